@@ -3,11 +3,31 @@
 #ifndef EXT4_H
 #define EXT4_H 1
 
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define EXT2_MAGIC      0xef53
 #define EXT2_ROOT_INODE 2
 
+#define EXT2_BCACHE_MIN_BLOCKS     16
+#define EXT2_BCACHE_DEFAULT_BLOCKS 256
+
+#define EXT2_ICACHE_BUCKETS     1024
+#define EXT2_ICACHE_SLAB_INODES 64
+#define EXT2_ICACHE_MAX_UNUSED  1024
+
+#define EXT2_DCACHE_ENTRIES  4096
+#define EXT2_DCACHE_NAME_LEN 54
+
+#define EXT2_SCAN_CHUNK (1 << 20)
+
+#define EXT2_READ_RUNS 64
+
+#define EXT2_PREFETCH_BLOCKS 64
+
+#define EXT2_ARENA_CHUNK (64 << 10)
+
 typedef enum
 {
   EXT2_FS_STATE_VALID = 1,
@@ -46,6 +66,22 @@ typedef enum
   EXT2_RDO_FLAG_DIRS_USE_BINARY_TREE = 0x4,
 } ext2_rdonly_flag_t;
 
+typedef enum
+{
+  EXT2_SB_FLAG_SIGNED_HASH = 0x1,
+  EXT2_SB_FLAG_UNSIGNED_HASH = 0x2,
+} ext2_sb_flag_t;
+
+typedef enum
+{
+  EXT2_HASH_LEGACY = 0,
+  EXT2_HASH_HALF_MD4 = 1,
+  EXT2_HASH_TEA = 2,
+  EXT2_HASH_LEGACY_UNSIGNED = 3,
+  EXT2_HASH_HALF_MD4_UNSIGNED = 4,
+  EXT2_HASH_TEA_UNSIGNED = 5
+} ext2_hash_ver_t;
+
 typedef enum
 {
   EXT2_INODE_PERM_OEXEC = 0x1,
@@ -69,9 +105,9 @@ typedef enum
   EXT2_INODE_FLAG_APPEND_ONLY = 0x20,
   EXT2_INODE_FLAG_EXCL_DUMP = 0x40,
   EXT2_INODE_FLAG_NO_UPDATE_LAST_ACC = 0x80,
-  EXT2_INODE_FLAG_HASH_IDX_DIR = 0x10000,
-  EXT2_INODE_FLAG_AFS_DIR = 0x20000,
-  EXT2_INODE_FLAG_JOURNAL_FDATA = 0x40000
+  EXT2_INODE_FLAG_HASH_IDX_DIR = 0x1000,
+  EXT2_INODE_FLAG_AFS_DIR = 0x2000,
+  EXT2_INODE_FLAG_JOURNAL_FDATA = 0x4000
 } ext2_inode_flags_t;
 
 typedef enum
@@ -134,6 +170,14 @@ typedef struct
   uint8_t align2[3];
   uint32_t def_mnt_opts;
   uint32_t first_meta_bg;
+  uint32_t mkfs_time;
+  uint32_t journal_blocks[17];
+  uint32_t block_cnt_hi;
+  uint32_t su_block_cnt_hi;
+  uint32_t free_block_cnt_hi;
+  uint16_t min_extra_isize;
+  uint16_t want_extra_isize;
+  uint32_t flags;
 } ext2_sb_t;
 
 typedef struct
@@ -143,10 +187,22 @@ typedef struct
   uint32_t inode_table;
   uint16_t num_free_blks;
   uint16_t num_free_inodes;
-  uint16_t pad;
+  uint16_t num_dirs;
   uint8_t res[12];
 } ext2_bgdt_t;
 
+typedef enum
+{
+  EXT2_FT_UNKN = 0,
+  EXT2_FT_REG_FILE = 1,
+  EXT2_FT_DIR = 2,
+  EXT2_FT_CHR_DEV = 3,
+  EXT2_FT_BLK_DEV = 4,
+  EXT2_FT_FIFO = 5,
+  EXT2_FT_SOCK = 6,
+  EXT2_FT_SYM_LINK = 7
+} ext2_ft_t;
+
 typedef struct
 {
   uint16_t mode;
@@ -169,6 +225,152 @@ typedef struct
   uint8_t os_res2[12];
 } ext2_inode_t;
 
+typedef struct
+{
+  uint32_t block;
+  uint32_t next; /* hash chain */
+  uint16_t pins;
+  uint8_t valid;
+  uint8_t ref;   /* CLOCK reference bit */
+  uint8_t dirty; /* newer than the image, written back on eviction or sync */
+} ext2_bcache_ent_t;
+
+typedef struct
+{
+  size_t nents;
+  size_t nbuckets;
+  size_t hand;
+  uint32_t *buckets;
+  ext2_bcache_ent_t *ents;
+  unsigned char *data;
+  size_t ndirty;
+  size_t hits;
+  size_t misses;
+} ext2_bcache_t;
+
+typedef struct
+{
+  uint32_t inode;
+  uint16_t rec_len;
+  uint8_t name_len;
+  uint8_t file_type; /* high byte of name_len without the filetype feature */
+  char name[];
+} ext2_dirent_t;
+
+#define EXT2_INODE_TYPE(mode) ((mode) & 0xf000)
+
+#define EXT2_DIRENT_MIN_LEN 8
+#define EXT2_NAME_MAX       255
+
+typedef struct
+{
+  uint32_t reserved_zero;
+  uint8_t hash_ver;
+  uint8_t info_len;
+  uint8_t indirect_levels;
+  uint8_t unused_flags;
+} ext2_dx_root_info_t;
+
+typedef struct
+{
+  uint16_t limit;
+  uint16_t count;
+} ext2_dx_countlimit_t;
+
+typedef struct
+{
+  uint32_t hash; /* overlaid by ext2_dx_countlimit_t in the first entry */
+  uint32_t block;
+} ext2_dx_entry_t;
+
+#define EXT2_DX_MAX_LEVELS 3
+
+#define EXT2_NDIR_BLOCKS 12
+#define EXT2_IND_BLOCK   12
+#define EXT2_DIND_BLOCK  13
+#define EXT2_TIND_BLOCK  14
+
+typedef struct
+{
+  size_t lblk;
+  uint32_t pblk; /* 0 for a hole */
+  size_t len;
+} ext2_run_t;
+
+typedef struct ext2_icache_ent
+{
+  ext2_inode_t inode; /* must be first, handed out as ext2_inode_t * */
+  uint32_t ino;
+  uint32_t refcnt;
+  struct ext2_icache_ent *hnext;
+  /* unused list while refcnt is 0, free list while ino is 0 */
+  struct ext2_icache_ent *prev;
+  struct ext2_icache_ent *next;
+} ext2_icache_ent_t;
+
+typedef struct
+{
+  ext2_icache_ent_t ents[EXT2_ICACHE_SLAB_INODES];
+} ext2_icache_slab_t;
+
+typedef struct
+{
+  ext2_icache_ent_t *buckets[EXT2_ICACHE_BUCKETS];
+  ext2_icache_ent_t *free;
+  ext2_icache_ent_t *unused_head; /* least recently released */
+  ext2_icache_ent_t *unused_tail;
+  size_t nunused;
+  size_t hits;
+  size_t misses;
+} ext2_icache_t;
+
+typedef struct
+{
+  uint32_t parent;
+  uint32_t ino; /* 0 for a name known to be missing */
+  uint32_t hash;
+  uint32_t next; /* hash chain */
+  uint8_t len;
+  uint8_t ref; /* CLOCK reference bit */
+  char name[EXT2_DCACHE_NAME_LEN];
+} ext2_dcache_ent_t;
+
+typedef struct
+{
+  size_t nents;
+  size_t nbuckets;
+  size_t hand;
+  uint32_t *buckets;
+  ext2_dcache_ent_t *ents;
+  size_t hits;
+  size_t neg_hits;
+  size_t misses;
+} ext2_dcache_t;
+
+typedef struct ext2_arena_chunk
+{
+  struct ext2_arena_chunk *prev;
+  size_t size;
+  size_t used;
+  max_align_t data[];
+} ext2_arena_chunk_t;
+
+/*
+ * Bump allocator for objects that all go away together. Nothing is freed
+ * on its own; ext2_arena_release drops everything allocated since a mark
+ * and ext2_arena_fini the rest. Not locked.
+ */
+typedef struct
+{
+  ext2_arena_chunk_t *head;
+} ext2_arena_t;
+
+typedef struct
+{
+  ext2_arena_chunk_t *chunk;
+  size_t used;
+} ext2_arena_mark_t;
+
 typedef struct
 {
   size_t block_group_cnt;
@@ -178,12 +380,114 @@ typedef struct
   ext2_sb_t *sb;
   size_t bgdt_size;
   ext2_bgdt_t *bgdt;
+  int sb_dirty;   /* the in-memory superblock and BGDT differ from the */
+  int bgdt_dirty; /* image until the next ext2_fs_sync */
   ext2_inode_t *root_inode;
   file_t *file;
+  ext2_bcache_t bcache;
+  ext2_icache_t icache;
+  ext2_dcache_t dcache;
+  /*
+   * Serializes everything above but the free counts in the superblock and
+   * the BGDT, which the allocator updates atomically. Held by ext2_namei
+   * and the ext2 file operations, which may be used from several threads;
+   * data transfers run with it dropped.
+   */
+  pthread_mutex_t lock;
+  int has_lock;
+  /*
+   * One per block group, held by the allocator around that group's bitmaps
+   * and descriptor. The lock above may already be held when one is taken,
+   * but is never taken while holding one.
+   */
+  pthread_mutex_t *group_locks;
+  size_t ngroup_locks; /* initialized so far */
+  /*
+   * Holds this structure, the superblock, the BGDT, the dentry cache and
+   * the inode slabs, all released at once by ext2_fs_fini. Serialized by
+   * the lock like the caches.
+   */
+  ext2_arena_t arena;
   fs_t fs;
 } ext2_fs_t;
 
+void ext2_arena_init (ext2_arena_t *arena);
+void ext2_arena_fini (ext2_arena_t *arena);
+void *ext2_arena_alloc (ext2_arena_t *arena, size_t nbytes);
+char *ext2_arena_strdup (ext2_arena_t *arena, const char *str);
+ext2_arena_mark_t ext2_arena_mark (const ext2_arena_t *arena);
+void ext2_arena_release (ext2_arena_t *arena, ext2_arena_mark_t mark);
+
 fs_t *ext2_fs_init (file_t *file, fs_init_error_t *error);
 void ext2_fs_fini (fs_t *fs);
+int ext2_fs_sync (ext2_fs_t *fs);
+
+int ext2_fs_set_bcache_size (ext2_fs_t *fs, size_t nblocks);
+
+ext2_inode_t *ext2_inode_get (ext2_fs_t *fs, uint32_t ino);
+ext2_inode_t *ext2_inode_dup (ext2_inode_t *inode);
+void ext2_inode_put (ext2_fs_t *fs, ext2_inode_t *inode);
+uint32_t ext2_inode_ino (ext2_inode_t *inode);
+void ext2_inode_prefetch (ext2_fs_t *fs, const uint32_t *inos, size_t ninos);
+
+uint64_t ext2_inode_get_size (ext2_fs_t *fs, const ext2_inode_t *inode);
+file_type_t ext2_inode_get_type (const ext2_inode_t *inode);
+
+int ext2_bmap (ext2_fs_t *fs, const ext2_inode_t *inode, size_t lblk,
+               uint32_t *pblk);
+ssize_t ext2_map_runs (ext2_fs_t *fs, const ext2_inode_t *inode, size_t lblk,
+                       size_t nblks, ext2_run_t *runs, size_t *nruns);
+int ext2_lookup (ext2_fs_t *fs, const ext2_inode_t *dir, const char *name,
+                 size_t len, uint32_t *ino);
+int ext2_namei (ext2_fs_t *fs, const char *path, uint32_t *ino);
+
+file_t *ext2_file_open (ext2_fs_t *fs, uint32_t ino);
+file_t *ext2_file_create (ext2_fs_t *fs, uint32_t dir_ino, const char *name,
+                          uint16_t mode);
+file_t *ext2_file_create_in (ext2_fs_t *fs, uint32_t dir_ino,
+                             const char *name, uint16_t mode, size_t group);
+int ext2_file_reserve (file_t *file, uint64_t nbytes);
+uint32_t ext2_file_ino (file_t *file);
+
+int ext2_mkdir (ext2_fs_t *fs, uint32_t dir_ino, const char *name,
+                uint16_t mode, uint32_t *ino);
+int ext2_symlink (ext2_fs_t *fs, uint32_t dir_ino, const char *name,
+                  const char *target, uint32_t *ino);
+int ext2_mknod (ext2_fs_t *fs, uint32_t dir_ino, const char *name,
+                uint16_t mode, uint32_t major, uint32_t minor, uint32_t *ino);
+int ext2_link (ext2_fs_t *fs, uint32_t dir_ino, const char *name,
+               uint32_t ino);
+int ext2_setattr (ext2_fs_t *fs, uint32_t ino, uint16_t perm, uint32_t uid,
+                  uint32_t gid, uint32_t mtime);
+
+typedef int (*ext2_inode_iter_t) (ext2_fs_t *fs, uint32_t ino,
+                                  const ext2_inode_t *inode, void *arg);
+
+int ext2_scan_group (ext2_fs_t *fs, size_t group, ext2_inode_iter_t iter,
+                     void *arg);
+int ext2_scan_inodes (ext2_fs_t *fs, ext2_inode_iter_t iter, void *arg);
+
+typedef int (*ext2_block_iter_t) (ext2_fs_t *fs, uint32_t block,
+                                  size_t depth, void *arg);
+
+int ext2_walk_blocks (ext2_fs_t *fs, const ext2_inode_t *inode,
+                      ext2_block_iter_t iter, void *arg);
+
+/* what a group's bitmaps say about it */
+typedef struct
+{
+  size_t nblocks;
+  size_t used_blocks;
+  size_t ninodes;
+  size_t used_inodes;
+} ext2_group_count_t;
+
+int ext2_count_group (ext2_fs_t *fs, size_t group, ext2_group_count_t *count);
+int ext2_group_has_super (uint32_t rdo_flags, size_t group);
+
+typedef int (*ext2_group_iter_t) (ext2_fs_t *fs, size_t group, void *arg);
+
+int ext2_for_each_group (ext2_fs_t *fs, long jobs, ext2_group_iter_t iter,
+                         void *arg);
 
 #endif
\ No newline at end of file
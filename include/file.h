@@ -27,7 +27,9 @@ typedef enum
 {
   FILE_ORDONLY = (1 << 0),
   FILE_OWRONLY = (1 << 1),
-  FILE_ORDWR = (1 << 2)
+  FILE_ORDWR = (1 << 2),
+  FILE_OCREAT = (1 << 3),
+  FILE_OTRUNC = (1 << 4)
 } file_oflags_t;
 
 typedef enum
@@ -37,20 +39,52 @@ typedef enum
   FILE_SEEK_END
 } file_seek_t;
 
+typedef enum
+{
+  FILE_IO_READ,
+  FILE_IO_WRITE
+} file_io_op_t;
+
+/* one request of a batch handed to file_submit */
+typedef struct
+{
+  file_io_op_t op;
+  void *buf;
+  size_t nbytes;
+  size_t off;
+  ssize_t res; /* bytes transferred, -1 on error */
+} file_io_t;
+
 typedef struct file
 {
   struct dir *(*opendir) (struct file *file);
   int (*get_type) (struct file *file, file_type_t *type);
   int (*get_size) (struct file *file, size_t *size);
+  int (*set_size) (struct file *file, size_t size);
   int (*seek) (struct file *file, size_t off, file_seek_t seek);
   ssize_t (*read) (struct file *file, void *buf, size_t nbytes);
   ssize_t (*write) (struct file *file, const void *buf, size_t nbytes);
+  /* positional variants, these leave the file offset alone */
+  ssize_t (*pread) (struct file *file, void *buf, size_t nbytes, size_t off);
+  ssize_t (*pwrite) (struct file *file, const void *buf, size_t nbytes,
+                     size_t off);
+  /* borrow a pointer to [off, off + nbytes) without copying; optional */
+  const void *(*map) (struct file *file, size_t off, size_t nbytes);
+  /* in-kernel copy to another file, without a bounce buffer; optional */
+  ssize_t (*copy_range) (struct file *file, size_t off, struct file *dst,
+                         size_t dst_off, size_t nbytes);
+  /* have a batch of requests in flight at once; optional */
+  int (*submit) (struct file *file, file_io_t *ios, size_t nios);
+  /* find the next data extent at or after off, skipping holes; optional */
+  int (*next_data) (struct file *file, size_t off, size_t *data,
+                    size_t *hole);
   void (*close) (struct file *file);
 } file_t;
 
 typedef struct dentry
 {
   file_type_t type;
+  size_t ino; /* 0 if the backend has no notion of inode numbers */
   char *name;
 } dentry_t;
 
@@ -62,6 +96,14 @@ typedef struct dir
 } dir_t;
 
 file_t *file_open (const char *name, file_oflags_t flags);
+file_t *file_open_mmap (const char *name, file_oflags_t flags);
+file_t *file_open_uring (const char *name, file_oflags_t flags);
+file_t *file_open_sparse (file_t *file);
+file_t *file_open_maybe_sparse (file_t *file);
+
+/* shared by the backends that sit on a descriptor */
+int file_fd_next_data (int fd, size_t off, size_t *data, size_t *hole);
+size_t file_fd_submit_run (int fd, file_io_t *ios, size_t nios, int *ret);
 
 __always_inline static dir_t *
 file_open_dir (file_t *file)
@@ -96,6 +138,17 @@ file_get_size (file_t *file, size_t *size)
   return file->get_size (file, size);
 }
 
+__always_inline static int
+file_set_size (file_t *file, size_t size)
+{
+  if (file->set_size == NULL)
+    {
+      errno = -ENOSYS;
+      return -1;
+    }
+  return file->set_size (file, size);
+}
+
 __always_inline static int
 file_seek (file_t *file, size_t off, file_seek_t origin)
 {
@@ -118,12 +171,31 @@ file_read (file_t *file, void *buf, size_t nbytes)
   return file->read (file, buf, nbytes);
 }
 
+__always_inline static ssize_t
+file_pread (file_t *file, void *buf, size_t nbytes, size_t off)
+{
+  if (file->pread == NULL)
+    {
+      errno = -ENOSYS;
+      return -1;
+    }
+  return file->pread (file, buf, nbytes, off);
+}
+
 __always_inline static ssize_t
 file_sread (file_t *file, size_t off, file_seek_t origin, void *buf,
             size_t nbytes)
 {
   ssize_t read;
 
+  /* one syscall instead of two when the backend can do it */
+  if (origin == FILE_SEEK_START && file->pread != NULL)
+    {
+      if ((read = file->pread (file, buf, nbytes, off)) == -1)
+        return -2;
+      return read;
+    }
+
   if (file_seek (file, off, origin) == -1)
     return -1;
 
@@ -145,12 +217,30 @@ file_write (file_t *file, const void *buf, size_t nbytes)
   return file->write (file, buf, nbytes);
 }
 
+__always_inline static ssize_t
+file_pwrite (file_t *file, const void *buf, size_t nbytes, size_t off)
+{
+  if (file->pwrite == NULL)
+    {
+      errno = -ENOSYS;
+      return -1;
+    }
+  return file->pwrite (file, buf, nbytes, off);
+}
+
 __always_inline static ssize_t
 file_swrite (file_t *file, size_t off, file_seek_t origin, const void *buf,
              size_t nbytes)
 {
   ssize_t write;
 
+  if (origin == FILE_SEEK_START && file->pwrite != NULL)
+    {
+      if ((write = file->pwrite (file, buf, nbytes, off)) == -1)
+        return -2;
+      return write;
+    }
+
   if (file_seek (file, off, origin) == -1)
     return -1;
 
@@ -160,6 +250,73 @@ file_swrite (file_t *file, size_t off, file_seek_t origin, const void *buf,
   return write;
 }
 
+__always_inline static const void *
+file_map (file_t *file, size_t off, size_t nbytes)
+{
+  if (file->map == NULL)
+    {
+      errno = -ENOSYS;
+      return NULL;
+    }
+  return file->map (file, off, nbytes);
+}
+
+__always_inline static ssize_t
+file_copy_range (file_t *file, size_t off, file_t *dst, size_t dst_off,
+                 size_t nbytes)
+{
+  if (file->copy_range == NULL)
+    {
+      errno = -ENOSYS;
+      return -1;
+    }
+  return file->copy_range (file, off, dst, dst_off, nbytes);
+}
+
+/*
+ * Runs a batch of reads and writes and waits for all of them to finish.
+ * Without a submit operation they are simply done one after another. Each
+ * request gets its own result; the return is -1 if any of them failed or
+ * came up short.
+ */
+__always_inline static int
+file_submit (file_t *file, file_io_t *ios, size_t nios)
+{
+  int ret = 0;
+
+  if (file->submit != NULL)
+    return file->submit (file, ios, nios);
+
+  for (size_t i = 0; i < nios; i++)
+    {
+      if (ios[i].op == FILE_IO_READ)
+        ios[i].res = file_pread (file, ios[i].buf, ios[i].nbytes, ios[i].off);
+      else
+        ios[i].res = file_pwrite (file, ios[i].buf, ios[i].nbytes, ios[i].off);
+
+      if (ios[i].res != (ssize_t) ios[i].nbytes)
+        ret = -1;
+    }
+
+  return ret;
+}
+
+/*
+ * Sets [*data, *hole) to the first extent at or after off that holds data.
+ * Anything between off and *data reads back as zeros without taking up
+ * space. Past the last extent both are set to the end of the file.
+ */
+__always_inline static int
+file_next_data (file_t *file, size_t off, size_t *data, size_t *hole)
+{
+  if (file->next_data == NULL)
+    {
+      errno = -ENOSYS;
+      return -1;
+    }
+  return file->next_data (file, off, data, hole);
+}
+
 __always_inline static void
 file_close (file_t *file)
 {
@@ -0,0 +1,54 @@
+#ifndef STATS_H
+#define STATS_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "file.h"
+
+/* latency buckets, bucket i counts operations that took under 2^i ns */
+#define STATS_NBUCKETS 32
+
+typedef enum
+{
+  STATS_OP_READ,
+  STATS_OP_WRITE,
+  STATS_OP_SEEK,
+  STATS_OP_MAP,
+  STATS_OP_COPY, /* copy_range */
+  STATS_OP_SUBMIT,
+  STATS_NOPS
+} stats_op_t;
+
+typedef enum
+{
+  STATS_FORMAT_TEXT,
+  STATS_FORMAT_JSON
+} stats_format_t;
+
+typedef struct
+{
+  uint64_t nops;
+  uint64_t nbytes;
+  uint64_t ns;
+  uint64_t hist[STATS_NBUCKETS];
+} stats_counters_t;
+
+/*
+ * Counters for every file opened on them, updated atomically so threads
+ * can share one set. Reads and writes batched through submit count towards
+ * their own op, but their time goes to the submit.
+ */
+typedef struct
+{
+  stats_counters_t ops[STATS_NOPS];
+  uint64_t njumps; /* positioned reads and writes not following the last */
+} stats_t;
+
+file_t *file_open_stats (file_t *file, stats_t *stats);
+
+void stats_report (FILE *out, const char *const *names,
+                   const stats_t *const *stats, size_t nstats,
+                   stats_format_t format);
+
+#endif
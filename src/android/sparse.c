@@ -0,0 +1,468 @@
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file.h"
+
+#define SPARSE_FILE(file) sparse_file_t *sparse_file = (sparse_file_t *) (file)
+
+#define SPARSE_MAGIC          0xed26ff3a
+#define SPARSE_MAJOR_VER      1
+#define SPARSE_HDR_SIZE       28
+#define SPARSE_CHUNK_HDR_SIZE 12
+
+#define SPARSE_CHUNK_RAW       0xcac1
+#define SPARSE_CHUNK_FILL      0xcac2
+#define SPARSE_CHUNK_DONT_CARE 0xcac3
+#define SPARSE_CHUNK_CRC32     0xcac4
+
+/* all fields little-endian */
+typedef struct
+{
+  uint32_t magic;
+  uint16_t major_ver;
+  uint16_t minor_ver;
+  uint16_t file_hdr_size;
+  uint16_t chunk_hdr_size;
+  uint32_t block_size;
+  uint32_t total_blocks;
+  uint32_t total_chunks;
+  uint32_t checksum;
+} __attribute__ ((packed)) sparse_header_t;
+
+typedef struct
+{
+  uint16_t type;
+  uint16_t reserved;
+  uint32_t nblocks; /* output blocks covered */
+  uint32_t total_size; /* header included */
+} __attribute__ ((packed)) sparse_chunk_header_t;
+
+/* one entry per raw, fill or don't care chunk, in output order */
+typedef struct
+{
+  uint64_t off; /* in the expanded image */
+  uint64_t len;
+  uint64_t src_off; /* raw only: where the data sits in the sparse file */
+  uint32_t fill; /* fill only: pattern repeated over the chunk */
+  uint16_t type;
+} sparse_chunk_t;
+
+/*
+ * Presents an Android sparse image as the full image it expands to. The
+ * chunk headers are read once into an index sorted by output offset; a read
+ * finds its chunk by binary search and is served from the raw data in the
+ * underlying file, a fill pattern or zeros. Read only.
+ */
+typedef struct
+{
+  file_t base;
+  file_t *file; /* the sparse image, owned */
+  sparse_chunk_t *chunks;
+  size_t nchunks;
+  size_t size;
+  size_t off;
+} sparse_file_t;
+
+static int sparse_file_get_type (file_t *file, file_type_t *type);
+static int sparse_file_get_size (file_t *file, size_t *size);
+static int sparse_file_seek (file_t *file, size_t off, file_seek_t origin);
+static ssize_t sparse_file_read (file_t *file, void *buf, size_t nbytes);
+static ssize_t sparse_file_pread (file_t *file, void *buf, size_t nbytes,
+                                  size_t off);
+static const void *sparse_file_map (file_t *file, size_t off, size_t nbytes);
+static ssize_t sparse_file_copy_range (file_t *file, size_t off, file_t *dst,
+                                       size_t dst_off, size_t nbytes);
+static int sparse_file_next_data (file_t *file, size_t off, size_t *data,
+                                  size_t *hole);
+static void sparse_file_close (file_t *file);
+
+static int
+sparse_read_index (sparse_file_t *sparse_file, const sparse_header_t *hdr)
+{
+  size_t block_size = le32toh (hdr->block_size);
+  size_t src_off = le16toh (hdr->file_hdr_size);
+  size_t chunk_hdr_size = le16toh (hdr->chunk_hdr_size);
+  size_t total_chunks = le32toh (hdr->total_chunks);
+  uint64_t off = 0;
+
+  sparse_file->chunks = malloc ((total_chunks + 1) * sizeof (sparse_chunk_t));
+  if (sparse_file->chunks == NULL)
+    {
+      errno = -ENOMEM;
+      return -1;
+    }
+
+  for (size_t i = 0; i < total_chunks; i++)
+    {
+      sparse_chunk_t *chunk = sparse_file->chunks + sparse_file->nchunks;
+      sparse_chunk_header_t chdr;
+      uint64_t len, data_size;
+
+      if (file_pread (sparse_file->file, &chdr, sizeof (chdr), src_off)
+          != sizeof (chdr))
+        goto invalid;
+
+      len = (uint64_t) le32toh (chdr.nblocks) * block_size;
+      data_size = le32toh (chdr.total_size);
+      if (data_size < chunk_hdr_size)
+        goto invalid;
+
+      data_size -= chunk_hdr_size;
+      src_off += chunk_hdr_size;
+
+      chunk->off = off;
+      chunk->len = len;
+      chunk->type = le16toh (chdr.type);
+
+      switch (chunk->type)
+        {
+        case SPARSE_CHUNK_RAW:
+          if (data_size != len)
+            goto invalid;
+          chunk->src_off = src_off;
+          break;
+        case SPARSE_CHUNK_FILL:
+          if (data_size != sizeof (uint32_t)
+              || file_pread (sparse_file->file, &chunk->fill,
+                             sizeof (uint32_t), src_off)
+                     != sizeof (uint32_t))
+            goto invalid;
+
+          /* kept in file byte order, it is copied out as bytes */
+          break;
+        case SPARSE_CHUNK_DONT_CARE:
+          if (data_size)
+            goto invalid;
+          break;
+        case SPARSE_CHUNK_CRC32:
+          /* covers no output, the checksum isn't verified */
+          src_off += data_size;
+          continue;
+        default:
+          goto invalid;
+        }
+
+      src_off += data_size;
+
+      /* empty chunks would only get in the way of the search */
+      if (len)
+        {
+          off += len;
+          sparse_file->nchunks++;
+        }
+    }
+
+  if (off != (uint64_t) le32toh (hdr->total_blocks) * block_size)
+    goto invalid;
+
+  sparse_file->size = off;
+  return 0;
+
+invalid:
+  errno = -EBADMSG;
+  return -1;
+}
+
+/*
+ * Opens the sparse image in file on top of it. On success the returned file
+ * owns file and closes it. Otherwise file is left to the caller: errno is
+ * -EINVAL if it holds no sparse image at all, -EBADMSG if it is malformed.
+ */
+file_t *
+file_open_sparse (file_t *file)
+{
+  sparse_file_t *sparse_file;
+  sparse_header_t hdr;
+
+  if (file_pread (file, &hdr, sizeof (hdr), 0) != sizeof (hdr))
+    {
+      errno = -EINVAL;
+      return NULL;
+    }
+
+  if (le32toh (hdr.magic) != SPARSE_MAGIC)
+    {
+      errno = -EINVAL;
+      return NULL;
+    }
+
+  if (le16toh (hdr.major_ver) != SPARSE_MAJOR_VER
+      || le16toh (hdr.file_hdr_size) < SPARSE_HDR_SIZE
+      || le16toh (hdr.chunk_hdr_size) < SPARSE_CHUNK_HDR_SIZE
+      || !le32toh (hdr.block_size) || le32toh (hdr.block_size) % 4)
+    {
+      errno = -EBADMSG;
+      return NULL;
+    }
+
+  sparse_file = malloc (sizeof (sparse_file_t));
+  if (sparse_file == NULL)
+    {
+      errno = -ENOMEM;
+      return NULL;
+    }
+
+  memset (sparse_file, 0, sizeof (sparse_file_t));
+
+  sparse_file->base.get_type = sparse_file_get_type;
+  sparse_file->base.get_size = sparse_file_get_size;
+  sparse_file->base.seek = sparse_file_seek;
+  sparse_file->base.read = sparse_file_read;
+  sparse_file->base.pread = sparse_file_pread;
+  sparse_file->base.map = sparse_file_map;
+  sparse_file->base.copy_range = sparse_file_copy_range;
+  sparse_file->base.next_data = sparse_file_next_data;
+  sparse_file->base.close = sparse_file_close;
+
+  sparse_file->file = file;
+
+  if (sparse_read_index (sparse_file, &hdr) == -1)
+    {
+      free (sparse_file->chunks);
+      free (sparse_file);
+      return NULL;
+    }
+
+  return &sparse_file->base;
+}
+
+/*
+ * Like file_open_sparse, but hands back file itself if it holds no sparse
+ * image, so callers can take any image as it comes. NULL only on a real
+ * failure, with file left to the caller: -EBADMSG for a malformed sparse
+ * image.
+ */
+file_t *
+file_open_maybe_sparse (file_t *file)
+{
+  file_t *sparse_file = file_open_sparse (file);
+
+  if (sparse_file == NULL && errno == -EINVAL)
+    return file;
+
+  return sparse_file;
+}
+
+/* index of the chunk holding off, which must be below the size */
+static size_t
+sparse_find_chunk (const sparse_file_t *sparse_file, size_t off)
+{
+  size_t lo = 0, hi = sparse_file->nchunks - 1;
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo + 1) / 2;
+
+      if (sparse_file->chunks[mid].off <= off)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+
+  return lo;
+}
+
+static int
+sparse_file_get_type (file_t *file, file_type_t *type)
+{
+  (void) file;
+  *type = FILE_TYPE_FILE;
+  return 0;
+}
+
+static int
+sparse_file_get_size (file_t *file, size_t *size)
+{
+  SPARSE_FILE (file);
+  *size = sparse_file->size;
+  return 0;
+}
+
+static int
+sparse_file_seek (file_t *file, size_t off, file_seek_t origin)
+{
+  SPARSE_FILE (file);
+
+  switch (origin)
+    {
+    case FILE_SEEK_START:
+      sparse_file->off = off;
+      break;
+    case FILE_SEEK_CUR:
+      sparse_file->off += off;
+      break;
+    case FILE_SEEK_END:
+      sparse_file->off = sparse_file->size + off;
+      break;
+    default:
+      errno = -EINVAL;
+      return -1;
+    }
+
+  return 0;
+}
+
+static ssize_t
+sparse_file_read (file_t *file, void *buf, size_t nbytes)
+{
+  SPARSE_FILE (file);
+  ssize_t read = sparse_file_pread (file, buf, nbytes, sparse_file->off);
+
+  if (read > 0)
+    sparse_file->off += read;
+
+  return read;
+}
+
+static ssize_t
+sparse_file_pread (file_t *file, void *buf, size_t nbytes, size_t off)
+{
+  SPARSE_FILE (file);
+  unsigned char *dst = buf;
+  size_t done = 0, idx;
+
+  if (off >= sparse_file->size)
+    return 0;
+
+  if (nbytes > sparse_file->size - off)
+    nbytes = sparse_file->size - off;
+
+  for (idx = sparse_find_chunk (sparse_file, off); done < nbytes; idx++)
+    {
+      const sparse_chunk_t *chunk = sparse_file->chunks + idx;
+      size_t at = off + done - chunk->off;
+      size_t n = chunk->len - at;
+
+      if (n > nbytes - done)
+        n = nbytes - done;
+
+      switch (chunk->type)
+        {
+        case SPARSE_CHUNK_RAW:
+          if (file_pread (sparse_file->file, dst + done, n,
+                          chunk->src_off + at)
+              != (ssize_t) n)
+            return done ? (ssize_t) done : -1;
+          break;
+        case SPARSE_CHUNK_FILL:
+          {
+            const unsigned char *fill
+                = (const unsigned char *) &chunk->fill;
+
+            /* chunks start block aligned, so the pattern phase is off % 4 */
+            for (size_t i = 0; i < n; i++)
+              dst[done + i] = fill[(at + i) % 4];
+            break;
+          }
+        default:
+          memset (dst + done, 0, n);
+        }
+
+      done += n;
+    }
+
+  return done;
+}
+
+static const void *
+sparse_file_map (file_t *file, size_t off, size_t nbytes)
+{
+  SPARSE_FILE (file);
+  const sparse_chunk_t *chunk;
+
+  if (off >= sparse_file->size)
+    {
+      errno = -EINVAL;
+      return NULL;
+    }
+
+  /* only raw data exists to be borrowed, and only within one chunk */
+  chunk = sparse_file->chunks + sparse_find_chunk (sparse_file, off);
+  if (chunk->type != SPARSE_CHUNK_RAW || nbytes > chunk->off + chunk->len - off)
+    {
+      errno = -EINVAL;
+      return NULL;
+    }
+
+  return file_map (sparse_file->file, chunk->src_off + off - chunk->off,
+                   nbytes);
+}
+
+/* raw data goes straight through, stopping short at the end of its chunk */
+static ssize_t
+sparse_file_copy_range (file_t *file, size_t off, file_t *dst, size_t dst_off,
+                        size_t nbytes)
+{
+  SPARSE_FILE (file);
+  const sparse_chunk_t *chunk;
+
+  if (off >= sparse_file->size)
+    return 0;
+
+  chunk = sparse_file->chunks + sparse_find_chunk (sparse_file, off);
+  if (chunk->type != SPARSE_CHUNK_RAW)
+    {
+      errno = -EINVAL;
+      return -1;
+    }
+
+  if (nbytes > chunk->off + chunk->len - off)
+    nbytes = chunk->off + chunk->len - off;
+
+  return file_copy_range (sparse_file->file, chunk->src_off + off - chunk->off,
+                          dst, dst_off, nbytes);
+}
+
+/* zero fills and don't care chunks are holes, everything else data */
+static int
+sparse_file_next_data (file_t *file, size_t off, size_t *data, size_t *hole)
+{
+  SPARSE_FILE (file);
+  size_t idx;
+
+  if (off >= sparse_file->size)
+    {
+      *data = *hole = off;
+      return 0;
+    }
+
+  idx = sparse_find_chunk (sparse_file, off);
+
+  while (idx < sparse_file->nchunks
+         && (sparse_file->chunks[idx].type == SPARSE_CHUNK_DONT_CARE
+             || (sparse_file->chunks[idx].type == SPARSE_CHUNK_FILL
+                 && !sparse_file->chunks[idx].fill)))
+    idx++;
+
+  if (idx == sparse_file->nchunks)
+    {
+      *data = *hole = sparse_file->size;
+      return 0;
+    }
+
+  *data = sparse_file->chunks[idx].off > off ? sparse_file->chunks[idx].off
+                                             : off;
+
+  while (idx < sparse_file->nchunks
+         && (sparse_file->chunks[idx].type == SPARSE_CHUNK_RAW
+             || (sparse_file->chunks[idx].type == SPARSE_CHUNK_FILL
+                 && sparse_file->chunks[idx].fill)))
+    idx++;
+
+  *hole = idx == sparse_file->nchunks ? sparse_file->size
+                                      : sparse_file->chunks[idx].off;
+  return 0;
+}
+
+static void
+sparse_file_close (file_t *file)
+{
+  SPARSE_FILE (file);
+
+  file_close (sparse_file->file);
+  free (sparse_file->chunks);
+  free (sparse_file);
+}
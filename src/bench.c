@@ -0,0 +1,291 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define USE_ESCAPE_SEQUENCES
+
+#ifdef USE_ESCAPE_SEQUENCES
+
+#define ESC_RESET "\033[0m"
+#define ESC_BOLD  "\033[1m"
+#define ESC_RED   "\033[31m"
+
+#else
+
+#define ESC_RESET
+#define ESC_BOLD
+#define ESC_RED
+
+#endif
+
+static const char *bench_cmd_name = "benchrun";
+
+typedef struct
+{
+  uint64_t nbytes; /* moved by the command, for throughput; 0 if unknown */
+  uint64_t nfiles;
+  int file_stats; /* COMMAND reports its file I/O as JSON on stderr */
+  int no_proc_io; /* COMMAND's I/O bypasses what /proc/PID/io counts */
+  char *const *cmd;
+} bench_params_t;
+
+/* counters the kernel keeps in /proc/PID/io */
+typedef struct
+{
+  uint64_t syscr; /* read-class syscalls: read, pread, readv, ... */
+  uint64_t syscw; /* write-class syscalls */
+  uint64_t rchar;
+  uint64_t wchar;
+} bench_io_t;
+
+static void
+fail (const char *fmt, ...)
+{
+  va_list args;
+
+  va_start (args, fmt);
+  fprintf (stderr, ESC_BOLD "%s: " ESC_RED "error: " ESC_RESET,
+           bench_cmd_name);
+  vfprintf (stderr, fmt, args);
+  fprintf (stderr, "\n");
+  va_end (args);
+
+  exit (2);
+}
+
+static void
+usage (void)
+{
+  printf ("Usage: %s [OPTION]... COMMAND [ARG]...\n", bench_cmd_name);
+  printf ("Run COMMAND once and print its cost as a JSON object.\n");
+  printf ("\n");
+  printf ("  -b BYTES  bytes COMMAND moves, to report throughput\n");
+  printf ("  -n FILES  files COMMAND handles, to report a file rate\n");
+  printf ("  -s        include the JSON object COMMAND writes to stderr, like "
+          "its\n            --stats=json report, as \"file_stats\"\n");
+  printf ("  -S        leave out the /proc/PID/io counters, for COMMANDs "
+          "doing\n            their I/O through io_uring\n");
+  printf ("  -h        display this help and exit\n");
+}
+
+static uint64_t
+bench_now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * The counters have to be read while the child is a zombie: waited for,
+ * but not yet reaped. By then every thread has folded its counts into the
+ * process totals.
+ */
+static int
+bench_read_io (pid_t pid, bench_io_t *io)
+{
+  char path[64], line[128];
+  FILE *f;
+
+  snprintf (path, sizeof (path), "/proc/%d/io", (int) pid);
+  f = fopen (path, "r");
+  if (f == NULL)
+    return -1;
+
+  while (fgets (line, sizeof (line), f) != NULL)
+    {
+      uint64_t n;
+
+      if (sscanf (line, "syscr: %" SCNu64, &n) == 1)
+        io->syscr = n;
+      else if (sscanf (line, "syscw: %" SCNu64, &n) == 1)
+        io->syscw = n;
+      else if (sscanf (line, "rchar: %" SCNu64, &n) == 1)
+        io->rchar = n;
+      else if (sscanf (line, "wchar: %" SCNu64, &n) == 1)
+        io->wchar = n;
+    }
+
+  fclose (f);
+  return 0;
+}
+
+/*
+ * Copies what COMMAND wrote to stderr through to ours, except for the line
+ * holding its JSON report, which goes into the result instead.
+ */
+static void
+bench_print_file_stats (FILE *err)
+{
+  char *line = NULL;
+  size_t len = 0;
+  ssize_t n;
+
+  rewind (err);
+  while ((n = getline (&line, &len, err)) != -1)
+    {
+      if (line[0] == '{' && n > 1 && line[n - 1] == '\n')
+        {
+          line[n - 1] = '\0';
+          printf (", \"file_stats\": %s", line);
+        }
+      else
+        fputs (line, stderr);
+    }
+
+  free (line);
+}
+
+static void
+bench_op (const bench_params_t *params)
+{
+  bench_io_t io = { 0 };
+  struct rusage ru;
+  uint64_t start, wall;
+  siginfo_t info;
+  int status, has_io;
+  FILE *err = NULL;
+  pid_t pid;
+
+  if (params->file_stats && (err = tmpfile ()) == NULL)
+    fail ("failed to create a file for the output of '%s'", params->cmd[0]);
+
+  start = bench_now_ns ();
+
+  pid = fork ();
+  if (pid == -1)
+    fail ("failed to fork");
+
+  if (!pid)
+    {
+      /* the listing isn't what's being measured, errors still show */
+      int null = open ("/dev/null", O_WRONLY);
+
+      if (null != -1)
+        dup2 (null, STDOUT_FILENO);
+
+      if (err != NULL)
+        dup2 (fileno (err), STDERR_FILENO);
+
+      execvp (params->cmd[0], params->cmd);
+      fprintf (stderr, "%s: cannot run '%s'\n", bench_cmd_name,
+               params->cmd[0]);
+      _exit (127);
+    }
+
+  if (waitid (P_PID, pid, &info, WEXITED | WNOWAIT) == -1)
+    fail ("failed to wait for '%s'", params->cmd[0]);
+
+  wall = bench_now_ns () - start;
+  has_io = !params->no_proc_io && bench_read_io (pid, &io) != -1;
+
+  if (wait4 (pid, &status, 0, &ru) == -1)
+    fail ("failed to wait for '%s'", params->cmd[0]);
+
+  printf ("{\"status\": %d, \"wall_ns\": %" PRIu64,
+          WIFEXITED (status) ? WEXITSTATUS (status) : 128 + WTERMSIG (status),
+          wall);
+  printf (", \"user_us\": %" PRIu64 ", \"sys_us\": %" PRIu64,
+          (uint64_t) ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec,
+          (uint64_t) ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec);
+  printf (", \"max_rss_kb\": %ld", ru.ru_maxrss);
+  printf (", \"minor_faults\": %ld, \"major_faults\": %ld", ru.ru_minflt,
+          ru.ru_majflt);
+  printf (", \"ctx_switches\": %ld", ru.ru_nvcsw + ru.ru_nivcsw);
+
+  if (has_io)
+    printf (", \"read_syscalls\": %" PRIu64 ", \"write_syscalls\": %" PRIu64
+            ", \"read_chars\": %" PRIu64 ", \"write_chars\": %" PRIu64,
+            io.syscr, io.syscw, io.rchar, io.wchar);
+
+  if (err != NULL)
+    {
+      bench_print_file_stats (err);
+      fclose (err);
+    }
+
+  if (params->nbytes)
+    printf (", \"bytes\": %" PRIu64 ", \"mb_per_s\": %.2f", params->nbytes,
+            wall ? params->nbytes * 1e3 / wall : 0.0);
+
+  if (params->nfiles)
+    printf (", \"files\": %" PRIu64 ", \"files_per_s\": %.1f",
+            params->nfiles, wall ? params->nfiles * 1e9 / wall : 0.0);
+
+  printf ("}\n");
+
+  if (!WIFEXITED (status) || WEXITSTATUS (status))
+    exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  bench_params_t params = { 0 };
+  int argn;
+
+  for (argn = 1; argn < argc && argv[argn][0] == '-'; argn++)
+    {
+      const char *arg = argv[argn];
+      char opt = arg[1];
+      uint64_t n;
+      char *end;
+
+      if (opt == 'h')
+        {
+          usage ();
+          exit (0);
+        }
+
+      if (opt == 's' || opt == 'S')
+        {
+          if (arg[2] != '\0')
+            fail ("invalid option '%s'", arg);
+
+          if (opt == 's')
+            params.file_stats = 1;
+          else
+            params.no_proc_io = 1;
+
+          continue;
+        }
+
+      if (opt != 'b' && opt != 'n')
+        fail ("invalid option '%c'", opt);
+
+      /* -bN or -b N */
+      if (arg[2] != '\0')
+        arg += 2;
+      else if (argn + 1 < argc)
+        arg = argv[++argn];
+      else
+        fail ("option '%c' requires an argument", opt);
+
+      n = strtoull (arg, &end, 10);
+      if (end == arg || *end != '\0')
+        fail ("invalid number: '%s'", arg);
+
+      if (opt == 'b')
+        params.nbytes = n;
+      else
+        params.nfiles = n;
+    }
+
+  if (argn == argc)
+    fail ("missing command operand");
+
+  params.cmd = argv + argn;
+  bench_op (&params);
+
+  return 0;
+}
@@ -0,0 +1,623 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ext2.h"
+#include "file.h"
+#include "fs.h"
+
+#define USE_ESCAPE_SEQUENCES
+
+#ifdef USE_ESCAPE_SEQUENCES
+
+#define ESC_RESET "\033[0m"
+#define ESC_BOLD  "\033[1m"
+#define ESC_RED   "\033[31m"
+
+#else
+
+#define ESC_RESET
+#define ESC_BOLD
+#define ESC_RED
+
+#endif
+
+/* cross-linked ranges reported, the rest are only counted */
+#define CHECK_MAX_CROSSLINKS 16
+
+static const char *check_cmd_name = "ext2check";
+
+typedef struct
+{
+  const char *img;
+  long jobs; /* 0 for one per online CPU */
+} check_params_t;
+
+/* consecutive blocks with one owner */
+typedef struct
+{
+  uint32_t start;
+  uint32_t len;
+  uint32_t ino; /* 0 for the filesystem's own metadata */
+} check_run_t;
+
+/* everything one worker found out about a group */
+typedef struct
+{
+  check_run_t *runs; /* sorted by start once the group is done */
+  size_t nruns;
+  size_t cap;
+  char *report; /* problems, printed in group order at the end */
+  size_t report_len;
+  FILE *out;
+  size_t nproblems;
+  size_t ninodes;
+  ext2_group_count_t count;
+  int counted;
+  /* the inode being walked */
+  uint32_t ino;
+  size_t nbad;
+  uint32_t first_bad;
+} check_group_t;
+
+static file_t *img_file = NULL;
+static fs_t *fs = NULL;
+static char *error_msg = NULL;
+static check_group_t *groups = NULL;
+static size_t *heap = NULL;
+static size_t check_ngroups = 0;
+
+static void
+cleanup (void)
+{
+  if (fs != NULL)
+    ext2_fs_fini (fs);
+
+  if (img_file != NULL)
+    file_close (img_file);
+
+  if (groups != NULL)
+    {
+      for (size_t i = 0; i < check_ngroups; i++)
+        {
+          if (groups[i].out != NULL)
+            fclose (groups[i].out);
+
+          free (groups[i].report);
+          free (groups[i].runs);
+        }
+
+      free (groups);
+    }
+
+  if (heap != NULL)
+    free (heap);
+
+  if (error_msg != NULL)
+    free (error_msg);
+
+  fs = NULL;
+  img_file = NULL;
+  groups = NULL;
+  heap = NULL;
+  error_msg = NULL;
+}
+
+static void
+fail (const char *fmt, ...)
+{
+  const char *internal_err = "formatting error";
+  char *msg = NULL;
+  int tmp, _errno;
+  va_list args;
+
+  va_start (args, fmt);
+  tmp = vasprintf (&msg, fmt, args);
+  _errno = errno;
+
+  cleanup ();
+
+  if (tmp == -1)
+    goto perror;
+
+  fprintf (stderr, ESC_BOLD "%s: " ESC_RED "error: " ESC_RESET "%s\n",
+           check_cmd_name, msg);
+
+  va_end (args);
+  exit (1);
+
+perror:
+  if (msg != NULL)
+    free (msg);
+
+  if (_errno == -ENOMEM)
+    internal_err = "out of memory";
+
+  fprintf (stderr, ESC_BOLD "%s: " ESC_RED "error:" ESC_RESET "%s\n",
+           check_cmd_name, internal_err);
+
+  exit (2);
+}
+
+static void
+usage (void)
+{
+  printf ("Usage: %s [OPTION]... IMAGE\n", check_cmd_name);
+  printf ("Check the block groups of IMAGE in parallel without changing "
+          "it.\n");
+  printf ("\n");
+  printf ("  -j N  check with N threads, default one per CPU\n");
+  printf ("  -h    display this help and exit\n");
+  printf ("\n");
+  printf ("Exits with 1 if a problem was found.\n");
+}
+
+/* a problem in a group, kept until every group is done */
+static void
+check_report (check_group_t *cg, const char *fmt, ...)
+{
+  va_list args;
+
+  cg->nproblems++;
+
+  if (cg->out == NULL)
+    cg->out = open_memstream (&cg->report, &cg->report_len);
+
+  va_start (args, fmt);
+  /* out of memory for the report, the problem still goes out */
+  vfprintf (cg->out != NULL ? cg->out : stdout, fmt, args);
+  va_end (args);
+}
+
+static int
+check_in_range (ext2_fs_t *ext2, uint32_t block, size_t n)
+{
+  return block >= ext2->sb->first_block && block < ext2->sb->block_cnt
+         && n <= ext2->sb->block_cnt - block;
+}
+
+static int
+check_add_run (check_group_t *cg, uint32_t start, uint32_t len, uint32_t ino)
+{
+  check_run_t *last = cg->nruns ? cg->runs + cg->nruns - 1 : NULL;
+
+  /* files are mostly contiguous, a run per extent keeps the merge small */
+  if (last != NULL && last->ino == ino && last->start + last->len == start)
+    {
+      last->len += len;
+      return 0;
+    }
+
+  if (cg->nruns == cg->cap)
+    {
+      size_t cap = cg->cap ? cg->cap * 2 : 64;
+      check_run_t *runs = realloc (cg->runs, cap * sizeof (check_run_t));
+
+      if (runs == NULL)
+        {
+          errno = -ENOMEM;
+          return -1;
+        }
+
+      cg->runs = runs;
+      cg->cap = cap;
+    }
+
+  cg->runs[cg->nruns].start = start;
+  cg->runs[cg->nruns].len = len;
+  cg->runs[cg->nruns].ino = ino;
+  cg->nruns++;
+
+  return 0;
+}
+
+static int
+check_block (ext2_fs_t *ext2, uint32_t block, size_t depth, void *arg)
+{
+  check_group_t *cg = arg;
+
+  (void) depth;
+
+  if (!check_in_range (ext2, block, 1))
+    {
+      if (!cg->nbad++)
+        cg->first_bad = block;
+      return 0;
+    }
+
+  return check_add_run (cg, block, 1, cg->ino);
+}
+
+static int
+check_inode (ext2_fs_t *ext2, uint32_t ino, const ext2_inode_t *inode,
+             void *arg)
+{
+  check_group_t *cg = arg;
+  int ret;
+
+  cg->ino = ino;
+  cg->nbad = 0;
+  cg->ninodes++;
+
+  if ((ret = ext2_walk_blocks (ext2, inode, check_block, cg)))
+    return ret;
+
+  if (cg->nbad)
+    check_report (cg,
+                  "inode %" PRIu32 ": %zu block pointers outside the "
+                  "filesystem, the first is %" PRIu32 "\n",
+                  ino, cg->nbad, cg->first_bad);
+
+  return 0;
+}
+
+static int
+check_run_cmp (const void *a, const void *b)
+{
+  const check_run_t *x = a, *y = b;
+
+  if (x->start != y->start)
+    return x->start < y->start ? -1 : 1;
+
+  return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+/*
+ * Checks one group's descriptor against its bitmaps and walks the blocks of
+ * its inodes. Group metadata is claimed like file blocks, so a file sharing
+ * a block with a bitmap or the inode table shows up as a cross-link later.
+ */
+static int
+check_group (ext2_fs_t *ext2, size_t group, void *arg)
+{
+  check_group_t *cg = groups + group;
+  const ext2_bgdt_t *bgdt = ext2->bgdt + group;
+  size_t first = ext2->sb->first_block + group * ext2->sb->blocks_per_group;
+  size_t itb = (ext2->sb->inodes_per_group * ext2->inode_size
+                + ext2->block_size - 1)
+               / ext2->block_size;
+  size_t gdt_blocks = (ext2->block_group_cnt * sizeof (ext2_bgdt_t)
+                       + ext2->block_size - 1)
+                      / ext2->block_size;
+  int ok = 1;
+
+  (void) arg;
+
+  /* the superblock copy and the BGDT behind it */
+  if (ext2_group_has_super (ext2->sb->rdo_flags, group)
+      && check_add_run (cg, first, 1 + gdt_blocks, 0) == -1)
+    return -1;
+
+  if (!check_in_range (ext2, bgdt->block_bitmap, 1))
+    {
+      check_report (cg,
+                    "group %zu: block bitmap at %" PRIu32 " is outside the "
+                    "filesystem\n",
+                    group, bgdt->block_bitmap);
+      ok = 0;
+    }
+  else if (check_add_run (cg, bgdt->block_bitmap, 1, 0) == -1)
+    return -1;
+
+  if (!check_in_range (ext2, bgdt->inode_bitmap, 1))
+    {
+      check_report (cg,
+                    "group %zu: inode bitmap at %" PRIu32 " is outside the "
+                    "filesystem\n",
+                    group, bgdt->inode_bitmap);
+      ok = 0;
+    }
+  else if (check_add_run (cg, bgdt->inode_bitmap, 1, 0) == -1)
+    return -1;
+
+  if (!check_in_range (ext2, bgdt->inode_table, itb))
+    {
+      check_report (cg,
+                    "group %zu: inode table at %" PRIu32 "-%zu is outside "
+                    "the filesystem\n",
+                    group, bgdt->inode_table, bgdt->inode_table + itb - 1);
+      ok = 0;
+    }
+  else if (check_add_run (cg, bgdt->inode_table, itb, 0) == -1)
+    return -1;
+
+  /* nothing more of the group can be trusted */
+  if (!ok)
+    return 0;
+
+  if (ext2_count_group (ext2, group, &cg->count) == -1)
+    return -1;
+
+  cg->counted = 1;
+
+  if (cg->count.nblocks - cg->count.used_blocks != bgdt->num_free_blks)
+    check_report (cg,
+                  "group %zu: block bitmap has %zu free blocks, descriptor "
+                  "says %u\n",
+                  group, cg->count.nblocks - cg->count.used_blocks,
+                  bgdt->num_free_blks);
+
+  if (cg->count.ninodes - cg->count.used_inodes != bgdt->num_free_inodes)
+    check_report (cg,
+                  "group %zu: inode bitmap has %zu free inodes, descriptor "
+                  "says %u\n",
+                  group, cg->count.ninodes - cg->count.used_inodes,
+                  bgdt->num_free_inodes);
+
+  if (ext2_scan_group (ext2, group, check_inode, cg) == -1)
+    return -1;
+
+  qsort (cg->runs, cg->nruns, sizeof (check_run_t), check_run_cmp);
+
+  return 0;
+}
+
+static const check_run_t *
+check_head (const size_t *pos, size_t group)
+{
+  return groups[group].runs + pos[group];
+}
+
+static int
+check_heap_less (const size_t *pos, size_t a, size_t b)
+{
+  return check_run_cmp (check_head (pos, a), check_head (pos, b)) < 0;
+}
+
+static void
+check_sift_down (const size_t *pos, size_t n, size_t i)
+{
+  for (;;)
+    {
+      size_t min = i, l = 2 * i + 1, r = 2 * i + 2, tmp;
+
+      if (l < n && check_heap_less (pos, heap[l], heap[min]))
+        min = l;
+      if (r < n && check_heap_less (pos, heap[r], heap[min]))
+        min = r;
+      if (min == i)
+        return;
+
+      tmp = heap[i];
+      heap[i] = heap[min];
+      heap[min] = tmp;
+      i = min;
+    }
+}
+
+static void
+check_owner (char *buf, size_t len, uint32_t ino)
+{
+  if (ino)
+    snprintf (buf, len, "inode %" PRIu32, ino);
+  else
+    snprintf (buf, len, "filesystem metadata");
+}
+
+/*
+ * Merges the sorted runs of all groups, oldest start first, and reports
+ * every range claimed twice. Returns the number of such ranges; *nclaimed
+ * is how many distinct blocks were claimed at all.
+ */
+static size_t
+check_crosslinks (uint64_t *nclaimed)
+{
+  check_run_t cur = { 0 };
+  uint64_t cur_end = 0;
+  size_t *pos, n = 0, nlinks = 0;
+
+  *nclaimed = 0;
+
+  heap = malloc (sizeof (size_t) * check_ngroups);
+  pos = calloc (check_ngroups, sizeof (size_t));
+  if (heap == NULL || pos == NULL)
+    {
+      free (pos);
+      fail ("out of memory");
+    }
+
+  for (size_t i = 0; i < check_ngroups; i++)
+    if (groups[i].nruns)
+      heap[n++] = i;
+
+  for (size_t i = n / 2; i-- > 0;)
+    check_sift_down (pos, n, i);
+
+  while (n)
+    {
+      size_t group = heap[0];
+      check_run_t run = *check_head (pos, group);
+      uint64_t end = (uint64_t) run.start + run.len;
+
+      if (++pos[group] == groups[group].nruns)
+        heap[0] = heap[--n];
+      check_sift_down (pos, n, 0);
+
+      if (run.start < cur_end)
+        {
+          if (nlinks++ < CHECK_MAX_CROSSLINKS)
+            {
+              char a[32], b[32];
+
+              check_owner (a, sizeof (a), cur.ino);
+              check_owner (b, sizeof (b), run.ino);
+              printf ("blocks %" PRIu32 "-%" PRIu64 " are claimed by %s and "
+                      "%s\n",
+                      run.start, (end < cur_end ? end : cur_end) - 1, a, b);
+            }
+
+          if (end > cur_end)
+            *nclaimed += end - cur_end;
+        }
+      else
+        *nclaimed += run.len;
+
+      if (end > cur_end)
+        {
+          cur = run;
+          cur_end = end;
+        }
+    }
+
+  if (nlinks > CHECK_MAX_CROSSLINKS)
+    printf ("%zu more cross-linked ranges\n", nlinks - CHECK_MAX_CROSSLINKS);
+
+  free (pos);
+  return nlinks;
+}
+
+static void
+check_op (const check_params_t *params)
+{
+  fs_init_error_t error;
+  file_t *sparse_file;
+  ext2_fs_t *ext2;
+  uint64_t free_blocks = 0, free_inodes = 0, used_blocks = 0, nclaimed;
+  size_t nproblems = 0, ninodes = 0, nunchecked = 0;
+  int all_counted = 1;
+
+  /* prefer the mapped backend, plain reads are the fallback */
+  img_file = file_open_mmap (params->img, FILE_ORDONLY);
+  if (img_file == NULL)
+    img_file = file_open (params->img, FILE_ORDONLY);
+  if (img_file == NULL)
+    fail ("failed to open image file");
+
+  /* compact sparse images are expanded on the fly */
+  sparse_file = file_open_maybe_sparse (img_file);
+  if (sparse_file == NULL)
+    fail (errno == -EBADMSG ? "invalid sparse image"
+                            : "failed to read image file");
+  img_file = sparse_file;
+
+  fs = ext2_fs_init (img_file, &error);
+  if (fs == NULL)
+    {
+      if (error.allocated)
+        error_msg = error.alloc_error;
+      fail ("%s", error.const_error);
+    }
+
+  ext2 = fs->data;
+  check_ngroups = ext2->block_group_cnt;
+  groups = calloc (check_ngroups, sizeof (check_group_t));
+  if (groups == NULL)
+    fail ("out of memory");
+
+  if (ext2_for_each_group (ext2, params->jobs, check_group, NULL) == -1)
+    fail ("failed to read image");
+
+  for (size_t i = 0; i < check_ngroups; i++)
+    {
+      check_group_t *cg = groups + i;
+
+      if (cg->out != NULL)
+        {
+          fclose (cg->out);
+          cg->out = NULL;
+          fwrite (cg->report, 1, cg->report_len, stdout);
+        }
+
+      nproblems += cg->nproblems;
+      ninodes += cg->ninodes;
+      free_blocks += ext2->bgdt[i].num_free_blks;
+      free_inodes += ext2->bgdt[i].num_free_inodes;
+
+      if (cg->counted)
+        used_blocks += cg->count.used_blocks;
+      else
+        {
+          all_counted = 0;
+          nunchecked++;
+        }
+    }
+
+  if (free_blocks != ext2->sb->free_block_cnt
+      || free_inodes != ext2->sb->free_inode_cnt)
+    {
+      printf ("descriptors have %" PRIu64 " free blocks and %" PRIu64
+              " free inodes, superblock says %u and %u\n",
+              free_blocks, free_inodes, ext2->sb->free_block_cnt,
+              ext2->sb->free_inode_cnt);
+      nproblems++;
+    }
+
+  nproblems += check_crosslinks (&nclaimed);
+
+  /* only comparable when no group was skipped */
+  if (all_counted && nclaimed != used_blocks)
+    {
+      printf ("block bitmaps mark %" PRIu64 " blocks in use, %" PRIu64
+              " are claimed\n",
+              used_blocks, nclaimed);
+      nproblems++;
+    }
+
+  printf ("%s: %zu groups, %zu inodes, %" PRIu64 " blocks checked", params->img,
+          check_ngroups, ninodes, nclaimed);
+  if (nunchecked)
+    printf (", %zu groups skipped", nunchecked);
+  printf (", %zu problems\n", nproblems);
+
+  cleanup ();
+
+  if (nproblems)
+    exit (1);
+}
+
+int
+main (int argc, const char **argv)
+{
+  check_params_t params = { 0 };
+  char *end;
+
+  for (int argn = 1; argn < argc; argn++)
+    {
+      const char *arg = argv[argn];
+
+      if (arg[0] != '-')
+        {
+          if (params.img != NULL)
+            fail ("extra operand '%s'", arg);
+
+          params.img = arg;
+          continue;
+        }
+
+      switch (arg[1])
+        {
+        case 'h':
+          usage ();
+          exit (0);
+        case 'j':
+          /* -jN or -j N */
+          if (arg[2] != '\0')
+            arg += 2;
+          else if (argn + 1 < argc)
+            arg = argv[++argn];
+          else
+            fail ("option 'j' requires an argument");
+
+          params.jobs = strtol (arg, &end, 10);
+          if (end == arg || *end != '\0' || params.jobs <= 0)
+            fail ("invalid number of jobs: '%s'", arg);
+          break;
+        default:
+          fail ("invalid option '%c'", arg[1]);
+        }
+    }
+
+  if (params.img == NULL)
+    fail ("missing image operand");
+
+  assert (params.img);
+
+  check_op (&params);
+
+  return 0;
+}
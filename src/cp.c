@@ -1,13 +1,17 @@
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "ext2.h"
 #include "file.h"
 #include "fs.h"
+#include "stats.h"
 
 #define USE_ESCAPE_SEQUENCES
 
@@ -25,13 +29,16 @@
 
 #endif
 
-static const char *cp_cmd_name = "ext2cp";
+/* bounce buffer size between source and image */
+#define CP_BUF_SIZE (8 << 20)
 
-static file_t *img_file = NULL;
-static int nsrc_files = 0;
-static file_t **src_files = NULL;
-static fs_t *fs = NULL;
-static char *error_msg = NULL;
+/* bytes or'ed together per step of the zero check */
+#define CP_ZERO_STEP 64
+
+/* rw-r--r-- */
+#define CP_FILE_MODE 0644
+
+static const char *cp_cmd_name = "ext2cp";
 
 typedef struct
 {
@@ -39,11 +46,64 @@ typedef struct
   int nsrcs;
   const char **srcs;
   const char *dst;
+  long jobs; /* 0 for one per online CPU */
+  int uring; /* drive the image through io_uring where the kernel can */
+  int stats; /* report image and source I/O on stderr when done */
+  stats_format_t stats_format;
 } cp_params_t;
 
+/*
+ * One copying thread. Each gets its own block group to allocate inodes and
+ * blocks from, so the workers fill separate bitmaps side by side.
+ */
+typedef struct
+{
+  pthread_t thread;
+  int started;
+  size_t group;
+  unsigned char *buf;
+  file_t *dst_file;
+  char *error; /* reported by the main thread once everyone is done */
+} cp_worker_t;
+
+static file_t *img_file = NULL;
+static int nsrc_files = 0;
+static file_t **src_files = NULL;
+static fs_t *fs = NULL;
+static char *error_msg = NULL;
+static char *dst_dir = NULL;
+
+static cp_params_t *cp_params = NULL;
+static uint32_t cp_dir_ino = 0;
+static int cp_next = 0;   /* next source to copy */
+static int cp_failed = 0; /* tells the other workers to stop */
+static int nworkers = 0;
+static cp_worker_t *workers = NULL;
+static stats_t img_stats;
+static stats_t src_stats; /* all sources together */
+
 static void
 cleanup (void)
 {
+  /* the filesystem still writes through the image until it is torn down */
+  for (int i = 0; i < nworkers; i++)
+    {
+      if (workers[i].dst_file != NULL)
+        file_close (workers[i].dst_file);
+
+      if (workers[i].buf != NULL)
+        free (workers[i].buf);
+
+      if (workers[i].error != NULL)
+        free (workers[i].error);
+    }
+
+  if (workers != NULL)
+    free (workers);
+
+  if (fs != NULL)
+    ext2_fs_fini (fs);
+
   if (img_file != NULL)
     file_close (img_file);
 
@@ -56,20 +116,26 @@ cleanup (void)
         file_close (src_files[i]);
       }
 
-  if (fs != NULL)
-    ext2_fs_fini (fs);
+  if (src_files != NULL)
+    free (src_files);
+
+  if (dst_dir != NULL)
+    free (dst_dir);
+
+  if (error_msg != NULL)
+    free (error_msg);
 }
 
 static void
 fail (const char *fmt, ...)
 {
   const char *internal_err = "formatting error";
-  char *buf = NULL;
+  char *msg = NULL;
   int tmp, _errno;
   va_list args;
 
   va_start (args, fmt);
-  tmp = vasprintf (&buf, fmt, args);
+  tmp = vasprintf (&msg, fmt, args);
   _errno = errno;
 
   cleanup ();
@@ -78,14 +144,14 @@ fail (const char *fmt, ...)
     goto perror;
 
   fprintf (stderr, ESC_BOLD "%s: " ESC_RED "error: " ESC_RESET "%s\n",
-           cp_cmd_name, buf);
+           cp_cmd_name, msg);
 
   va_end (args);
   exit (1);
 
 perror:
-  if (buf != NULL)
-    free (buf);
+  if (msg != NULL)
+    free (msg);
 
   if (_errno == -ENOMEM)
     internal_err = "out of memory";
@@ -101,17 +167,355 @@ usage (void)
 {
   printf ("Usage: %s [OPTION]... IMAGE SOURCE    DEST\n", cp_cmd_name);
   printf ("   or: %s [OPTION]... IMAGE SOURCE... DIRECTORY\n", cp_cmd_name);
+  printf ("\n");
+  printf ("  -j N            copy with N threads, default one per CPU\n");
+  printf ("  --uring         use io_uring for the image, if the kernel has "
+          "it\n");
+  printf ("  --stats[=json]  report image and source I/O on stderr when "
+          "done\n");
+  printf ("  -h              display this help and exit\n");
+}
+
+static int
+cp_error (cp_worker_t *worker, const char *fmt, ...)
+{
+  va_list args;
+
+  if (worker->error == NULL)
+    {
+      va_start (args, fmt);
+      if (vasprintf (&worker->error, fmt, args) == -1)
+        worker->error = NULL;
+      va_end (args);
+    }
+
+  __atomic_store_n (&cp_failed, 1, __ATOMIC_RELAXED);
+  return -1;
+}
+
+/*
+ * Whether a block is all zeros. The inner loop has no early exit so the
+ * compiler can vectorize it; data blocks tend to fail on the first step.
+ */
+static int
+cp_is_zero (const unsigned char *buf, size_t nbytes)
+{
+  for (size_t i = 0; i < nbytes; i += CP_ZERO_STEP)
+    {
+      uint64_t acc = 0;
+
+      for (size_t j = 0; j < CP_ZERO_STEP; j += sizeof (uint64_t))
+        {
+          uint64_t w;
+
+          memcpy (&w, buf + i + j, sizeof (uint64_t));
+          acc |= w;
+        }
+
+      if (acc)
+        return 0;
+    }
+
+  return 1;
+}
+
+/* bytes of the source that hold data, all of them if holes can't be told */
+static size_t
+cp_data_size (file_t *src, size_t size)
+{
+  size_t total = 0, data, hole;
+
+  for (size_t off = 0; off < size; off = hole)
+    {
+      if (file_next_data (src, off, &data, &hole) == -1)
+        return size;
+
+      if (hole > size)
+        hole = size;
+
+      if (data >= hole)
+        break;
+
+      total += hole - data;
+    }
+
+  return total;
+}
+
+/* writes buf[from, to) of the chunk read at off */
+static int
+cp_write (cp_worker_t *worker, const char *dst, size_t off, size_t from,
+          size_t to)
+{
+  if (from == to)
+    return 0;
+
+  if (file_pwrite (worker->dst_file, worker->buf + from, to - from,
+                   off + from)
+      != (ssize_t) (to - from))
+    {
+      if (errno == -ENOSPC)
+        return cp_error (worker,
+                         "failed to write '%s': no space left on image", dst);
+      return cp_error (worker, "failed to write '%s'", dst);
+    }
+
+  return 0;
+}
+
+/*
+ * Copies [off, end) of a source, leaving blocks that are entirely zero
+ * unallocated. Only whole image blocks are skipped, the destination is new
+ * so they read back as zeros.
+ */
+static int
+cp_range (cp_worker_t *worker, int idx, const char *dst, size_t off,
+          size_t end)
+{
+  size_t bs = ((ext2_fs_t *) fs->data)->block_size;
+
+  while (off < end)
+    {
+      size_t n = end - off > CP_BUF_SIZE ? CP_BUF_SIZE : end - off;
+      size_t from = 0;
+
+      if (worker->buf == NULL
+          && (worker->buf = malloc (CP_BUF_SIZE)) == NULL)
+        return cp_error (worker, "out of memory");
+
+      if (file_pread (src_files[idx], worker->buf, n, off) != (ssize_t) n)
+        return cp_error (worker, "failed to read '%s'", cp_params->srcs[idx]);
+
+      for (size_t pos = 0, len; pos < n; pos += len)
+        {
+          len = bs - (off + pos) % bs;
+          if (len > n - pos)
+            len = n - pos;
+
+          if (len == bs && cp_is_zero (worker->buf + pos, bs))
+            {
+              if (cp_write (worker, dst, off, from, pos) == -1)
+                return -1;
+              from = pos + len;
+            }
+        }
+
+      if (cp_write (worker, dst, off, from, n) == -1)
+        return -1;
+
+      off += n;
+    }
+
+  return 0;
+}
+
+static int
+cp_file (cp_worker_t *worker, int idx, const char *name, const char *dst)
+{
+  ext2_fs_t *ext2 = fs->data;
+  const char *src = cp_params->srcs[idx];
+  size_t size, data, hole;
+
+  if (file_get_size (src_files[idx], &size) == -1)
+    return cp_error (worker, "failed to read size of '%s'", src);
+
+  worker->dst_file
+      = ext2_file_create_in (ext2, cp_dir_ino, name,
+                             EXT2_INODE_TYPE_REG_FILE | CP_FILE_MODE,
+                             worker->group);
+  if (worker->dst_file == NULL)
+    {
+      if (errno == -EEXIST)
+        return cp_error (worker, "cannot create '%s': file exists", dst);
+      if (errno == -ENOSPC)
+        return cp_error (worker, "cannot create '%s': no space left on image",
+                         dst);
+      return cp_error (worker, "cannot create '%s'", dst);
+    }
+
+  /* one contiguous run for all the data, if the image has one */
+  if (ext2_file_reserve (worker->dst_file,
+                         cp_data_size (src_files[idx], size))
+          == -1
+      && errno != -ENOSPC)
+    return cp_error (worker, "failed to allocate blocks for '%s'", dst);
+
+  /* holes in the source stay holes in the image */
+  for (size_t off = 0; off < size; off = hole)
+    {
+      if (file_next_data (src_files[idx], off, &data, &hole) == -1)
+        {
+          data = off;
+          hole = size;
+        }
+
+      if (hole > size)
+        hole = size;
+
+      if (data >= hole)
+        break;
+
+      if (cp_range (worker, idx, dst, data, hole) == -1)
+        return -1;
+    }
+
+  /* a hole at the end still counts towards the size */
+  if (file_set_size (worker->dst_file, size) == -1)
+    return cp_error (worker, "failed to write '%s'", dst);
+
+  file_close (worker->dst_file);
+  worker->dst_file = NULL;
+  return 0;
+}
+
+static const char *
+cp_basename (const char *path)
+{
+  const char *base = strrchr (path, '/');
+  return base != NULL ? base + 1 : path;
+}
+
+/* copies sources into the destination directory until they run out */
+static void *
+cp_worker (void *arg)
+{
+  cp_worker_t *worker = arg;
+
+  while (!__atomic_load_n (&cp_failed, __ATOMIC_RELAXED))
+    {
+      int idx = __atomic_fetch_add (&cp_next, 1, __ATOMIC_RELAXED);
+      const char *base;
+      char *dst;
+      int ret;
+
+      if (idx >= nsrc_files)
+        break;
+
+      base = cp_basename (cp_params->srcs[idx]);
+      if (asprintf (&dst, "%s%s%s", cp_params->dst,
+                    strrchr (cp_params->dst, '/')[1] ? "/" : "", base)
+          == -1)
+        {
+          cp_error (worker, "out of memory");
+          break;
+        }
+
+      ret = cp_file (worker, idx, base, dst);
+      free (dst);
+
+      if (ret == -1)
+        break;
+    }
+
+  return NULL;
+}
+
+static void
+cp_start_workers (long jobs)
+{
+  ext2_fs_t *ext2 = fs->data;
+  size_t dir_group = (cp_dir_ino - 1) / ext2->sb->inodes_per_group;
+
+  if (jobs <= 0)
+    jobs = sysconf (_SC_NPROCESSORS_ONLN);
+  if (jobs <= 0)
+    jobs = 1;
+  if (jobs > nsrc_files)
+    jobs = nsrc_files;
+
+  workers = malloc (sizeof (cp_worker_t) * jobs);
+  if (workers == NULL)
+    fail ("out of memory");
+
+  memset (workers, 0, sizeof (cp_worker_t) * jobs);
+  nworkers = jobs;
+
+  /* spread the workers evenly over the groups, the first one stays home */
+  for (int i = 0; i < nworkers; i++)
+    workers[i].group
+        = (dir_group + i * ext2->block_group_cnt / nworkers)
+          % ext2->block_group_cnt;
+
+  /* the main thread is worker 0, a thread that won't start isn't fatal */
+  for (int i = 1; i < nworkers; i++)
+    workers[i].started = !pthread_create (&workers[i].thread, NULL,
+                                          cp_worker, workers + i);
+
+  cp_worker (workers);
+
+  for (int i = 1; i < nworkers; i++)
+    if (workers[i].started)
+      pthread_join (workers[i].thread, NULL);
+
+  for (int i = 0; i < nworkers; i++)
+    if (workers[i].error != NULL)
+      fail ("%s", workers[i].error);
+
+  if (cp_failed)
+    fail ("out of memory");
+}
+
+static int
+cp_is_dir (uint32_t ino)
+{
+  ext2_fs_t *ext2 = fs->data;
+  ext2_inode_t *inode = ext2_inode_get (ext2, ino);
+  int ret;
+
+  if (inode == NULL)
+    fail ("failed to read inode %u", ino);
+
+  ret = ext2_inode_get_type (inode) == FILE_TYPE_DIR;
+  ext2_inode_put (ext2, inode);
+  return ret;
+}
+
+/* the wrapper takes over file, the caller's pointer is swapped for it */
+static void
+cp_stats_wrap (file_t **file, stats_t *stats)
+{
+  file_t *stats_file = file_open_stats (*file, stats);
+
+  if (stats_file == NULL)
+    fail ("out of memory");
+
+  *file = stats_file;
+}
+
+static void
+cp_stats_report (const cp_params_t *params)
+{
+  const char *names[] = { "image", "sources" };
+  const stats_t *stats[] = { &img_stats, &src_stats };
+
+  if (params->stats)
+    stats_report (stderr, names, stats, 2, params->stats_format);
 }
 
 static void
 cp_op (cp_params_t *params)
 {
   fs_init_error_t error;
-
-  img_file = file_open (params->img, FILE_ORDWR);
+  ext2_fs_t *ext2;
+  char *name;
+
+  /*
+   * Prefer the mapped backend, plain reads are the fallback. io_uring
+   * goes first when asked for, kernels without it fall through.
+   */
+  img_file = NULL;
+  if (params->uring)
+    img_file = file_open_uring (params->img, FILE_ORDWR);
+  if (img_file == NULL)
+    img_file = file_open_mmap (params->img, FILE_ORDWR);
+  if (img_file == NULL)
+    img_file = file_open (params->img, FILE_ORDWR);
   if (img_file == NULL)
     fail ("failed to open image file: '%s'", params->img);
 
+  if (params->stats)
+    cp_stats_wrap (&img_file, &img_stats);
+
   nsrc_files = params->nsrcs;
   src_files = malloc (sizeof (file_t *) * nsrc_files);
   if (src_files == NULL)
@@ -124,6 +528,9 @@ cp_op (cp_params_t *params)
       src_files[i] = file_open (params->srcs[i], FILE_ORDONLY);
       if (src_files[i] == NULL)
         fail ("failed to open source file: '%s'", params->srcs[i]);
+
+      if (params->stats)
+        cp_stats_wrap (&src_files[i], &src_stats);
     }
 
   if (params->dst[0] != '/')
@@ -137,6 +544,62 @@ cp_op (cp_params_t *params)
       fail ("%s", error.const_error);
     }
 
+  ext2 = fs->data;
+  cp_params = params;
+
+  /* an existing directory takes the sources under their own names */
+  if (!ext2_namei (ext2, params->dst, &cp_dir_ino))
+    {
+      if (!cp_is_dir (cp_dir_ino))
+        fail ("cannot create '%s': file exists", params->dst);
+
+      for (int i = 0; i < nsrc_files; i++)
+        if (cp_basename (params->srcs[i])[0] == '\0')
+          fail ("cannot copy a directory: '%s'", params->srcs[i]);
+
+      cp_start_workers (params->jobs);
+
+      /* bitmaps, inodes and counters have been kept back until now */
+      if (ext2_fs_sync (ext2) == -1)
+        fail ("failed to write metadata to image");
+
+      cp_stats_report (params);
+      cleanup ();
+      return;
+    }
+
+  if (errno != -ENOENT)
+    fail ("cannot stat '%s'", params->dst);
+
+  if (nsrc_files > 1)
+    fail ("target '%s' is not a directory", params->dst);
+
+  dst_dir = strdup (params->dst);
+  if (dst_dir == NULL)
+    fail ("out of memory");
+
+  name = strrchr (dst_dir, '/');
+  *name++ = '\0';
+
+  if (ext2_namei (ext2, dst_dir[0] ? dst_dir : "/", &cp_dir_ino) == -1
+      || !cp_is_dir (cp_dir_ino))
+    fail ("cannot create '%s': no such directory", params->dst);
+
+  workers = malloc (sizeof (cp_worker_t));
+  if (workers == NULL)
+    fail ("out of memory");
+
+  memset (workers, 0, sizeof (cp_worker_t));
+  nworkers = 1;
+  workers->group = (cp_dir_ino - 1) / ext2->sb->inodes_per_group;
+
+  if (cp_file (workers, 0, name, params->dst) == -1)
+    fail ("%s", workers->error != NULL ? workers->error : "out of memory");
+
+  if (ext2_fs_sync (ext2) == -1)
+    fail ("failed to write metadata to image");
+
+  cp_stats_report (params);
   cleanup ();
 }
 
@@ -145,12 +608,36 @@ main (int argc, const char **argv)
 {
   cp_params_t params = { 0 };
   int argn, nsrcs = 0;
+  char *end;
 
   /* pre-pass */
   for (argn = 1; argn < argc; argn++)
     {
       const char *arg = argv[argn];
 
+      if (!strcmp (arg, "--stats") || !strcmp (arg, "--stats=text"))
+        {
+          params.stats = 1;
+          params.stats_format = STATS_FORMAT_TEXT;
+          continue;
+        }
+
+      if (!strcmp (arg, "--uring"))
+        {
+          params.uring = 1;
+          continue;
+        }
+
+      if (!strcmp (arg, "--stats=json"))
+        {
+          params.stats = 1;
+          params.stats_format = STATS_FORMAT_JSON;
+          continue;
+        }
+
+      if (arg[0] == '-' && arg[1] == '-')
+        fail ("invalid option '%s'", arg);
+
       if (arg[0] == '-')
         {
           arg++;
@@ -161,11 +648,28 @@ main (int argc, const char **argv)
                 case 'h':
                   usage ();
                   exit (0);
+                case 'j':
+                  /* -jN or -j N, the value is hidden from the second pass */
+                  if (arg[1] == '\0' && argn + 1 < argc)
+                    {
+                      arg = argv[++argn];
+                      argv[argn] = NULL;
+                    }
+                  else
+                    arg++;
+
+                  params.jobs = strtol (arg, &end, 10);
+                  if (end == arg || *end != '\0' || params.jobs <= 0)
+                    fail ("invalid number of jobs: '%s'", arg);
+
+                  arg = end - 1;
+                  break;
                 default:
-                  fail ("invalid option '%c'", arg[1]);
+                  fail ("invalid option '%c'", arg[0]);
                 }
               arg++;
             }
+          continue;
         }
 
       if (params.img == NULL)
@@ -193,7 +697,7 @@ main (int argc, const char **argv)
     {
       const char *arg = argv[argn];
 
-      if (arg[0] == '-')
+      if (arg == NULL || arg[0] == '-')
         continue;
 
       if (params.img == NULL)
@@ -210,5 +714,7 @@ main (int argc, const char **argv)
 
   cp_op (&params);
 
+  free (params.srcs);
+
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,383 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ext2.h"
+#include "file.h"
+#include "fs.h"
+
+#define USE_ESCAPE_SEQUENCES
+
+#ifdef USE_ESCAPE_SEQUENCES
+
+#define ESC_RESET  "\033[0m"
+#define ESC_BOLD   "\033[1m"
+#define ESC_RED    "\033[31m"
+#define ESC_YELLOW "\033[33m"
+
+#else
+
+#define ESC_RESET
+#define ESC_BOLD
+#define ESC_RED
+#define ESC_YELLOW
+
+#endif
+
+/* disagreeing groups reported per image, the rest are only counted */
+#define DF_MAX_MISMATCHES 8
+
+static const char *df_cmd_name = "ext2df";
+
+typedef struct
+{
+  int nimgs;
+  const char **imgs;
+  long jobs; /* 0 for one per online CPU */
+} df_params_t;
+
+/* sums over all groups of an image */
+typedef struct
+{
+  uint64_t nblocks;
+  uint64_t used_blocks;
+  uint64_t ninodes;
+  uint64_t used_inodes;
+} df_usage_t;
+
+static file_t *img_file = NULL;
+static fs_t *fs = NULL;
+static char *error_msg = NULL;
+static ext2_group_count_t *counts = NULL;
+static size_t df_ngroups = 0;
+
+static void
+cleanup (void)
+{
+  if (fs != NULL)
+    ext2_fs_fini (fs);
+
+  if (img_file != NULL)
+    file_close (img_file);
+
+  if (counts != NULL)
+    free (counts);
+
+  if (error_msg != NULL)
+    free (error_msg);
+
+  fs = NULL;
+  img_file = NULL;
+  counts = NULL;
+  error_msg = NULL;
+}
+
+static void
+fail (const char *fmt, ...)
+{
+  const char *internal_err = "formatting error";
+  char *msg = NULL;
+  int tmp, _errno;
+  va_list args;
+
+  va_start (args, fmt);
+  tmp = vasprintf (&msg, fmt, args);
+  _errno = errno;
+
+  cleanup ();
+
+  if (tmp == -1)
+    goto perror;
+
+  fprintf (stderr, ESC_BOLD "%s: " ESC_RED "error: " ESC_RESET "%s\n",
+           df_cmd_name, msg);
+
+  va_end (args);
+  exit (1);
+
+perror:
+  if (msg != NULL)
+    free (msg);
+
+  if (_errno == -ENOMEM)
+    internal_err = "out of memory";
+
+  fprintf (stderr, ESC_BOLD "%s: " ESC_RED "error:" ESC_RESET "%s\n",
+           df_cmd_name, internal_err);
+
+  exit (2);
+}
+
+/* a problem with one image, the others are still reported */
+static void
+df_error (const char *img, const char *fmt, ...)
+{
+  va_list args;
+
+  /* keep it in line with the rows already printed */
+  fflush (stdout);
+
+  va_start (args, fmt);
+  fprintf (stderr, ESC_BOLD "%s: " ESC_RED "error: " ESC_RESET "%s: ",
+           df_cmd_name, img);
+  vfprintf (stderr, fmt, args);
+  fprintf (stderr, "\n");
+  va_end (args);
+}
+
+static void
+df_warn (const char *img, const char *fmt, ...)
+{
+  va_list args;
+
+  fflush (stdout);
+
+  va_start (args, fmt);
+  fprintf (stderr, ESC_BOLD "%s: " ESC_YELLOW "warning: " ESC_RESET "%s: ",
+           df_cmd_name, img);
+  vfprintf (stderr, fmt, args);
+  fprintf (stderr, "\n");
+  va_end (args);
+}
+
+static void
+usage (void)
+{
+  printf ("Usage: %s [OPTION]... IMAGE...\n", df_cmd_name);
+  printf ("Report block and inode usage of each IMAGE, counted from its "
+          "bitmaps.\n");
+  printf ("\n");
+  printf ("  -j N  count with N threads, default one per CPU\n");
+  printf ("  -h    display this help and exit\n");
+}
+
+static int
+df_count_group (ext2_fs_t *ext2, size_t group, void *arg)
+{
+  (void) arg;
+  return ext2_count_group (ext2, group, counts + group);
+}
+
+/*
+ * Sums the group counts and holds them against the free counts in the group
+ * descriptors and the superblock. Returns the number of disagreements.
+ */
+static size_t
+df_check (const char *img, df_usage_t *usage)
+{
+  ext2_fs_t *ext2 = fs->data;
+  uint64_t free_blocks = 0, free_inodes = 0;
+  size_t nmismatches = 0;
+
+  memset (usage, 0, sizeof (df_usage_t));
+
+  for (size_t i = 0; i < df_ngroups; i++)
+    {
+      const ext2_group_count_t *count = counts + i;
+      const ext2_bgdt_t *bgdt = ext2->bgdt + i;
+      size_t nfree_blocks = count->nblocks - count->used_blocks;
+      size_t nfree_inodes = count->ninodes - count->used_inodes;
+
+      usage->nblocks += count->nblocks;
+      usage->used_blocks += count->used_blocks;
+      usage->ninodes += count->ninodes;
+      usage->used_inodes += count->used_inodes;
+      free_blocks += bgdt->num_free_blks;
+      free_inodes += bgdt->num_free_inodes;
+
+      if (nfree_blocks == bgdt->num_free_blks
+          && nfree_inodes == bgdt->num_free_inodes)
+        continue;
+
+      if (nmismatches++ < DF_MAX_MISMATCHES)
+        df_warn (img,
+                 "group %zu: bitmaps have %zu free blocks and %zu free "
+                 "inodes, descriptor says %u and %u",
+                 i, nfree_blocks, nfree_inodes, bgdt->num_free_blks,
+                 bgdt->num_free_inodes);
+    }
+
+  if (nmismatches > DF_MAX_MISMATCHES)
+    df_warn (img, "%zu more groups disagree with their descriptors",
+             nmismatches - DF_MAX_MISMATCHES);
+
+  if (free_blocks != ext2->sb->free_block_cnt
+      || free_inodes != ext2->sb->free_inode_cnt)
+    {
+      df_warn (img,
+               "descriptors have %" PRIu64 " free blocks and %" PRIu64
+               " free inodes, superblock says %u and %u",
+               free_blocks, free_inodes, ext2->sb->free_block_cnt,
+               ext2->sb->free_inode_cnt);
+      nmismatches++;
+    }
+
+  return nmismatches;
+}
+
+static void
+df_percent (char *buf, size_t len, uint64_t used, uint64_t avail)
+{
+  /* rounded up like df, a nearly full image never shows 100% free */
+  if (!used && !avail)
+    snprintf (buf, len, "-");
+  else
+    snprintf (buf, len, "%" PRIu64 "%%",
+              (used * 100 + used + avail - 1) / (used + avail));
+}
+
+static void
+df_print (const char *img, const df_usage_t *usage)
+{
+  ext2_fs_t *ext2 = fs->data;
+  uint64_t kib = ext2->block_size / 1024;
+  uint64_t free_blocks = usage->nblocks - usage->used_blocks;
+  uint64_t avail = free_blocks > ext2->sb->su_block_cnt
+                       ? free_blocks - ext2->sb->su_block_cnt
+                       : 0;
+  char use[8], iuse[8];
+
+  df_percent (use, sizeof (use), usage->used_blocks, avail);
+  df_percent (iuse, sizeof (iuse), usage->used_inodes,
+              usage->ninodes - usage->used_inodes);
+
+  printf ("%-20s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %5s %10" PRIu64
+          " %10" PRIu64 " %10" PRIu64 " %5s\n",
+          img, usage->nblocks * kib, usage->used_blocks * kib, avail * kib,
+          use, usage->ninodes, usage->used_inodes,
+          usage->ninodes - usage->used_inodes, iuse);
+}
+
+/* 0 if the image was reported and consistent, 1 otherwise */
+static int
+df_image (const df_params_t *params, const char *img)
+{
+  fs_init_error_t error;
+  file_t *sparse_file;
+  df_usage_t usage;
+  int ret = 1;
+
+  /* prefer the mapped backend, plain reads are the fallback */
+  img_file = file_open_mmap (img, FILE_ORDONLY);
+  if (img_file == NULL)
+    img_file = file_open (img, FILE_ORDONLY);
+  if (img_file == NULL)
+    {
+      df_error (img, "failed to open image file");
+      goto out;
+    }
+
+  /* compact sparse images are expanded on the fly */
+  sparse_file = file_open_maybe_sparse (img_file);
+  if (sparse_file == NULL)
+    {
+      df_error (img, errno == -EBADMSG ? "invalid sparse image"
+                                       : "failed to read image file");
+      goto out;
+    }
+  img_file = sparse_file;
+
+  fs = ext2_fs_init (img_file, &error);
+  if (fs == NULL)
+    {
+      if (error.allocated)
+        error_msg = error.alloc_error;
+      df_error (img, "%s", error.const_error);
+      goto out;
+    }
+
+  df_ngroups = ((ext2_fs_t *) fs->data)->block_group_cnt;
+  counts = malloc (sizeof (ext2_group_count_t) * df_ngroups);
+  if (counts == NULL)
+    fail ("out of memory");
+
+  if (ext2_for_each_group (fs->data, params->jobs, df_count_group, NULL)
+      == -1)
+    {
+      df_error (img, "failed to read bitmaps");
+      goto out;
+    }
+
+  ret = df_check (img, &usage) != 0;
+  df_print (img, &usage);
+
+out:
+  cleanup ();
+  return ret;
+}
+
+static void
+df_op (const df_params_t *params)
+{
+  int ret = 0;
+
+  printf ("%-20s %12s %12s %12s %5s %10s %10s %10s %5s\n", "Image",
+          "1K-blocks", "Used", "Available", "Use%", "Inodes", "IUsed",
+          "IFree", "IUse%");
+
+  for (int i = 0; i < params->nimgs; i++)
+    ret |= df_image (params, params->imgs[i]);
+
+  if (ret)
+    exit (1);
+}
+
+int
+main (int argc, const char **argv)
+{
+  df_params_t params = { 0 };
+  char *end;
+
+  params.imgs = malloc (sizeof (const char *) * argc);
+  if (params.imgs == NULL)
+    fail ("out of memory");
+
+  for (int argn = 1; argn < argc; argn++)
+    {
+      const char *arg = argv[argn];
+
+      if (arg[0] != '-')
+        {
+          params.imgs[params.nimgs++] = arg;
+          continue;
+        }
+
+      switch (arg[1])
+        {
+        case 'h':
+          usage ();
+          exit (0);
+        case 'j':
+          /* -jN or -j N */
+          if (arg[2] != '\0')
+            arg += 2;
+          else if (argn + 1 < argc)
+            arg = argv[++argn];
+          else
+            fail ("option 'j' requires an argument");
+
+          params.jobs = strtol (arg, &end, 10);
+          if (end == arg || *end != '\0' || params.jobs <= 0)
+            fail ("invalid number of jobs: '%s'", arg);
+          break;
+        default:
+          fail ("invalid option '%c'", arg[1]);
+        }
+    }
+
+  if (!params.nimgs)
+    fail ("missing image operand");
+
+  assert (params.imgs);
+
+  df_op (&params);
+
+  free (params.imgs);
+
+  return 0;
+}
@@ -0,0 +1,453 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "file.h"
+#include "stats.h"
+
+#define STATS_FILE(file) stats_file_t *stats_file = (stats_file_t *) (file)
+
+/*
+ * Passes every operation on to the wrapped file, timing and counting it on
+ * the way. Only the operations the wrapped file has are set, so callers see
+ * the same optional entries, and take the same fallbacks, as without it.
+ */
+typedef struct
+{
+  file_t base;
+  file_t *file; /* owned */
+  stats_t *stats;
+  size_t next_off; /* where the next sequential positioned access starts */
+} stats_file_t;
+
+static const char *stats_op_names[STATS_NOPS]
+    = { "read", "write", "seek", "map", "copy_range", "submit" };
+
+static dir_t *stats_file_opendir (file_t *file);
+static int stats_file_get_type (file_t *file, file_type_t *type);
+static int stats_file_get_size (file_t *file, size_t *size);
+static int stats_file_set_size (file_t *file, size_t size);
+static int stats_file_seek (file_t *file, size_t off, file_seek_t origin);
+static ssize_t stats_file_read (file_t *file, void *buf, size_t nbytes);
+static ssize_t stats_file_write (file_t *file, const void *buf,
+                                 size_t nbytes);
+static ssize_t stats_file_pread (file_t *file, void *buf, size_t nbytes,
+                                 size_t off);
+static ssize_t stats_file_pwrite (file_t *file, const void *buf,
+                                  size_t nbytes, size_t off);
+static const void *stats_file_map (file_t *file, size_t off, size_t nbytes);
+static ssize_t stats_file_copy_range (file_t *file, size_t off, file_t *dst,
+                                      size_t dst_off, size_t nbytes);
+static int stats_file_submit (file_t *file, file_io_t *ios, size_t nios);
+static int stats_file_next_data (file_t *file, size_t off, size_t *data,
+                                 size_t *hole);
+static void stats_file_close (file_t *file);
+
+/*
+ * Wraps file so that everything done through the returned file is counted
+ * in stats. The returned file owns file and closes it.
+ */
+file_t *
+file_open_stats (file_t *file, stats_t *stats)
+{
+  stats_file_t *stats_file = malloc (sizeof (stats_file_t));
+
+  if (stats_file == NULL)
+    {
+      errno = -ENOMEM;
+      return NULL;
+    }
+
+  memset (stats_file, 0, sizeof (stats_file_t));
+
+#define STATS_WRAP(op)                                                        \
+  if (file->op != NULL)                                                       \
+    stats_file->base.op = stats_file_##op;
+
+  STATS_WRAP (opendir);
+  STATS_WRAP (get_type);
+  STATS_WRAP (get_size);
+  STATS_WRAP (set_size);
+  STATS_WRAP (seek);
+  STATS_WRAP (read);
+  STATS_WRAP (write);
+  STATS_WRAP (pread);
+  STATS_WRAP (pwrite);
+  STATS_WRAP (map);
+  STATS_WRAP (copy_range);
+  STATS_WRAP (submit);
+  STATS_WRAP (next_data);
+
+#undef STATS_WRAP
+
+  stats_file->base.close = stats_file_close;
+  stats_file->file = file;
+  stats_file->stats = stats;
+
+  return &stats_file->base;
+}
+
+static uint64_t
+stats_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+stats_add (stats_t *stats, stats_op_t op, ssize_t nbytes)
+{
+  stats_counters_t *counters = stats->ops + op;
+
+  __atomic_fetch_add (&counters->nops, 1, __ATOMIC_RELAXED);
+  if (nbytes > 0)
+    __atomic_fetch_add (&counters->nbytes, nbytes, __ATOMIC_RELAXED);
+}
+
+static void
+stats_count (stats_t *stats, stats_op_t op, ssize_t nbytes, uint64_t start)
+{
+  stats_counters_t *counters = stats->ops + op;
+  uint64_t ns = stats_now () - start;
+  size_t bucket = ns ? 64 - __builtin_clzll (ns) : 0;
+
+  if (bucket >= STATS_NBUCKETS)
+    bucket = STATS_NBUCKETS - 1;
+
+  stats_add (stats, op, nbytes);
+  __atomic_fetch_add (&counters->ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&counters->hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/* a positioned access that doesn't carry on where the last one ended */
+static void
+stats_track (stats_file_t *stats_file, size_t off, size_t nbytes)
+{
+  size_t prev = __atomic_exchange_n (&stats_file->next_off, off + nbytes,
+                                     __ATOMIC_RELAXED);
+
+  if (prev != off)
+    __atomic_fetch_add (&stats_file->stats->njumps, 1, __ATOMIC_RELAXED);
+}
+
+static dir_t *
+stats_file_opendir (file_t *file)
+{
+  STATS_FILE (file);
+  return file_open_dir (stats_file->file);
+}
+
+static int
+stats_file_get_type (file_t *file, file_type_t *type)
+{
+  STATS_FILE (file);
+  return file_get_type (stats_file->file, type);
+}
+
+static int
+stats_file_get_size (file_t *file, size_t *size)
+{
+  STATS_FILE (file);
+  return file_get_size (stats_file->file, size);
+}
+
+static int
+stats_file_set_size (file_t *file, size_t size)
+{
+  STATS_FILE (file);
+  return file_set_size (stats_file->file, size);
+}
+
+static int
+stats_file_seek (file_t *file, size_t off, file_seek_t origin)
+{
+  STATS_FILE (file);
+  uint64_t start = stats_now ();
+  int ret = file_seek (stats_file->file, off, origin);
+
+  stats_count (stats_file->stats, STATS_OP_SEEK, 0, start);
+  return ret;
+}
+
+static ssize_t
+stats_file_read (file_t *file, void *buf, size_t nbytes)
+{
+  STATS_FILE (file);
+  uint64_t start = stats_now ();
+  ssize_t ret = file_read (stats_file->file, buf, nbytes);
+
+  stats_count (stats_file->stats, STATS_OP_READ, ret, start);
+  return ret;
+}
+
+static ssize_t
+stats_file_write (file_t *file, const void *buf, size_t nbytes)
+{
+  STATS_FILE (file);
+  uint64_t start = stats_now ();
+  ssize_t ret = file_write (stats_file->file, buf, nbytes);
+
+  stats_count (stats_file->stats, STATS_OP_WRITE, ret, start);
+  return ret;
+}
+
+static ssize_t
+stats_file_pread (file_t *file, void *buf, size_t nbytes, size_t off)
+{
+  STATS_FILE (file);
+  uint64_t start = stats_now ();
+  ssize_t ret = file_pread (stats_file->file, buf, nbytes, off);
+
+  stats_count (stats_file->stats, STATS_OP_READ, ret, start);
+  stats_track (stats_file, off, nbytes);
+  return ret;
+}
+
+static ssize_t
+stats_file_pwrite (file_t *file, const void *buf, size_t nbytes, size_t off)
+{
+  STATS_FILE (file);
+  uint64_t start = stats_now ();
+  ssize_t ret = file_pwrite (stats_file->file, buf, nbytes, off);
+
+  stats_count (stats_file->stats, STATS_OP_WRITE, ret, start);
+  stats_track (stats_file, off, nbytes);
+  return ret;
+}
+
+static const void *
+stats_file_map (file_t *file, size_t off, size_t nbytes)
+{
+  STATS_FILE (file);
+  uint64_t start = stats_now ();
+  const void *ret = file_map (stats_file->file, off, nbytes);
+
+  stats_count (stats_file->stats, STATS_OP_MAP, ret != NULL ? nbytes : 0,
+               start);
+  return ret;
+}
+
+static ssize_t
+stats_file_copy_range (file_t *file, size_t off, file_t *dst, size_t dst_off,
+                       size_t nbytes)
+{
+  STATS_FILE (file);
+  uint64_t start = stats_now ();
+  ssize_t ret
+      = file_copy_range (stats_file->file, off, dst, dst_off, nbytes);
+
+  stats_count (stats_file->stats, STATS_OP_COPY, ret, start);
+  stats_track (stats_file, off, nbytes);
+  return ret;
+}
+
+static int
+stats_file_submit (file_t *file, file_io_t *ios, size_t nios)
+{
+  STATS_FILE (file);
+  uint64_t start = stats_now ();
+  int ret = file_submit (stats_file->file, ios, nios);
+  ssize_t nbytes = 0;
+
+  for (size_t i = 0; i < nios; i++)
+    {
+      stats_add (stats_file->stats,
+                 ios[i].op == FILE_IO_READ ? STATS_OP_READ : STATS_OP_WRITE,
+                 ios[i].res);
+      stats_track (stats_file, ios[i].off, ios[i].nbytes);
+
+      if (ios[i].res > 0)
+        nbytes += ios[i].res;
+    }
+
+  stats_count (stats_file->stats, STATS_OP_SUBMIT, nbytes, start);
+  return ret;
+}
+
+static int
+stats_file_next_data (file_t *file, size_t off, size_t *data, size_t *hole)
+{
+  STATS_FILE (file);
+  return file_next_data (stats_file->file, off, data, hole);
+}
+
+static void
+stats_file_close (file_t *file)
+{
+  STATS_FILE (file);
+
+  file_close (stats_file->file);
+  free (stats_file);
+}
+
+static void
+stats_fmt_bytes (char *buf, size_t len, uint64_t nbytes)
+{
+  static const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+  double n = nbytes;
+  size_t unit = 0;
+
+  while (n >= 1024 && unit + 1 < sizeof (units) / sizeof (units[0]))
+    {
+      n /= 1024;
+      unit++;
+    }
+
+  if (!unit)
+    snprintf (buf, len, "%" PRIu64 "B", nbytes);
+  else
+    snprintf (buf, len, "%.1f%s", n, units[unit]);
+}
+
+static void
+stats_fmt_ns (char *buf, size_t len, double ns)
+{
+  if (ns < 1e3)
+    snprintf (buf, len, "%.0fns", ns);
+  else if (ns < 1e6)
+    snprintf (buf, len, "%.1fus", ns / 1e3);
+  else if (ns < 1e9)
+    snprintf (buf, len, "%.1fms", ns / 1e6);
+  else
+    snprintf (buf, len, "%.2fs", ns / 1e9);
+}
+
+/* reads and writes only ever batched through submit have no timings */
+static uint64_t
+stats_timed (const stats_counters_t *counters)
+{
+  uint64_t timed = 0;
+
+  for (size_t i = 0; i < STATS_NBUCKETS; i++)
+    timed += counters->hist[i];
+
+  return timed;
+}
+
+/* the p-th fraction of timed operations took under this many ns */
+static double
+stats_percentile (const stats_counters_t *counters, double p)
+{
+  uint64_t timed = stats_timed (counters), seen = 0;
+
+  for (size_t i = 0; i < STATS_NBUCKETS; i++)
+    {
+      seen += counters->hist[i];
+      if (seen && seen >= p * timed)
+        return (double) (1ull << i);
+    }
+
+  return 0;
+}
+
+static void
+stats_report_text (FILE *out, const char *name, const stats_t *stats)
+{
+  char bytes[16], total[16], avg[16], p50[16] = "<", p99[16] = "<";
+
+  fprintf (out, "%s:\n", name);
+  fprintf (out, "  %-10s %10s %10s %10s %9s %9s %9s\n", "op", "count",
+           "bytes", "time", "avg", "p50", "p99");
+
+  for (size_t op = 0; op < STATS_NOPS; op++)
+    {
+      const stats_counters_t *counters = stats->ops + op;
+
+      if (!counters->nops)
+        continue;
+
+      stats_fmt_bytes (bytes, sizeof (bytes), counters->nbytes);
+      stats_fmt_ns (total, sizeof (total), counters->ns);
+      stats_fmt_ns (avg, sizeof (avg), (double) counters->ns / counters->nops);
+      stats_fmt_ns (p50 + 1, sizeof (p50) - 1,
+                    stats_percentile (counters, 0.5));
+      stats_fmt_ns (p99 + 1, sizeof (p99) - 1,
+                    stats_percentile (counters, 0.99));
+
+      fprintf (out, "  %-10s %10" PRIu64 " %10s %10s %9s %9s %9s\n",
+               stats_op_names[op], counters->nops, bytes, total, avg, p50,
+               p99);
+    }
+
+  fprintf (out, "  %" PRIu64 " positioned accesses out of sequence\n",
+           stats->njumps);
+
+  /* histograms, only the buckets that have anything in them */
+  for (size_t op = 0; op < STATS_NOPS; op++)
+    {
+      const stats_counters_t *counters = stats->ops + op;
+      const char *sep = "";
+
+      if (!stats_timed (counters))
+        continue;
+
+      fprintf (out, "  %s latency:", stats_op_names[op]);
+      for (size_t i = 0; i < STATS_NBUCKETS; i++)
+        {
+          if (!counters->hist[i])
+            continue;
+
+          stats_fmt_ns (avg, sizeof (avg), (double) (1ull << i));
+          fprintf (out, "%s <%s %" PRIu64, sep, avg, counters->hist[i]);
+          sep = ",";
+        }
+      fprintf (out, "\n");
+    }
+}
+
+static void
+stats_report_json (FILE *out, const char *name, const stats_t *stats)
+{
+  fprintf (out, "\"%s\": {\"jumps\": %" PRIu64, name, stats->njumps);
+
+  for (size_t op = 0; op < STATS_NOPS; op++)
+    {
+      const stats_counters_t *counters = stats->ops + op;
+
+      fprintf (out,
+               ", \"%s\": {\"count\": %" PRIu64 ", \"bytes\": %" PRIu64
+               ", \"ns\": %" PRIu64 ", \"hist\": [",
+               stats_op_names[op], counters->nops, counters->nbytes,
+               counters->ns);
+
+      for (size_t i = 0; i < STATS_NBUCKETS; i++)
+        fprintf (out, "%s%" PRIu64, i ? ", " : "", counters->hist[i]);
+
+      fprintf (out, "]}");
+    }
+
+  fprintf (out, "}");
+}
+
+/*
+ * Prints the named sets of counters, as a table per set or as one JSON
+ * object with a member per set. Histogram bucket i of an op counts the
+ * calls that took under 2^i ns.
+ */
+void
+stats_report (FILE *out, const char *const *names,
+              const stats_t *const *stats, size_t nstats,
+              stats_format_t format)
+{
+  if (format == STATS_FORMAT_JSON)
+    fprintf (out, "{");
+
+  for (size_t i = 0; i < nstats; i++)
+    {
+      if (format == STATS_FORMAT_JSON)
+        {
+          if (i)
+            fprintf (out, ", ");
+          stats_report_json (out, names[i], stats[i]);
+        }
+      else
+        stats_report_text (out, names[i], stats[i]);
+    }
+
+  if (format == STATS_FORMAT_JSON)
+    fprintf (out, "}\n");
+}
@@ -1,8 +1,11 @@
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "ext2.h"
 #include "file.h"
@@ -48,64 +51,4138 @@ ext2_has_extended_sb (ext2_sb_t *sb)
   return sb->major_ver >= 1;
 }
 
+static const void *
+ext2_borrow_from_block (ext2_fs_t *fs, size_t block, size_t off,
+                        size_t nbytes)
+{
+  if (block >= fs->sb->block_cnt)
+    {
+      errno = -EINVAL;
+      return NULL;
+    }
+
+  return file_map (fs->file, block * fs->block_size + off, nbytes);
+}
+
+/* session arena */
+
+void
+ext2_arena_init (ext2_arena_t *arena)
+{
+  arena->head = NULL;
+}
+
+void
+ext2_arena_fini (ext2_arena_t *arena)
+{
+  ext2_arena_chunk_t *chunk = arena->head;
+
+  while (chunk != NULL)
+    {
+      ext2_arena_chunk_t *prev = chunk->prev;
+      free (chunk);
+      chunk = prev;
+    }
+
+  arena->head = NULL;
+}
+
+/*
+ * Carves nbytes off the newest chunk, suitably aligned for anything. A
+ * request that doesn't fit starts a new chunk of EXT2_ARENA_CHUNK bytes,
+ * or one just big enough for it; the rest of the old chunk goes unused.
+ */
+void *
+ext2_arena_alloc (ext2_arena_t *arena, size_t nbytes)
+{
+  ext2_arena_chunk_t *chunk = arena->head;
+  size_t size = ALIGN_UP (nbytes, sizeof (max_align_t));
+  void *ptr;
+
+  if (chunk == NULL || chunk->size - chunk->used < size)
+    {
+      size_t chunk_size = size > EXT2_ARENA_CHUNK ? size : EXT2_ARENA_CHUNK;
+
+      chunk = malloc (sizeof (ext2_arena_chunk_t) + chunk_size);
+      if (chunk == NULL)
+        {
+          errno = -ENOMEM;
+          return NULL;
+        }
+
+      chunk->prev = arena->head;
+      chunk->size = chunk_size;
+      chunk->used = 0;
+      arena->head = chunk;
+    }
+
+  ptr = (unsigned char *) chunk->data + chunk->used;
+  chunk->used += size;
+
+  return ptr;
+}
+
+char *
+ext2_arena_strdup (ext2_arena_t *arena, const char *str)
+{
+  size_t len = strlen (str) + 1;
+  char *copy = ext2_arena_alloc (arena, len);
+
+  if (copy != NULL)
+    memcpy (copy, str, len);
+
+  return copy;
+}
+
+ext2_arena_mark_t
+ext2_arena_mark (const ext2_arena_t *arena)
+{
+  ext2_arena_mark_t mark;
+
+  mark.chunk = arena->head;
+  mark.used = arena->head != NULL ? arena->head->used : 0;
+
+  return mark;
+}
+
+/* frees everything allocated after mark was taken */
+void
+ext2_arena_release (ext2_arena_t *arena, ext2_arena_mark_t mark)
+{
+  while (arena->head != mark.chunk)
+    {
+      ext2_arena_chunk_t *prev = arena->head->prev;
+      free (arena->head);
+      arena->head = prev;
+    }
+
+  if (arena->head != NULL)
+    arena->head->used = mark.used;
+}
+
+#define EXT2_BCACHE_NIL UINT32_MAX
+
+static size_t
+ext2_bcache_bucket (ext2_bcache_t *bcache, size_t block)
+{
+  /* fibonacci hashing, neighbouring blocks land in different buckets */
+  return (block * 0x9e3779b97f4a7c15ull) >> 32 & (bcache->nbuckets - 1);
+}
+
+static void
+ext2_bcache_fini (ext2_fs_t *fs)
+{
+  ext2_bcache_t *bcache = &fs->bcache;
+
+  free (bcache->buckets);
+  free (bcache->ents);
+  free (bcache->data);
+  memset (bcache, 0, sizeof (ext2_bcache_t));
+}
+
+static int
+ext2_bcache_init (ext2_fs_t *fs, size_t nblocks)
+{
+  ext2_bcache_t *bcache = &fs->bcache;
+  size_t nbuckets = 1;
+
+  if (nblocks < EXT2_BCACHE_MIN_BLOCKS)
+    nblocks = EXT2_BCACHE_MIN_BLOCKS;
+
+  while (nbuckets < nblocks)
+    nbuckets <<= 1;
+
+  memset (bcache, 0, sizeof (ext2_bcache_t));
+  bcache->nents = nblocks;
+  bcache->nbuckets = nbuckets;
+  bcache->buckets = malloc (nbuckets * sizeof (uint32_t));
+  bcache->ents = calloc (nblocks, sizeof (ext2_bcache_ent_t));
+  bcache->data = malloc (nblocks * fs->block_size);
+
+  if (bcache->buckets == NULL || bcache->ents == NULL || bcache->data == NULL)
+    {
+      ext2_bcache_fini (fs);
+      errno = -ENOMEM;
+      return -1;
+    }
+
+  memset (bcache->buckets, 0xff, nbuckets * sizeof (uint32_t));
+  return 0;
+}
+
+int
+ext2_fs_set_bcache_size (ext2_fs_t *fs, size_t nblocks)
+{
+  ext2_bcache_t old;
+
+  /* dirty blocks don't survive the swap */
+  if (ext2_fs_sync (fs) == -1)
+    return -1;
+
+  old = fs->bcache;
+  for (size_t i = 0; i < old.nents; i++)
+    if (old.ents[i].pins)
+      {
+        errno = -EBUSY;
+        return -1;
+      }
+
+  if (ext2_bcache_init (fs, nblocks) == -1)
+    {
+      fs->bcache = old;
+      return -1;
+    }
+
+  fs->bcache.hits = old.hits;
+  fs->bcache.misses = old.misses;
+
+  free (old.buckets);
+  free (old.ents);
+  free (old.data);
+
+  return 0;
+}
+
+static void
+ext2_bcache_unlink (ext2_bcache_t *bcache, uint32_t idx)
+{
+  uint32_t *link
+      = &bcache->buckets[ext2_bcache_bucket (bcache, bcache->ents[idx].block)];
+
+  while (*link != idx)
+    link = &bcache->ents[*link].next;
+
+  *link = bcache->ents[idx].next;
+}
+
+static uint32_t
+ext2_bcache_lookup (ext2_bcache_t *bcache, size_t block)
+{
+  uint32_t idx;
+
+  for (idx = bcache->buckets[ext2_bcache_bucket (bcache, block)];
+       idx != EXT2_BCACHE_NIL; idx = bcache->ents[idx].next)
+    if (bcache->ents[idx].block == block)
+      break;
+
+  return idx;
+}
+
+static void
+ext2_bcache_link (ext2_bcache_t *bcache, uint32_t idx, size_t block)
+{
+  ext2_bcache_ent_t *ent = bcache->ents + idx;
+
+  ent->block = block;
+  ent->valid = 1;
+  ent->next = bcache->buckets[ext2_bcache_bucket (bcache, block)];
+  bcache->buckets[ext2_bcache_bucket (bcache, block)] = idx;
+}
+
+static int
+ext2_bcache_writeback (ext2_fs_t *fs, uint32_t idx)
+{
+  ext2_bcache_t *bcache = &fs->bcache;
+  ext2_bcache_ent_t *ent = bcache->ents + idx;
+
+  if (file_pwrite (fs->file, bcache->data + idx * fs->block_size,
+                   fs->block_size, (size_t) ent->block * fs->block_size)
+      != (ssize_t) fs->block_size)
+    {
+      errno = -EIO;
+      return -1;
+    }
+
+  ent->dirty = 0;
+  bcache->ndirty--;
+  return 0;
+}
+
+static int
+ext2_bcache_victim (ext2_fs_t *fs, uint32_t *idx)
+{
+  ext2_bcache_t *bcache = &fs->bcache;
+
+  /* two sweeps clear every reference bit, anything left is pinned */
+  for (size_t i = 0; i < 2 * bcache->nents; i++)
+    {
+      ext2_bcache_ent_t *ent = bcache->ents + bcache->hand;
+      uint32_t cur = bcache->hand;
+
+      bcache->hand = (bcache->hand + 1) % bcache->nents;
+
+      if (ent->pins)
+        continue;
+
+      if (ent->valid && ent->ref)
+        {
+          ent->ref = 0;
+          continue;
+        }
+
+      /* a dirty block has to reach the image before its slot is reused */
+      if (ent->dirty && ext2_bcache_writeback (fs, cur) == -1)
+        return -1;
+
+      *idx = cur;
+      return 0;
+    }
+
+  errno = -EBUSY;
+  return -1;
+}
+
+typedef enum
+{
+  EXT2_BCACHE_PEEK, /* only return the block if it's already cached */
+  EXT2_BCACHE_READ, /* read it in on a miss */
+  EXT2_BCACHE_ZERO  /* a fresh block, never read, zero filled */
+} ext2_bcache_mode_t;
+
+static unsigned char *
+ext2_bcache_get (ext2_fs_t *fs, size_t block, ext2_bcache_mode_t mode)
+{
+  ext2_bcache_t *bcache = &fs->bcache;
+  ext2_bcache_ent_t *ent;
+  unsigned char *data;
+  uint32_t idx;
+
+  idx = ext2_bcache_lookup (bcache, block);
+  if (idx != EXT2_BCACHE_NIL)
+    {
+      ent = bcache->ents + idx;
+      bcache->hits++;
+      ent->ref = 1;
+      ent->pins++;
+
+      data = bcache->data + idx * fs->block_size;
+      if (mode == EXT2_BCACHE_ZERO)
+        memset (data, 0, fs->block_size);
+
+      return data;
+    }
+
+  if (mode == EXT2_BCACHE_PEEK)
+    return NULL;
+
+  bcache->misses++;
+
+  if (ext2_bcache_victim (fs, &idx) == -1)
+    return NULL;
+
+  ent = bcache->ents + idx;
+  data = bcache->data + idx * fs->block_size;
+
+  if (ent->valid)
+    {
+      ext2_bcache_unlink (bcache, idx);
+      ent->valid = 0;
+    }
+
+  if (mode == EXT2_BCACHE_ZERO)
+    memset (data, 0, fs->block_size);
+  else if (file_sread (fs->file, block * fs->block_size, FILE_SEEK_START,
+                       data, fs->block_size)
+           != (ssize_t) fs->block_size)
+    {
+      errno = -EIO;
+      return NULL;
+    }
+
+  ext2_bcache_link (bcache, idx, block);
+  ent->ref = 1;
+  ent->pins = 1;
+
+  return data;
+}
+
+/*
+ * Reads whichever of the given blocks are neither mapped nor cached into the
+ * cache as one batch, so that the ext2_get_block calls that follow all hit.
+ * Purely advisory, a block that can't be read is just left out.
+ */
+static void
+ext2_bcache_prefetch (ext2_fs_t *fs, const uint32_t *blocks, size_t nblks)
+{
+  ext2_bcache_t *bcache = &fs->bcache;
+  file_io_t ios[EXT2_PREFETCH_BLOCKS];
+  uint32_t idxs[EXT2_PREFETCH_BLOCKS];
+  size_t nios = 0;
+
+  /* leave the cache room for what the caller has pinned */
+  if (nblks > bcache->nents / 2)
+    nblks = bcache->nents / 2;
+
+  if (nblks > EXT2_PREFETCH_BLOCKS)
+    nblks = EXT2_PREFETCH_BLOCKS;
+
+  for (size_t i = 0; i < nblks; i++)
+    {
+      uint32_t block = blocks[i], idx;
+
+      if (!block || block >= fs->sb->block_cnt
+          || ext2_bcache_lookup (bcache, block) != EXT2_BCACHE_NIL)
+        continue;
+
+      /*
+       * A mapped block has nothing to gain. Only skip it: slots already
+       * taken for earlier blocks must still have their reads submitted,
+       * and a sparse image maps some blocks but not others.
+       */
+      if (ext2_borrow_from_block (fs, block, 0, fs->block_size) != NULL)
+        continue;
+
+      if (ext2_bcache_victim (fs, &idx) == -1)
+        break;
+
+      if (bcache->ents[idx].valid)
+        ext2_bcache_unlink (bcache, idx);
+
+      /* linked right away so duplicates are spotted, pinned till read */
+      ext2_bcache_link (bcache, idx, block);
+      bcache->ents[idx].pins = 1;
+
+      ios[nios].op = FILE_IO_READ;
+      ios[nios].buf = bcache->data + idx * fs->block_size;
+      ios[nios].nbytes = fs->block_size;
+      ios[nios].off = (size_t) block * fs->block_size;
+      idxs[nios++] = idx;
+    }
+
+  if (!nios)
+    return;
+
+  file_submit (fs->file, ios, nios);
+  bcache->misses += nios;
+
+  for (size_t i = 0; i < nios; i++)
+    {
+      ext2_bcache_ent_t *ent = bcache->ents + idxs[i];
+
+      ent->pins = 0;
+      ent->ref = 0;
+
+      if (ios[i].res != (ssize_t) fs->block_size)
+        {
+          ext2_bcache_unlink (bcache, idxs[i]);
+          ent->valid = 0;
+        }
+    }
+}
+
+/*
+ * Returns a pinned, read-only view of a whole block. The pointer stays valid
+ * until it is handed back with ext2_put_block.
+ */
+static const void *
+ext2_get_block (ext2_fs_t *fs, size_t block)
+{
+  const void *data;
+
+  if (block >= fs->sb->block_cnt)
+    {
+      errno = -EINVAL;
+      return NULL;
+    }
+
+  /* a cached copy may be newer than what the mapping shows */
+  data = ext2_bcache_get (fs, block, EXT2_BCACHE_PEEK);
+  if (data != NULL)
+    return data;
+
+  data = ext2_borrow_from_block (fs, block, 0, fs->block_size);
+  if (data != NULL)
+    return data;
+
+  return ext2_bcache_get (fs, block, EXT2_BCACHE_READ);
+}
+
+/*
+ * Like ext2_get_block, but always a writable cached copy. A fresh block
+ * isn't read, it comes back zeroed. Release with ext2_put_block, or with
+ * ext2_put_block_dirty if it was modified.
+ */
+static void *
+ext2_get_block_mut (ext2_fs_t *fs, size_t block, int fresh)
+{
+  if (block >= fs->sb->block_cnt)
+    {
+      errno = -EINVAL;
+      return NULL;
+    }
+
+  return ext2_bcache_get (fs, block,
+                          fresh ? EXT2_BCACHE_ZERO : EXT2_BCACHE_READ);
+}
+
+static void
+ext2_put_block (ext2_fs_t *fs, const void *data)
+{
+  ext2_bcache_t *bcache = &fs->bcache;
+  const unsigned char *ptr = data;
+  size_t idx;
+
+  /* borrowed from a mapping, nothing to release */
+  if (ptr < bcache->data || ptr >= bcache->data + bcache->nents * fs->block_size)
+    return;
+
+  idx = (ptr - bcache->data) / fs->block_size;
+  if (bcache->ents[idx].pins)
+    bcache->ents[idx].pins--;
+}
+
+/*
+ * Releases a block modified through ext2_get_block_mut. It isn't written
+ * out here; dirty blocks go to the image when they are evicted or at the
+ * next ext2_fs_sync, so a bitmap or inode table block updated once per
+ * file still costs a single write.
+ */
+static void
+ext2_put_block_dirty (ext2_fs_t *fs, void *data)
+{
+  ext2_bcache_t *bcache = &fs->bcache;
+  size_t idx = ((unsigned char *) data - bcache->data) / fs->block_size;
+
+  /* data may point anywhere into the block */
+  if (!bcache->ents[idx].dirty)
+    {
+      bcache->ents[idx].dirty = 1;
+      bcache->ndirty++;
+    }
+
+  ext2_put_block (fs, data);
+}
+
+/* like ext2_put_block_dirty, but the block is written out right away */
+static int
+ext2_put_block_sync (ext2_fs_t *fs, void *data)
+{
+  ext2_bcache_t *bcache = &fs->bcache;
+  size_t idx = ((unsigned char *) data - bcache->data) / fs->block_size;
+  int ret;
+
+  if (!bcache->ents[idx].dirty)
+    {
+      bcache->ents[idx].dirty = 1;
+      bcache->ndirty++;
+    }
+
+  ret = ext2_bcache_writeback (fs, idx);
+  ext2_put_block (fs, data);
+  return ret;
+}
+
+/* drops cached copies of blocks that were just written around the cache */
+static void
+ext2_bcache_invalidate (ext2_fs_t *fs, size_t block, size_t nblks)
+{
+  ext2_bcache_t *bcache = &fs->bcache;
+
+  for (size_t i = 0; i < nblks && bcache->nents; i++)
+    {
+      uint32_t idx = ext2_bcache_lookup (bcache, block + i);
+
+      if (idx == EXT2_BCACHE_NIL || bcache->ents[idx].pins)
+        continue;
+
+      /* whatever it held has just been overwritten */
+      if (bcache->ents[idx].dirty)
+        {
+          bcache->ents[idx].dirty = 0;
+          bcache->ndirty--;
+        }
+
+      ext2_bcache_unlink (bcache, idx);
+      bcache->ents[idx].valid = 0;
+    }
+}
+
+static int
+ext2_read_from_block (ext2_fs_t *fs, size_t block, size_t off, void *buf,
+                      size_t nbytes)
+{
+  unsigned char *dst = buf;
+  size_t left = nbytes;
+
+  if (block >= fs->sb->block_cnt)
+    return -3;
+
+  block += off / fs->block_size;
+  off %= fs->block_size;
+
+  while (left)
+    {
+      size_t n = fs->block_size - off;
+      const unsigned char *src;
+
+      if (n > left)
+        n = left;
+
+      src = ext2_get_block (fs, block);
+      if (src == NULL)
+        return -1;
+
+      memcpy (dst, src + off, n);
+      ext2_put_block (fs, src);
+
+      dst += n;
+      left -= n;
+      block++;
+      off = 0;
+    }
+
+  return nbytes;
+}
+
+/* the write counterpart of ext2_read_from_block, through the block cache */
+static int
+ext2_write_to_block (ext2_fs_t *fs, size_t block, size_t off, const void *buf,
+                     size_t nbytes)
+{
+  const unsigned char *src = buf;
+  size_t left = nbytes;
+
+  block += off / fs->block_size;
+  off %= fs->block_size;
+
+  while (left)
+    {
+      size_t n = fs->block_size - off;
+      unsigned char *dst;
+
+      if (n > left)
+        n = left;
+
+      dst = ext2_get_block_mut (fs, block, 0);
+      if (dst == NULL)
+        return -1;
+
+      memcpy (dst + off, src, n);
+      ext2_put_block_dirty (fs, dst);
+
+      src += n;
+      left -= n;
+      block++;
+      off = 0;
+    }
+
+  return 0;
+}
+
+static int
+ext2_read_inode (ext2_fs_t *fs, size_t inode, ext2_inode_t *buf)
+{
+  size_t block_group = (inode - 1) / fs->sb->inodes_per_group;
+  ext2_bgdt_t *bgdt;
+  size_t off;
+
+  if (!inode || inode > fs->sb->inode_cnt
+      || block_group >= fs->block_group_cnt)
+    {
+      errno = -EINVAL;
+      return -1;
+    }
+
+  bgdt = fs->bgdt + block_group;
+
+  /* only the rev 0 part is kept, any extra inode space is ignored */
+  off = fs->inode_size * ((inode - 1) % fs->sb->inodes_per_group);
+  if (ext2_read_from_block (fs, bgdt->inode_table, off, buf,
+                            sizeof (ext2_inode_t))
+      != (ssize_t) sizeof (ext2_inode_t))
+    {
+      errno = -EINVAL;
+      return -1;
+    }
+
+  return 0;
+}
+
+/*
+ * Writes the rev 0 part of an inode back to the table. A fresh inode also
+ * gets the rest of its on-disk slot cleared.
+ */
+static int
+ext2_write_inode (ext2_fs_t *fs, uint32_t ino, const ext2_inode_t *inode,
+                  int fresh)
+{
+  static const unsigned char zero[1024];
+  size_t group = (ino - 1) / fs->sb->inodes_per_group;
+  size_t off, extra = fs->inode_size - sizeof (ext2_inode_t);
+
+  if (!ino || ino > fs->sb->inode_cnt || group >= fs->block_group_cnt)
+    {
+      errno = -EINVAL;
+      return -1;
+    }
+
+  off = fs->inode_size * ((ino - 1) % fs->sb->inodes_per_group);
+  if (ext2_write_to_block (fs, fs->bgdt[group].inode_table, off, inode,
+                           sizeof (ext2_inode_t))
+      == -1)
+    return -1;
+
+  if (fresh && extra)
+    return ext2_write_to_block (fs, fs->bgdt[group].inode_table,
+                                off + sizeof (ext2_inode_t), zero,
+                                extra > sizeof (zero) ? sizeof (zero) : extra);
+
+  return 0;
+}
+
+#define ICACHE_ENT(inode) ((ext2_icache_ent_t *) (inode))
+
+static ext2_icache_ent_t **
+ext2_icache_bucket (ext2_icache_t *icache, uint32_t ino)
+{
+  return icache->buckets + (ino & (EXT2_ICACHE_BUCKETS - 1));
+}
+
+static void
+ext2_icache_unused_remove (ext2_icache_t *icache, ext2_icache_ent_t *ent)
+{
+  if (ent->prev != NULL)
+    ent->prev->next = ent->next;
+  else
+    icache->unused_head = ent->next;
+
+  if (ent->next != NULL)
+    ent->next->prev = ent->prev;
+  else
+    icache->unused_tail = ent->prev;
+
+  ent->prev = ent->next = NULL;
+  icache->nunused--;
+}
+
+static void
+ext2_icache_evict (ext2_icache_t *icache, ext2_icache_ent_t *ent)
+{
+  ext2_icache_ent_t **link = ext2_icache_bucket (icache, ent->ino);
+
+  while (*link != ent)
+    link = &(*link)->hnext;
+
+  *link = ent->hnext;
+
+  ext2_icache_unused_remove (icache, ent);
+
+  ent->ino = 0;
+  ent->next = icache->free;
+  icache->free = ent;
+}
+
+static ext2_icache_ent_t *
+ext2_icache_alloc (ext2_fs_t *fs)
+{
+  ext2_icache_t *icache = &fs->icache;
+  ext2_icache_ent_t *ent;
+
+  if (icache->free == NULL)
+    {
+      /* slabs live as long as the session, entries recycle within them */
+      ext2_icache_slab_t *slab
+          = ext2_arena_alloc (&fs->arena, sizeof (ext2_icache_slab_t));
+      if (slab == NULL)
+        {
+          /* last resort, recycle the oldest unused inode */
+          if (icache->unused_head == NULL)
+            {
+              errno = -ENOMEM;
+              return NULL;
+            }
+          ext2_icache_evict (icache, icache->unused_head);
+        }
+      else
+        {
+          for (size_t i = 0; i < EXT2_ICACHE_SLAB_INODES; i++)
+            {
+              slab->ents[i].ino = 0;
+              slab->ents[i].next = icache->free;
+              icache->free = slab->ents + i;
+            }
+        }
+    }
+
+  ent = icache->free;
+  icache->free = ent->next;
+  memset (ent, 0, sizeof (ext2_icache_ent_t));
+
+  return ent;
+}
+
+/*
+ * Returns a referenced inode, reading it at most once per session while
+ * something still holds it (and for a while after, see
+ * EXT2_ICACHE_MAX_UNUSED). Every successful call needs an ext2_inode_put.
+ */
+ext2_inode_t *
+ext2_inode_get (ext2_fs_t *fs, uint32_t ino)
+{
+  ext2_icache_t *icache = &fs->icache;
+  ext2_icache_ent_t **bucket = ext2_icache_bucket (icache, ino);
+  ext2_icache_ent_t *ent;
+
+  for (ent = *bucket; ent != NULL; ent = ent->hnext)
+    {
+      if (ent->ino != ino)
+        continue;
+
+      if (!ent->refcnt++)
+        ext2_icache_unused_remove (icache, ent);
+
+      icache->hits++;
+      return &ent->inode;
+    }
+
+  icache->misses++;
+
+  ent = ext2_icache_alloc (fs);
+  if (ent == NULL)
+    return NULL;
+
+  if (ext2_read_inode (fs, ino, &ent->inode) == -1)
+    {
+      ent->next = icache->free;
+      icache->free = ent;
+      return NULL;
+    }
+
+  ent->ino = ino;
+  ent->refcnt = 1;
+  ent->hnext = *bucket;
+  *bucket = ent;
+
+  return &ent->inode;
+}
+
+ext2_inode_t *
+ext2_inode_dup (ext2_inode_t *inode)
+{
+  ICACHE_ENT (inode)->refcnt++;
+  return inode;
+}
+
+void
+ext2_inode_put (ext2_fs_t *fs, ext2_inode_t *inode)
+{
+  ext2_icache_t *icache = &fs->icache;
+  ext2_icache_ent_t *ent = ICACHE_ENT (inode);
+
+  if (inode == NULL || --ent->refcnt)
+    return;
+
+  ent->prev = icache->unused_tail;
+  ent->next = NULL;
+
+  if (icache->unused_tail != NULL)
+    icache->unused_tail->next = ent;
+  else
+    icache->unused_head = ent;
+
+  icache->unused_tail = ent;
+
+  if (++icache->nunused > EXT2_ICACHE_MAX_UNUSED)
+    ext2_icache_evict (icache, icache->unused_head);
+}
+
+uint32_t
+ext2_inode_ino (ext2_inode_t *inode)
+{
+  return ICACHE_ENT (inode)->ino;
+}
+
+/*
+ * Reads the inode table blocks holding any of the given inodes that aren't
+ * cached yet in one batch, ahead of the ext2_inode_get calls for them.
+ * Sorting inos by number beforehand keeps the batch sequential.
+ */
+void
+ext2_inode_prefetch (ext2_fs_t *fs, const uint32_t *inos, size_t ninos)
+{
+  uint32_t blocks[EXT2_PREFETCH_BLOCKS];
+  size_t nblks = 0;
+
+  for (size_t i = 0; i < ninos; i++)
+    {
+      uint32_t ino = inos[i], block;
+      ext2_icache_ent_t *ent;
+      size_t group;
+
+      if (!ino || ino > fs->sb->inode_cnt)
+        continue;
+
+      for (ent = *ext2_icache_bucket (&fs->icache, ino); ent != NULL;
+           ent = ent->hnext)
+        if (ent->ino == ino)
+          break;
+
+      if (ent != NULL)
+        continue;
+
+      group = (ino - 1) / fs->sb->inodes_per_group;
+      block = fs->bgdt[group].inode_table
+              + fs->inode_size * ((ino - 1) % fs->sb->inodes_per_group)
+                    / fs->block_size;
+
+      if (nblks && blocks[nblks - 1] == block)
+        continue;
+
+      if (nblks == EXT2_PREFETCH_BLOCKS)
+        {
+          ext2_bcache_prefetch (fs, blocks, nblks);
+          nblks = 0;
+        }
+
+      blocks[nblks++] = block;
+    }
+
+  ext2_bcache_prefetch (fs, blocks, nblks);
+}
+
+/*
+ * Uncached read of a byte range, either borrowed from the mapping or read
+ * into buf. Touches no shared state, so it is safe to call from threads.
+ */
+static const void *
+ext2_read_direct (ext2_fs_t *fs, size_t block, size_t off, void *buf,
+                  size_t nbytes)
+{
+  const void *mapped = ext2_borrow_from_block (fs, block, off, nbytes);
+
+  if (mapped != NULL)
+    return mapped;
+
+  if (file_pread (fs->file, buf, nbytes, block * fs->block_size + off)
+      != (ssize_t) nbytes)
+    {
+      errno = -EIO;
+      return NULL;
+    }
+
+  return buf;
+}
+
+static int
+ext2_bitmap_test (const unsigned char *bitmap, size_t bit)
+{
+  return bitmap[bit >> 3] & (1 << (bit & 7));
+}
+
+static int
+ext2_bitmap_any (const unsigned char *bitmap, size_t lo, size_t hi)
+{
+  for (; lo < hi && (lo & 7); lo++)
+    if (ext2_bitmap_test (bitmap, lo))
+      return 1;
+
+  for (; lo + 8 <= hi; lo += 8)
+    if (bitmap[lo >> 3])
+      return 1;
+
+  for (; lo < hi; lo++)
+    if (ext2_bitmap_test (bitmap, lo))
+      return 1;
+
+  return 0;
+}
+
+/*
+ * Set bits among the first nbits, a 64-bit word at a time. On x86-64 a
+ * copy built for the popcnt instruction is picked at load time where the
+ * CPU has it.
+ */
+#if defined(__x86_64__)
+__attribute__ ((target_clones ("popcnt", "default")))
+#endif
+static size_t
+ext2_bitmap_count (const unsigned char *bitmap, size_t nbits)
+{
+  size_t n0 = 0, n1 = 0, n2 = 0, n3 = 0, i = 0;
+  uint64_t w[4];
+
+  /* four independent sums, so the popcounts don't wait on each other */
+  for (; i + 256 <= nbits; i += 256)
+    {
+      memcpy (w, bitmap + i / 8, sizeof (w));
+      n0 += __builtin_popcountll (w[0]);
+      n1 += __builtin_popcountll (w[1]);
+      n2 += __builtin_popcountll (w[2]);
+      n3 += __builtin_popcountll (w[3]);
+    }
+
+  for (; i + 64 <= nbits; i += 64)
+    {
+      memcpy (w, bitmap + i / 8, sizeof (uint64_t));
+      n0 += __builtin_popcountll (w[0]);
+    }
+
+  for (; i < nbits; i++)
+    if (ext2_bitmap_test (bitmap, i))
+      n0++;
+
+  return n0 + n1 + n2 + n3;
+}
+
+static int
+ext2_scan_group_buf (ext2_fs_t *fs, size_t group, unsigned char *buf,
+                     ext2_inode_iter_t iter, void *arg)
+{
+  ext2_bgdt_t *bgdt = fs->bgdt + group;
+  size_t per_chunk = EXT2_SCAN_CHUNK / fs->inode_size;
+  size_t ninodes = fs->sb->inodes_per_group;
+  const unsigned char *bitmap;
+  int ret;
+
+  bitmap = ext2_read_direct (fs, bgdt->inode_bitmap, 0, buf, fs->block_size);
+  if (bitmap == NULL)
+    return -1;
+
+  /* the bitmap must survive the table reads below */
+  if (bitmap == buf)
+    {
+      memcpy (buf + EXT2_SCAN_CHUNK, buf, fs->block_size);
+      bitmap = buf + EXT2_SCAN_CHUNK;
+    }
+
+  if (ninodes > fs->block_size * 8)
+    ninodes = fs->block_size * 8;
+
+  /* don't read the unused tail of the table */
+  while (ninodes && !ext2_bitmap_test (bitmap, ninodes - 1))
+    ninodes--;
+
+  for (size_t first = 0; first < ninodes; first += per_chunk)
+    {
+      size_t last = first + per_chunk > ninodes ? ninodes : first + per_chunk;
+      const unsigned char *table;
+
+      if (!ext2_bitmap_any (bitmap, first, last))
+        continue;
+
+      table = ext2_read_direct (fs, bgdt->inode_table,
+                                first * fs->inode_size, buf,
+                                (last - first) * fs->inode_size);
+      if (table == NULL)
+        return -1;
+
+      for (size_t i = first; i < last; i++)
+        {
+          ext2_inode_t inode;
+          uint32_t ino = group * fs->sb->inodes_per_group + i + 1;
+
+          if (!ext2_bitmap_test (bitmap, i))
+            continue;
+
+          /* copied out, the table may not be aligned for ext2_inode_t */
+          memcpy (&inode, table + (i - first) * fs->inode_size,
+                  sizeof (ext2_inode_t));
+
+          if ((ret = iter (fs, ino, &inode, arg)))
+            return ret;
+        }
+    }
+
+  return 0;
+}
+
+static unsigned char *
+ext2_scan_alloc (ext2_fs_t *fs)
+{
+  /* one chunk of inode table plus a copy of the inode bitmap */
+  unsigned char *buf = malloc (EXT2_SCAN_CHUNK + fs->block_size);
+
+  if (buf == NULL)
+    errno = -ENOMEM;
+
+  return buf;
+}
+
+/*
+ * Calls iter for every in-use inode of a block group, in inode-table order.
+ * The table is read sequentially in EXT2_SCAN_CHUNK sized pieces and chunks
+ * with no allocated inodes are skipped entirely. A non-zero return from iter
+ * stops the scan and is passed through. The reads bypass the block cache, so
+ * pending metadata is synced first.
+ */
+int
+ext2_scan_group (ext2_fs_t *fs, size_t group, ext2_inode_iter_t iter,
+                 void *arg)
+{
+  unsigned char *buf;
+  int ret;
+
+  if (group >= fs->block_group_cnt)
+    {
+      errno = -EINVAL;
+      return -1;
+    }
+
+  if (ext2_fs_sync (fs) == -1)
+    return -1;
+
+  buf = ext2_scan_alloc (fs);
+  if (buf == NULL)
+    return -1;
+
+  ret = ext2_scan_group_buf (fs, group, buf, iter, arg);
+
+  free (buf);
+  return ret;
+}
+
+int
+ext2_scan_inodes (ext2_fs_t *fs, ext2_inode_iter_t iter, void *arg)
+{
+  unsigned char *buf;
+  int ret = 0;
+
+  if (ext2_fs_sync (fs) == -1)
+    return -1;
+
+  buf = ext2_scan_alloc (fs);
+  if (buf == NULL)
+    return -1;
+
+  for (size_t group = 0; group < fs->block_group_cnt && !ret; group++)
+    ret = ext2_scan_group_buf (fs, group, buf, iter, arg);
+
+  free (buf);
+  return ret;
+}
+
+/*
+ * Counts the blocks and inodes a group has and how many of them its bitmaps
+ * mark in use. Padding bits past the end of the last group are left out.
+ * Like the scans this reads past the block cache, without taking the lock,
+ * so several threads can count groups at once; sync before if anything
+ * may be pending.
+ */
+int
+ext2_count_group (ext2_fs_t *fs, size_t group, ext2_group_count_t *count)
+{
+  ext2_bgdt_t *bgdt = fs->bgdt + group;
+  size_t first = fs->sb->first_block + group * fs->sb->blocks_per_group;
+  const unsigned char *bitmap;
+  unsigned char *buf;
+  int ret = -1;
+
+  if (group >= fs->block_group_cnt)
+    {
+      errno = -EINVAL;
+      return -1;
+    }
+
+  buf = malloc (fs->block_size);
+  if (buf == NULL)
+    {
+      errno = -ENOMEM;
+      return -1;
+    }
+
+  count->nblocks = fs->sb->block_cnt - first;
+  if (count->nblocks > fs->sb->blocks_per_group)
+    count->nblocks = fs->sb->blocks_per_group;
+
+  count->ninodes = fs->sb->inodes_per_group;
+
+  /* a bitmap is one block, a group can't describe more than that */
+  if (count->nblocks > fs->block_size * 8
+      || count->ninodes > fs->block_size * 8)
+    {
+      errno = -EINVAL;
+      goto out;
+    }
+
+  bitmap = ext2_read_direct (fs, bgdt->block_bitmap, 0, buf, fs->block_size);
+  if (bitmap == NULL)
+    goto out;
+
+  count->used_blocks = ext2_bitmap_count (bitmap, count->nblocks);
+
+  bitmap = ext2_read_direct (fs, bgdt->inode_bitmap, 0, buf, fs->block_size);
+  if (bitmap == NULL)
+    goto out;
+
+  count->used_inodes = ext2_bitmap_count (bitmap, count->ninodes);
+  ret = 0;
+
+out:
+  free (buf);
+  return ret;
+}
+
+static int
+ext2_is_power (size_t n, size_t base)
+{
+  while (n > 1 && n % base == 0)
+    n /= base;
+
+  return n == 1;
+}
+
+/*
+ * Whether a group starts with a copy of the superblock and the BGDT. With
+ * sparse_super only groups 0 and 1 and the powers of 3, 5 and 7 do. Takes
+ * the superblock's rdo_flags rather than a filesystem, so mkfs can lay out
+ * groups before there is one.
+ */
+int
+ext2_group_has_super (uint32_t rdo_flags, size_t group)
+{
+  if (!(rdo_flags & EXT2_RDO_FLAG_SPARSE_SB))
+    return 1;
+
+  return group <= 1 || ext2_is_power (group, 3) || ext2_is_power (group, 5)
+         || ext2_is_power (group, 7);
+}
+
+typedef struct
+{
+  ext2_fs_t *fs;
+  ext2_group_iter_t iter;
+  void *arg;
+  size_t next; /* next group to hand out */
+  int failed;  /* tells the other workers to stop */
+} ext2_group_pool_t;
+
+static void *
+ext2_group_worker (void *arg)
+{
+  ext2_group_pool_t *pool = arg;
+
+  while (!__atomic_load_n (&pool->failed, __ATOMIC_RELAXED))
+    {
+      size_t group = __atomic_fetch_add (&pool->next, 1, __ATOMIC_RELAXED);
+
+      if (group >= pool->fs->block_group_cnt)
+        break;
+
+      if (pool->iter (pool->fs, group, pool->arg) == -1)
+        __atomic_store_n (&pool->failed, 1, __ATOMIC_RELAXED);
+    }
+
+  return NULL;
+}
+
+/*
+ * Calls iter for every group on up to jobs threads, one per CPU if jobs is
+ * not positive. Groups are handed out one at a time, every thread takes the
+ * next one. The calling thread works too, and a thread that won't start
+ * isn't fatal. Once iter fails no more groups are handed out and -1 is
+ * returned. iter must be safe to call from several threads at once.
+ */
+int
+ext2_for_each_group (ext2_fs_t *fs, long jobs, ext2_group_iter_t iter,
+                     void *arg)
+{
+  ext2_group_pool_t pool = { fs, iter, arg, 0, 0 };
+  pthread_t *threads;
+  int *started;
+
+  if (jobs <= 0)
+    jobs = sysconf (_SC_NPROCESSORS_ONLN);
+  if (jobs <= 0)
+    jobs = 1;
+  if ((size_t) jobs > fs->block_group_cnt)
+    jobs = fs->block_group_cnt;
+
+  threads = malloc (sizeof (pthread_t) * jobs);
+  started = malloc (sizeof (int) * jobs);
+  if (threads == NULL || started == NULL)
+    jobs = 1;
+
+  for (long i = 1; i < jobs; i++)
+    started[i] = !pthread_create (threads + i, NULL, ext2_group_worker, &pool);
+
+  ext2_group_worker (&pool);
+
+  for (long i = 1; i < jobs; i++)
+    if (started[i])
+      pthread_join (threads[i], NULL);
+
+  free (threads);
+  free (started);
+
+  return pool.failed ? -1 : 0;
+}
+
+/* block and inode allocation */
+
+static uint64_t
+ext2_bitmap_word (const unsigned char *bitmap, size_t word)
+{
+  uint64_t w;
+
+  /* bitmaps are little endian, bit n of the group is bit n % 64 of a word */
+  memcpy (&w, bitmap + word * sizeof (uint64_t), sizeof (uint64_t));
+  return w;
+}
+
+/*
+ * Finds the first bit in [lo, hi) that is set (or clear, if set is 0),
+ * returning hi if there is none. Looks at 64 bits per step; hi must not
+ * go past the end of the bitmap block.
+ */
+static size_t
+ext2_bitmap_find (const unsigned char *bitmap, size_t lo, size_t hi, int set)
+{
+  uint64_t flip = set ? 0 : ~(uint64_t) 0;
+
+  while (lo < hi)
+    {
+      uint64_t w = (ext2_bitmap_word (bitmap, lo / 64) ^ flip)
+                   & (~(uint64_t) 0 << (lo % 64));
+
+      if (w)
+        {
+          lo = lo / 64 * 64 + __builtin_ctzll (w);
+          return lo < hi ? lo : hi;
+        }
+
+      lo = lo / 64 * 64 + 64;
+    }
+
+  return hi;
+}
+
+static void
+ext2_bitmap_fill (unsigned char *bitmap, size_t lo, size_t n, int set)
+{
+  size_t hi = lo + n;
+
+  for (; lo < hi && (lo & 7); lo++)
+    bitmap[lo >> 3] = set ? bitmap[lo >> 3] | 1 << (lo & 7)
+                          : bitmap[lo >> 3] & ~(1 << (lo & 7));
+
+  if (lo + 8 <= hi)
+    {
+      memset (bitmap + (lo >> 3), set ? 0xff : 0, (hi - lo) >> 3);
+      lo += (hi - lo) & ~(size_t) 7;
+    }
+
+  for (; lo < hi; lo++)
+    bitmap[lo >> 3] = set ? bitmap[lo >> 3] | 1 << (lo & 7)
+                          : bitmap[lo >> 3] & ~(1 << (lo & 7));
+}
+
+/* number of blocks actually in a group, the last one may be short */
+static size_t
+ext2_group_nblocks (ext2_fs_t *fs, size_t group)
+{
+  size_t first = fs->sb->first_block + group * fs->sb->blocks_per_group;
+  size_t n = fs->sb->block_cnt - first;
+
+  return n < fs->sb->blocks_per_group ? n : fs->sb->blocks_per_group;
+}
+
+/*
+ * The allocator works on one group at a time, under that group's lock. Its
+ * bitmap is pinned in the block cache before the group lock is taken and
+ * released after it is dropped, so fs->lock is only ever held around the
+ * cache itself and always taken first. Threads allocating from different
+ * groups then only meet on the cache for a moment.
+ */
+static unsigned char *
+ext2_group_bitmap_get (ext2_fs_t *fs, uint32_t block)
+{
+  unsigned char *bitmap;
+
+  pthread_mutex_lock (&fs->lock);
+  bitmap = ext2_get_block_mut (fs, block, 0);
+  pthread_mutex_unlock (&fs->lock);
+
+  return bitmap;
+}
+
+static void
+ext2_group_bitmap_put (ext2_fs_t *fs, unsigned char *bitmap, int dirty)
+{
+  pthread_mutex_lock (&fs->lock);
+
+  if (dirty)
+    ext2_put_block_dirty (fs, bitmap);
+  else
+    ext2_put_block (fs, bitmap);
+
+  pthread_mutex_unlock (&fs->lock);
+}
+
+/*
+ * The free counts are updated atomically: the superblock's are shared by
+ * all groups, and a group's are read without its lock to skip full groups.
+ * They are written back with everything else at sync time.
+ */
+static void
+ext2_count_free_blocks (ext2_fs_t *fs, size_t group, int delta)
+{
+  __atomic_add_fetch (&fs->bgdt[group].num_free_blks, (uint16_t) delta,
+                      __ATOMIC_RELAXED);
+  __atomic_add_fetch (&fs->sb->free_block_cnt, (uint32_t) delta,
+                      __ATOMIC_RELAXED);
+
+  __atomic_store_n (&fs->bgdt_dirty, 1, __ATOMIC_RELEASE);
+  __atomic_store_n (&fs->sb_dirty, 1, __ATOMIC_RELEASE);
+}
+
+static void
+ext2_count_free_inodes (ext2_fs_t *fs, size_t group, int delta, int is_dir)
+{
+  __atomic_add_fetch (&fs->bgdt[group].num_free_inodes, (uint16_t) delta,
+                      __ATOMIC_RELAXED);
+  __atomic_add_fetch (&fs->sb->free_inode_cnt, (uint32_t) delta,
+                      __ATOMIC_RELAXED);
+  if (is_dir)
+    __atomic_sub_fetch (&fs->bgdt[group].num_dirs, (uint16_t) delta,
+                        __ATOMIC_RELAXED);
+
+  __atomic_store_n (&fs->bgdt_dirty, 1, __ATOMIC_RELEASE);
+  __atomic_store_n (&fs->sb_dirty, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Looks through [lo, hi) of a group's block bitmap for want free blocks in
+ * a row and claims the first such run. Failing that, the longest shorter
+ * run is claimed if take_short and only measured otherwise. Returns the
+ * length of that run, with its first bit in *bit, or 0 if there is none.
+ */
+static ssize_t
+ext2_group_take_blocks (ext2_fs_t *fs, size_t group, size_t lo, size_t hi,
+                        size_t want, int take_short, size_t *bit)
+{
+  size_t best_bit = 0, best_len = 0;
+  unsigned char *bitmap;
+  int claim;
+
+  bitmap = ext2_group_bitmap_get (fs, fs->bgdt[group].block_bitmap);
+  if (bitmap == NULL)
+    return -1;
+
+  pthread_mutex_lock (fs->group_locks + group);
+
+  while (lo < hi && best_len < want)
+    {
+      size_t start = ext2_bitmap_find (bitmap, lo, hi, 0);
+      size_t end = ext2_bitmap_find (bitmap, start, hi, 1);
+
+      if (end - start > best_len)
+        {
+          best_bit = start;
+          best_len = end - start;
+        }
+
+      lo = end;
+    }
+
+  if (best_len > want)
+    best_len = want;
+
+  claim = best_len && (best_len == want || take_short);
+  if (claim)
+    {
+      ext2_bitmap_fill (bitmap, best_bit, best_len, 1);
+      ext2_count_free_blocks (fs, group, -(int) best_len);
+    }
+
+  pthread_mutex_unlock (fs->group_locks + group);
+  ext2_group_bitmap_put (fs, bitmap, claim);
+
+  *bit = best_bit;
+  return best_len;
+}
+
+/*
+ * Allocates a run of up to want contiguous blocks. Groups are searched from
+ * the one holding goal onwards, starting at goal itself, and the first free
+ * run of at least want blocks wins; if there is none the longest run seen is
+ * taken instead. Free runs are found with word-wide scans of the bitmaps,
+ * so a full or nearly full group costs a handful of loads rather than a
+ * test per block.
+ */
+static int
+ext2_alloc_blocks (ext2_fs_t *fs, size_t goal, size_t want, uint32_t *start,
+                   size_t *got)
+{
+  size_t bpg = fs->sb->blocks_per_group;
+  size_t ngroups = fs->block_group_cnt;
+  size_t goal_group = 0, goal_bit = 0;
+  size_t best_group = 0, best_len = 0;
+  size_t group, bit;
+  ssize_t len;
+
+  if (!want)
+    want = 1;
+
+  if (goal >= fs->sb->first_block && goal < fs->sb->block_cnt)
+    {
+      goal_group = (goal - fs->sb->first_block) / bpg;
+      goal_bit = (goal - fs->sb->first_block) % bpg;
+    }
+
+  /* one extra round picks up the part of the goal group before goal */
+  for (size_t i = 0; i <= ngroups; i++)
+    {
+      size_t lo = i == 0 ? goal_bit : 0, hi;
+
+      group = (goal_group + i) % ngroups;
+      hi = i == ngroups ? goal_bit : ext2_group_nblocks (fs, group);
+
+      if (!__atomic_load_n (&fs->bgdt[group].num_free_blks, __ATOMIC_RELAXED)
+          || lo >= hi)
+        continue;
+
+      len = ext2_group_take_blocks (fs, group, lo, hi, want, 0, &bit);
+      if (len == -1)
+        return -1;
+
+      if ((size_t) len == want)
+        goto out;
+
+      if ((size_t) len > best_len)
+        {
+          best_group = group;
+          best_len = len;
+        }
+    }
+
+  /*
+   * Settle for a shorter run, the longest one seen first. Other threads may
+   * have taken it in the meantime, then any group with room left will do.
+   */
+  for (size_t i = 0; i <= ngroups; i++)
+    {
+      group = i == 0 ? best_group : (goal_group + i - 1) % ngroups;
+
+      if ((i == 0 && !best_len)
+          || !__atomic_load_n (&fs->bgdt[group].num_free_blks,
+                               __ATOMIC_RELAXED))
+        continue;
+
+      len = ext2_group_take_blocks (fs, group, 0,
+                                    ext2_group_nblocks (fs, group), want, 1,
+                                    &bit);
+      if (len == -1)
+        return -1;
+
+      if (len)
+        goto out;
+    }
+
+  errno = -ENOSPC;
+  return -1;
+
+out:
+  *start = fs->sb->first_block + group * bpg + bit;
+  *got = len;
+  return 0;
+}
+
+/* hands back a run allocated by ext2_alloc_blocks, or any part of one */
+static int
+ext2_free_blocks (ext2_fs_t *fs, uint32_t start, size_t n)
+{
+  size_t bpg = fs->sb->blocks_per_group;
+  size_t group = (start - fs->sb->first_block) / bpg;
+  unsigned char *bitmap;
+
+  if (!n)
+    return 0;
+
+  bitmap = ext2_group_bitmap_get (fs, fs->bgdt[group].block_bitmap);
+  if (bitmap == NULL)
+    return -1;
+
+  pthread_mutex_lock (fs->group_locks + group);
+  ext2_bitmap_fill (bitmap, (start - fs->sb->first_block) % bpg, n, 0);
+  ext2_count_free_blocks (fs, group, n);
+  pthread_mutex_unlock (fs->group_locks + group);
+
+  ext2_group_bitmap_put (fs, bitmap, 1);
+  return 0;
+}
+
+/* allocates an inode, from the given group if it has any left */
+static int
+ext2_alloc_inode (ext2_fs_t *fs, size_t goal_group, int is_dir, uint32_t *ino)
+{
+  size_t ipg = fs->sb->inodes_per_group;
+  size_t first_ino = ext2_has_extended_sb (fs->sb) ? fs->sb->first_inode : 11;
+
+  for (size_t i = 0; i < fs->block_group_cnt; i++)
+    {
+      size_t group = (goal_group + i) % fs->block_group_cnt;
+      size_t lo = group ? 0 : first_ino - 1;
+      unsigned char *bitmap;
+      size_t bit;
+
+      if (!__atomic_load_n (&fs->bgdt[group].num_free_inodes,
+                            __ATOMIC_RELAXED)
+          || lo >= ipg)
+        continue;
+
+      bitmap = ext2_group_bitmap_get (fs, fs->bgdt[group].inode_bitmap);
+      if (bitmap == NULL)
+        return -1;
+
+      pthread_mutex_lock (fs->group_locks + group);
+
+      bit = ext2_bitmap_find (bitmap, lo, ipg, 0);
+      if (bit < ipg)
+        {
+          ext2_bitmap_fill (bitmap, bit, 1, 1);
+          ext2_count_free_inodes (fs, group, -1, is_dir);
+        }
+
+      pthread_mutex_unlock (fs->group_locks + group);
+      ext2_group_bitmap_put (fs, bitmap, bit < ipg);
+
+      if (bit < ipg)
+        {
+          *ino = group * ipg + bit + 1;
+          return 0;
+        }
+    }
+
+  errno = -ENOSPC;
+  return -1;
+}
+
+/* hands back an inode taken by ext2_alloc_inode */
+static int
+ext2_free_inode (ext2_fs_t *fs, uint32_t ino, int is_dir)
+{
+  size_t ipg = fs->sb->inodes_per_group;
+  size_t group = (ino - 1) / ipg;
+  unsigned char *bitmap;
+
+  bitmap = ext2_group_bitmap_get (fs, fs->bgdt[group].inode_bitmap);
+  if (bitmap == NULL)
+    return -1;
+
+  pthread_mutex_lock (fs->group_locks + group);
+  ext2_bitmap_fill (bitmap, (ino - 1) % ipg, 1, 0);
+  ext2_count_free_inodes (fs, group, 1, is_dir);
+  pthread_mutex_unlock (fs->group_locks + group);
+
+  ext2_group_bitmap_put (fs, bitmap, 1);
+  return 0;
+}
+
+static int
+ext2_has_filetype (ext2_fs_t *fs)
+{
+  return ext2_has_extended_sb (fs->sb)
+         && (fs->sb->req_flags & EXT2_REQ_FLAG_DIR_ENTS_HAVE_TYPE);
+}
+
+uint64_t
+ext2_inode_get_size (ext2_fs_t *fs, const ext2_inode_t *inode)
+{
+  uint64_t size = inode->nbytes_lo;
+
+  /* nbytes_hi is the directory ACL on anything but regular files */
+  if (ext2_has_extended_sb (fs->sb)
+      && EXT2_INODE_TYPE (inode->mode) == EXT2_INODE_TYPE_REG_FILE)
+    size |= (uint64_t) inode->nbytes_hi << 32;
+
+  return size;
+}
+
+file_type_t
+ext2_inode_get_type (const ext2_inode_t *inode)
+{
+  switch (EXT2_INODE_TYPE (inode->mode))
+    {
+    case EXT2_INODE_TYPE_FIFO:
+      return FILE_TYPE_PIPE;
+    case EXT2_INODE_TYPE_CHR_DEV:
+      return FILE_TYPE_CHAR;
+    case EXT2_INODE_TYPE_DIR:
+      return FILE_TYPE_DIR;
+    case EXT2_INODE_TYPE_BLK_DEV:
+      return FILE_TYPE_BLOCK;
+    case EXT2_INODE_TYPE_REG_FILE:
+      return FILE_TYPE_FILE;
+    case EXT2_INODE_TYPE_SYM_LINK:
+      return FILE_TYPE_SYM;
+    case EXT2_INODE_TYPE_SOCK:
+      return FILE_TYPE_SOCK;
+    default:
+      return FILE_TYPE_UNKN;
+    }
+}
+
+static file_type_t
+ext2_ft_get_type (uint8_t ft)
+{
+  switch (ft)
+    {
+    case EXT2_FT_REG_FILE:
+      return FILE_TYPE_FILE;
+    case EXT2_FT_DIR:
+      return FILE_TYPE_DIR;
+    case EXT2_FT_CHR_DEV:
+      return FILE_TYPE_CHAR;
+    case EXT2_FT_BLK_DEV:
+      return FILE_TYPE_BLOCK;
+    case EXT2_FT_FIFO:
+      return FILE_TYPE_PIPE;
+    case EXT2_FT_SOCK:
+      return FILE_TYPE_SOCK;
+    case EXT2_FT_SYM_LINK:
+      return FILE_TYPE_SYM;
+    default:
+      return FILE_TYPE_UNKN;
+    }
+}
+
+static int
+ext2_inode_is_fast_symlink (const ext2_inode_t *inode)
+{
+  /* short targets live in block[] and own no blocks */
+  return EXT2_INODE_TYPE (inode->mode) == EXT2_INODE_TYPE_SYM_LINK
+         && inode->num_sectors == 0;
+}
+
+/* levels of indirection to lblk, 0 for the direct blocks */
+static size_t
+ext2_bmap_depth (ext2_fs_t *fs, size_t lblk)
+{
+  size_t per_block = fs->block_size / sizeof (uint32_t);
+  size_t span = per_block, depth = 1;
+
+  if (lblk < EXT2_NDIR_BLOCKS)
+    return 0;
+
+  for (lblk -= EXT2_NDIR_BLOCKS; lblk >= span && depth <= 3; depth++)
+    {
+      lblk -= span;
+      span *= per_block;
+    }
+
+  return depth;
+}
+
+/*
+ * Finds the array of block pointers that holds lblk: either inode->block or
+ * a pinned indirect block, which the caller releases via *pinned. *cnt is
+ * how many consecutive logical blocks the array covers from lblk on. A NULL
+ * *entries means those *cnt blocks are a hole under a missing indirect block.
+ * nblks says how far the caller is going to walk; the indirect blocks
+ * needed for that are read ahead in one batch.
+ */
+static int
+ext2_bmap_span (ext2_fs_t *fs, const ext2_inode_t *inode, size_t lblk,
+                size_t nblks, const uint32_t **entries, size_t *cnt,
+                const void **pinned)
+{
+  size_t per_block = fs->block_size / sizeof (uint32_t);
+  size_t span = per_block;
+  size_t depth = 1;
+  uint32_t block;
+
+  *pinned = NULL;
+
+  if (lblk < EXT2_NDIR_BLOCKS)
+    {
+      *entries = inode->block + lblk;
+      *cnt = EXT2_NDIR_BLOCKS - lblk;
+      return 0;
+    }
+
+  lblk -= EXT2_NDIR_BLOCKS;
+
+  while (lblk >= span)
+    {
+      lblk -= span;
+      span *= per_block;
+
+      if (++depth > 3)
+        {
+          errno = -EFBIG;
+          return -1;
+        }
+    }
+
+  block = inode->block[EXT2_IND_BLOCK + depth - 1];
+
+  for (;;)
+    {
+      const uint32_t *table;
+
+      if (!block)
+        {
+          *entries = NULL;
+          *cnt = span - lblk;
+          return 0;
+        }
+
+      table = ext2_get_block (fs, block);
+      if (table == NULL)
+        return -1;
+
+      if (span == per_block)
+        {
+          *entries = table + lblk;
+          *cnt = per_block - lblk;
+          *pinned = table;
+          return 0;
+        }
+
+      span /= per_block;
+
+      /* the pointer blocks one level down that the walk will need */
+      if (nblks > 1)
+        {
+          size_t last = (lblk + nblks - 1) / span;
+
+          if (last >= per_block)
+            last = per_block - 1;
+
+          if (last > lblk / span)
+            ext2_bcache_prefetch (fs, table + lblk / span,
+                                  last - lblk / span + 1);
+        }
+
+      block = table[lblk / span];
+      lblk %= span;
+
+      ext2_put_block (fs, table);
+    }
+}
+
+/*
+ * Maps a logical block of an inode to its physical block, walking the
+ * indirect blocks through the block cache. A hole maps to block 0.
+ */
+int
+ext2_bmap (ext2_fs_t *fs, const ext2_inode_t *inode, size_t lblk,
+           uint32_t *pblk)
+{
+  const uint32_t *entries;
+  const void *pinned;
+  size_t cnt;
+
+  if (ext2_bmap_span (fs, inode, lblk, 1, &entries, &cnt, &pinned) == -1)
+    return -1;
+
+  *pblk = entries != NULL ? entries[0] : 0;
+
+  if (pinned != NULL)
+    ext2_put_block (fs, pinned);
+
+  return 0;
+}
+
+/*
+ * Describes nblks logical blocks from lblk on as runs of physically
+ * contiguous blocks (or holes), one indirect block lookup per pointer array
+ * rather than per block. At most *nruns runs are produced; returns how many
+ * logical blocks they cover, which may fall short of nblks when they run out.
+ */
+ssize_t
+ext2_map_runs (ext2_fs_t *fs, const ext2_inode_t *inode, size_t lblk,
+               size_t nblks, ext2_run_t *runs, size_t *nruns)
+{
+  size_t max = *nruns, n = 0, done = 0;
+  size_t lo = ext2_bmap_depth (fs, lblk);
+  size_t hi = nblks ? ext2_bmap_depth (fs, lblk + nblks - 1) : 0;
+
+  /* the top level indirect blocks the range goes through, as one batch */
+  if (hi > 3)
+    hi = 3;
+
+  if (lo < 1)
+    lo = 1;
+
+  if (hi >= lo)
+    ext2_bcache_prefetch (fs, inode->block + EXT2_IND_BLOCK + lo - 1,
+                          hi - lo + 1);
+
+  while (done < nblks)
+    {
+      const uint32_t *entries;
+      const void *pinned;
+      size_t cnt;
+
+      if (ext2_bmap_span (fs, inode, lblk + done, nblks - done, &entries,
+                          &cnt, &pinned)
+          == -1)
+        {
+          if (!done)
+            return -1;
+          break;
+        }
+
+      if (cnt > nblks - done)
+        cnt = nblks - done;
+
+      for (size_t i = 0; i < cnt; i++, done++)
+        {
+          uint32_t pblk = entries != NULL ? entries[i] : 0;
+          ext2_run_t *last = n ? runs + n - 1 : NULL;
+
+          if (last != NULL
+              && (pblk ? last->pblk && pblk == last->pblk + last->len
+                       : !last->pblk))
+            {
+              last->len++;
+              continue;
+            }
+
+          if (n == max)
+            {
+              if (pinned != NULL)
+                ext2_put_block (fs, pinned);
+              goto out;
+            }
+
+          runs[n].lblk = lblk + done;
+          runs[n].pblk = pblk;
+          runs[n].len = 1;
+          n++;
+        }
+
+      if (pinned != NULL)
+        ext2_put_block (fs, pinned);
+    }
+
+out:
+  *nruns = n;
+  return done;
+}
+
+static int
+ext2_walk_level (ext2_fs_t *fs, uint32_t block, size_t depth,
+                 unsigned char *buf, ext2_block_iter_t iter, void *arg)
+{
+  size_t per_block = fs->block_size / sizeof (uint32_t);
+  const unsigned char *table;
+  int ret;
+
+  if ((ret = iter (fs, block, depth, arg)))
+    return ret;
+
+  /* a pointer block outside the image has nothing to follow */
+  if (!depth || block < fs->sb->first_block || block >= fs->sb->block_cnt)
+    return 0;
+
+  table = ext2_read_direct (fs, block, 0, buf, fs->block_size);
+  if (table == NULL)
+    return -1;
+
+  for (size_t i = 0; i < per_block; i++)
+    {
+      uint32_t next;
+
+      memcpy (&next, table + i * sizeof (uint32_t), sizeof (uint32_t));
+
+      if (next
+          && (ret = ext2_walk_level (fs, next, depth - 1,
+                                     buf + fs->block_size, iter, arg)))
+        return ret;
+    }
+
+  return 0;
+}
+
+/*
+ * Calls iter for every block an inode owns, in pointer order: data blocks
+ * with depth 0 and indirect blocks with their level, 1 for a block of data
+ * pointers. Pointers outside the filesystem are passed on but not followed.
+ * Devices and short symlinks keep other things in block[] and own nothing.
+ * Like the scans this reads past the block cache and takes no lock, so
+ * threads can walk inodes at once. A non-zero return from iter stops the
+ * walk and is passed through.
+ */
+int
+ext2_walk_blocks (ext2_fs_t *fs, const ext2_inode_t *inode,
+                  ext2_block_iter_t iter, void *arg)
+{
+  uint16_t type = EXT2_INODE_TYPE (inode->mode);
+  unsigned char *buf = NULL;
+  int ret = 0;
+
+  if ((type != EXT2_INODE_TYPE_REG_FILE && type != EXT2_INODE_TYPE_DIR
+       && type != EXT2_INODE_TYPE_SYM_LINK)
+      || ext2_inode_is_fast_symlink (inode))
+    return 0;
+
+  for (size_t i = 0; i < EXT2_NDIR_BLOCKS; i++)
+    if (inode->block[i] && (ret = iter (fs, inode->block[i], 0, arg)))
+      return ret;
+
+  for (size_t depth = 1; depth <= 3 && !ret; depth++)
+    {
+      uint32_t block = inode->block[EXT2_IND_BLOCK + depth - 1];
+
+      if (!block)
+        continue;
+
+      /* one block per level of the path being walked */
+      if (buf == NULL && (buf = malloc (3 * fs->block_size)) == NULL)
+        {
+          errno = -ENOMEM;
+          return -1;
+        }
+
+      ret = ext2_walk_level (fs, block, depth, buf, iter, arg);
+    }
+
+  free (buf);
+  return ret;
+}
+
+/*
+ * Blocks reserved for one inode. Runs are carved off in order, so indirect
+ * blocks land right in front of the data they map, as the kernel lays them
+ * out, and a file written front to back ends up in one sequential stretch.
+ */
+typedef struct
+{
+  uint32_t goal; /* where the next reservation is searched from */
+  uint32_t next;
+  size_t left;
+} ext2_alloc_t;
+
+/* indirect blocks needed to map the first nblks blocks of a file */
+static size_t
+ext2_meta_blocks (ext2_fs_t *fs, size_t nblks)
+{
+  size_t per_block = fs->block_size / sizeof (uint32_t);
+  size_t span = per_block, meta = 0;
+
+  if (nblks <= EXT2_NDIR_BLOCKS)
+    return 0;
+
+  nblks -= EXT2_NDIR_BLOCKS;
+
+  /* one block per level and per pointer array below it */
+  for (int depth = 1; depth <= 3 && nblks; depth++, span *= per_block)
+    {
+      size_t n = nblks < span ? nblks : span;
+
+      for (size_t s = span; s > 1; s /= per_block)
+        meta += ALIGN_UP (n, s) / s;
+
+      nblks -= n;
+    }
+
+  return meta;
+}
+
+static int
+ext2_alloc_take (ext2_fs_t *fs, ext2_alloc_t *alloc, ext2_inode_t *inode,
+                 size_t want, uint32_t *block)
+{
+  if (!alloc->left
+      && ext2_alloc_blocks (fs, alloc->goal, want, &alloc->next, &alloc->left)
+             == -1)
+    return -1;
+
+  *block = alloc->next++;
+  alloc->left--;
+  alloc->goal = alloc->next;
+  inode->num_sectors += fs->block_size / 512;
+  return 0;
+}
+
+static int
+ext2_alloc_release (ext2_fs_t *fs, ext2_alloc_t *alloc)
+{
+  int ret = ext2_free_blocks (fs, alloc->next, alloc->left);
+
+  alloc->left = 0;
+  return ret;
+}
+
+static void
+ext2_release_block (ext2_fs_t *fs, void *data, int dirty)
+{
+  if (dirty)
+    ext2_put_block_dirty (fs, data);
+  else
+    ext2_put_block (fs, data);
+}
+
+/*
+ * The writable counterpart of ext2_bmap_span: finds the pointer array that
+ * maps lblk, allocating and zeroing indirect blocks on the way as needed.
+ * Unless the array is the inode's own, it comes back pinned, and *dirty says
+ * whether it has already been modified.
+ */
+static int
+ext2_bmap_span_mut (ext2_fs_t *fs, ext2_inode_t *inode, ext2_alloc_t *alloc,
+                    size_t lblk, size_t want, uint32_t **table, size_t *cnt,
+                    int *dirty)
+{
+  size_t per_block = fs->block_size / sizeof (uint32_t);
+  size_t span = per_block;
+  size_t depth = 1;
+  uint32_t *slot;
+
+  *dirty = 0;
+
+  if (lblk < EXT2_NDIR_BLOCKS)
+    {
+      *table = inode->block + lblk;
+      *cnt = EXT2_NDIR_BLOCKS - lblk;
+      return 0;
+    }
+
+  lblk -= EXT2_NDIR_BLOCKS;
+
+  while (lblk >= span)
+    {
+      lblk -= span;
+      span *= per_block;
+
+      if (++depth > 3)
+        {
+          errno = -EFBIG;
+          return -1;
+        }
+    }
+
+  slot = inode->block + EXT2_IND_BLOCK + depth - 1;
+  *table = NULL;
+
+  for (;;)
+    {
+      int fresh = !*slot;
+      uint32_t *next;
+
+      if (fresh && ext2_alloc_take (fs, alloc, inode, want, slot) == -1)
+        goto fail;
+
+      *dirty |= fresh;
+
+      next = ext2_get_block_mut (fs, *slot, fresh);
+      if (next == NULL)
+        goto fail;
+
+      if (*table != NULL)
+        ext2_release_block (fs, *table, *dirty);
+
+      *table = next;
+      *dirty = fresh;
+
+      if (span == per_block)
+        {
+          *table += lblk;
+          *cnt = per_block - lblk;
+          return 0;
+        }
+
+      span /= per_block;
+      slot = next + lblk / span;
+      lblk %= span;
+    }
+
+fail:
+  if (*table != NULL)
+    ext2_release_block (fs, *table, *dirty);
+
+  return -1;
+}
+
+/*
+ * Allocates every hole in the nblks logical blocks from lblk on, plus any
+ * indirect blocks missing on the way, from alloc. Data blocks are not
+ * zeroed, that is up to the caller.
+ */
+static int
+ext2_bmap_alloc (ext2_fs_t *fs, ext2_inode_t *inode, ext2_alloc_t *alloc,
+                 size_t lblk, size_t nblks)
+{
+  while (nblks)
+    {
+      size_t want = nblks + ext2_meta_blocks (fs, lblk + nblks)
+                    - ext2_meta_blocks (fs, lblk);
+      uint32_t *entries;
+      size_t cnt;
+      int dirty, ret = 0;
+
+      if (ext2_bmap_span_mut (fs, inode, alloc, lblk, want, &entries, &cnt,
+                              &dirty)
+          == -1)
+        return -1;
+
+      if (cnt > nblks)
+        cnt = nblks;
+
+      for (size_t i = 0; i < cnt && !ret; i++)
+        if (!entries[i])
+          {
+            ret = ext2_alloc_take (fs, alloc, inode, want - i, entries + i);
+            dirty = 1;
+          }
+
+      if (lblk >= EXT2_NDIR_BLOCKS)
+        ext2_release_block (fs, entries, dirty);
+
+      if (ret == -1)
+        return -1;
+
+      lblk += cnt;
+      nblks -= cnt;
+    }
+
+  return 0;
+}
+
+static size_t
+ext2_dirent_name_len (ext2_fs_t *fs, const ext2_dirent_t *dirent)
+{
+  if (ext2_has_filetype (fs))
+    return dirent->name_len;
+
+  return dirent->name_len | dirent->file_type << 8;
+}
+
+static const ext2_dirent_t *
+ext2_dirent_at (ext2_fs_t *fs, const unsigned char *block, size_t off)
+{
+  const ext2_dirent_t *dirent;
+
+  if (off + EXT2_DIRENT_MIN_LEN > fs->block_size)
+    return NULL;
+
+  dirent = (const ext2_dirent_t *) (block + off);
+
+  if (dirent->rec_len < EXT2_DIRENT_MIN_LEN || dirent->rec_len & 3
+      || off + dirent->rec_len > fs->block_size
+      || EXT2_DIRENT_MIN_LEN + ext2_dirent_name_len (fs, dirent)
+             > dirent->rec_len)
+    return NULL;
+
+  return dirent;
+}
+
+/* returns 0 if found, 1 if the block doesn't hold the name */
+static int
+ext2_search_dir_block (ext2_fs_t *fs, const ext2_inode_t *dir, size_t lblk,
+                       const char *name, size_t len, uint32_t *ino)
+{
+  const unsigned char *block;
+  const ext2_dirent_t *dirent;
+  uint32_t pblk;
+
+  if (ext2_bmap (fs, dir, lblk, &pblk) == -1)
+    return -1;
+
+  if (!pblk)
+    return 1;
+
+  block = ext2_get_block (fs, pblk);
+  if (block == NULL)
+    return -1;
+
+  for (size_t off = 0; off < fs->block_size; off += dirent->rec_len)
+    {
+      dirent = ext2_dirent_at (fs, block, off);
+      if (dirent == NULL)
+        {
+          ext2_put_block (fs, block);
+          errno = -EIO;
+          return -1;
+        }
+
+      if (dirent->inode && ext2_dirent_name_len (fs, dirent) == len
+          && !memcmp (dirent->name, name, len))
+        {
+          *ino = dirent->inode;
+          ext2_put_block (fs, block);
+          return 0;
+        }
+    }
+
+  ext2_put_block (fs, block);
+  return 1;
+}
+
+/* directory hashes, as computed by the ext3/ext4 htree code */
+
+#define EXT2_HASH_EOF 0x7fffffffu
+
+static uint32_t
+ext2_hash_legacy (const char *name, size_t len, int is_unsigned)
+{
+  uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+  while (len--)
+    {
+      int c = is_unsigned ? (int) (unsigned char) *name
+                          : (int) (signed char) *name;
+      name++;
+
+      hash = hash1 + (hash0 ^ (uint32_t) (c * 7152373));
+      if (hash & 0x80000000)
+        hash -= 0x7fffffff;
+
+      hash1 = hash0;
+      hash0 = hash;
+    }
+
+  return hash0 << 1;
+}
+
+static void
+ext2_hash_str2buf (const char *msg, size_t len, uint32_t *buf, int num,
+                   int is_unsigned)
+{
+  uint32_t pad, val;
+
+  pad = (uint32_t) len | ((uint32_t) len << 8);
+  pad |= pad << 16;
+  val = pad;
+
+  if (len > (size_t) num * 4)
+    len = num * 4;
+
+  for (size_t i = 0; i < len; i++)
+    {
+      int c = is_unsigned ? (int) (unsigned char) msg[i]
+                          : (int) (signed char) msg[i];
+
+      val = (uint32_t) c + (val << 8);
+      if ((i % 4) == 3)
+        {
+          *buf++ = val;
+          val = pad;
+          num--;
+        }
+    }
+
+  if (--num >= 0)
+    *buf++ = val;
+
+  while (--num >= 0)
+    *buf++ = pad;
+}
+
+static void
+ext2_hash_tea (uint32_t buf[4], const uint32_t in[4])
+{
+  uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+
+  for (int n = 0; n < 16; n++)
+    {
+      sum += 0x9e3779b9;
+      b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+      b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    }
+
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+#define ROL32(x, s)    (((x) << (s)) | ((x) >> (32 - (s))))
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s)                                        \
+  ((a) += f ((b), (c), (d)) + (x), (a) = ROL32 ((a), (s)))
+#define MD4_K2 013240474631u
+#define MD4_K3 015666365641u
+
+static void
+ext2_hash_half_md4 (uint32_t buf[4], const uint32_t in[8])
+{
+  uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  MD4_ROUND (MD4_F, a, b, c, d, in[0], 3);
+  MD4_ROUND (MD4_F, d, a, b, c, in[1], 7);
+  MD4_ROUND (MD4_F, c, d, a, b, in[2], 11);
+  MD4_ROUND (MD4_F, b, c, d, a, in[3], 19);
+  MD4_ROUND (MD4_F, a, b, c, d, in[4], 3);
+  MD4_ROUND (MD4_F, d, a, b, c, in[5], 7);
+  MD4_ROUND (MD4_F, c, d, a, b, in[6], 11);
+  MD4_ROUND (MD4_F, b, c, d, a, in[7], 19);
+
+  MD4_ROUND (MD4_G, a, b, c, d, in[1] + MD4_K2, 3);
+  MD4_ROUND (MD4_G, d, a, b, c, in[3] + MD4_K2, 5);
+  MD4_ROUND (MD4_G, c, d, a, b, in[5] + MD4_K2, 9);
+  MD4_ROUND (MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+  MD4_ROUND (MD4_G, a, b, c, d, in[0] + MD4_K2, 3);
+  MD4_ROUND (MD4_G, d, a, b, c, in[2] + MD4_K2, 5);
+  MD4_ROUND (MD4_G, c, d, a, b, in[4] + MD4_K2, 9);
+  MD4_ROUND (MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+  MD4_ROUND (MD4_H, a, b, c, d, in[3] + MD4_K3, 3);
+  MD4_ROUND (MD4_H, d, a, b, c, in[7] + MD4_K3, 9);
+  MD4_ROUND (MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+  MD4_ROUND (MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+  MD4_ROUND (MD4_H, a, b, c, d, in[1] + MD4_K3, 3);
+  MD4_ROUND (MD4_H, d, a, b, c, in[5] + MD4_K3, 9);
+  MD4_ROUND (MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+  MD4_ROUND (MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+static int
+ext2_dirhash (ext2_fs_t *fs, int ver, const char *name, size_t len,
+              uint32_t *hash)
+{
+  uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+  int is_unsigned = ver >= EXT2_HASH_LEGACY_UNSIGNED;
+  uint32_t in[8];
+
+  for (int i = 0; i < 4; i++)
+    if (fs->sb->hash_seed[i])
+      {
+        memcpy (buf, fs->sb->hash_seed, sizeof (buf));
+        break;
+      }
+
+  switch (ver)
+    {
+    case EXT2_HASH_LEGACY:
+    case EXT2_HASH_LEGACY_UNSIGNED:
+      *hash = ext2_hash_legacy (name, len, is_unsigned);
+      break;
+    case EXT2_HASH_HALF_MD4:
+    case EXT2_HASH_HALF_MD4_UNSIGNED:
+      for (size_t off = 0; off < len || !off; off += 32)
+        {
+          ext2_hash_str2buf (name + off, len - off, in, 8, is_unsigned);
+          ext2_hash_half_md4 (buf, in);
+          if (len <= off + 32)
+            break;
+        }
+      *hash = buf[1];
+      break;
+    case EXT2_HASH_TEA:
+    case EXT2_HASH_TEA_UNSIGNED:
+      for (size_t off = 0; off < len || !off; off += 16)
+        {
+          ext2_hash_str2buf (name + off, len - off, in, 4, is_unsigned);
+          ext2_hash_tea (buf, in);
+          if (len <= off + 16)
+            break;
+        }
+      *hash = buf[0];
+      break;
+    default:
+      errno = -EINVAL;
+      return -1;
+    }
+
+  *hash &= ~1u;
+  if (*hash == EXT2_HASH_EOF << 1)
+    *hash = (EXT2_HASH_EOF - 1) << 1;
+
+  return 0;
+}
+
+typedef struct
+{
+  const unsigned char *block;
+  const ext2_dx_entry_t *entries;
+  const ext2_dx_entry_t *at;
+  size_t count;
+} ext2_dx_frame_t;
+
+static const ext2_dx_entry_t *
+ext2_dx_node_entries (const unsigned char *block, size_t off, size_t bsize,
+                      size_t *count)
+{
+  const ext2_dx_countlimit_t *cl;
+
+  if (off + sizeof (ext2_dx_countlimit_t) > bsize)
+    return NULL;
+
+  cl = (const ext2_dx_countlimit_t *) (block + off);
+  if (!cl->count || cl->count > cl->limit
+      || off + cl->limit * sizeof (ext2_dx_entry_t) > bsize)
+    return NULL;
+
+  *count = cl->count;
+  return (const ext2_dx_entry_t *) (block + off);
+}
+
+static const ext2_dx_entry_t *
+ext2_dx_search (const ext2_dx_entry_t *entries, size_t count, uint32_t hash)
+{
+  /* entries[0] has no hash, it covers everything below entries[1] */
+  const ext2_dx_entry_t *p = entries + 1, *q = entries + count - 1;
+
+  while (p <= q)
+    {
+      const ext2_dx_entry_t *m = p + (q - p) / 2;
+
+      if (m->hash > hash)
+        q = m - 1;
+      else
+        p = m + 1;
+    }
+
+  return p - 1;
+}
+
+static int
+ext2_dx_descend (ext2_fs_t *fs, const ext2_inode_t *dir,
+                 ext2_dx_frame_t *frame, ext2_dx_frame_t *last, uint32_t hash)
+{
+  while (frame < last)
+    {
+      uint32_t pblk;
+
+      if (ext2_bmap (fs, dir, frame->at->block & 0x0fffffff, &pblk) == -1)
+        return -1;
+
+      frame++;
+      frame->block = pblk ? ext2_get_block (fs, pblk) : NULL;
+      if (frame->block == NULL)
+        return 1;
+
+      /* interior nodes start with an empty dirent spanning the block */
+      frame->entries = ext2_dx_node_entries (frame->block, 8, fs->block_size,
+                                             &frame->count);
+      if (frame->entries == NULL)
+        return 1;
+
+      frame->at = ext2_dx_search (frame->entries, frame->count, hash);
+    }
+
+  return 0;
+}
+
+/*
+ * Moves to the next leaf if it may hold more names hashing to hash, which
+ * happens when a run of colliding names was split across leaves.
+ */
+static int
+ext2_dx_next_leaf (ext2_fs_t *fs, const ext2_inode_t *dir,
+                   ext2_dx_frame_t *frames, ext2_dx_frame_t *last,
+                   uint32_t hash)
+{
+  ext2_dx_frame_t *p = last;
+
+  for (;;)
+    {
+      if (++p->at < p->entries + p->count)
+        break;
+
+      if (p == frames)
+        return 0;
+
+      p--;
+    }
+
+  if ((p->at->hash & ~1u) != hash)
+    return 0;
+
+  for (ext2_dx_frame_t *f = p + 1; f <= last; f++)
+    {
+      if (f->block != NULL)
+        ext2_put_block (fs, f->block);
+      f->block = NULL;
+    }
+
+  return ext2_dx_descend (fs, dir, p, last, hash) ? -1 : 1;
+}
+
+/*
+ * Hash-indexed lookup, one block read per index level plus the leaf.
+ * Returns 1 if the index can't be used and the caller should scan.
+ */
+static int
+ext2_dx_lookup (ext2_fs_t *fs, const ext2_inode_t *dir, const char *name,
+                size_t len, uint32_t *ino)
+{
+  ext2_dx_frame_t frames[EXT2_DX_MAX_LEVELS] = { 0 };
+  const ext2_dx_root_info_t *info;
+  ext2_dx_frame_t *last;
+  uint32_t pblk, hash;
+  int ver, ret = 1;
+
+  if (ext2_bmap (fs, dir, 0, &pblk) == -1 || !pblk)
+    return 1;
+
+  frames[0].block = ext2_get_block (fs, pblk);
+  if (frames[0].block == NULL)
+    return 1;
+
+  /* the root info sits right behind the "." and ".." entries */
+  info = (const ext2_dx_root_info_t *) (frames[0].block + 24);
+  if (info->reserved_zero || info->info_len < sizeof (ext2_dx_root_info_t)
+      || info->indirect_levels >= EXT2_DX_MAX_LEVELS)
+    goto out;
+
+  ver = info->hash_ver;
+  if (ver <= EXT2_HASH_TEA && (fs->sb->flags & EXT2_SB_FLAG_UNSIGNED_HASH))
+    ver += EXT2_HASH_LEGACY_UNSIGNED;
+
+  if (ext2_dirhash (fs, ver, name, len, &hash) == -1)
+    goto out;
+
+  frames[0].entries = ext2_dx_node_entries (
+      frames[0].block, 24 + info->info_len, fs->block_size, &frames[0].count);
+  if (frames[0].entries == NULL)
+    goto out;
+
+  frames[0].at = ext2_dx_search (frames[0].entries, frames[0].count, hash);
+  last = frames + info->indirect_levels;
+
+  if (ext2_dx_descend (fs, dir, frames, last, hash))
+    goto out;
+
+  do
+    {
+      ret = ext2_search_dir_block (fs, dir, last->at->block & 0x0fffffff,
+                                   name, len, ino);
+      if (ret != 1)
+        goto out;
+    }
+  while ((ret = ext2_dx_next_leaf (fs, dir, frames, last, hash)) == 1);
+
+  if (!ret)
+    {
+      errno = -ENOENT;
+      ret = -1;
+    }
+
+out:
+  for (int i = 0; i < EXT2_DX_MAX_LEVELS; i++)
+    if (frames[i].block != NULL)
+      ext2_put_block (fs, frames[i].block);
+
+  return ret;
+}
+
+static int
+ext2_is_dot_or_dotdot (const char *name, size_t len)
+{
+  return name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'));
+}
+
+int
+ext2_lookup (ext2_fs_t *fs, const ext2_inode_t *dir, const char *name,
+             size_t len, uint32_t *ino)
+{
+  uint64_t size = ext2_inode_get_size (fs, dir);
+  int ret;
+
+  if (EXT2_INODE_TYPE (dir->mode) != EXT2_INODE_TYPE_DIR)
+    {
+      errno = -ENOTDIR;
+      return -1;
+    }
+
+  /* "." and ".." live in the index root block, not in any leaf */
+  if ((dir->flags & EXT2_INODE_FLAG_HASH_IDX_DIR)
+      && (fs->sb->opt_flags & EXT2_OPT_FLAG_DIRS_USE_HASH_IDX)
+      && !ext2_is_dot_or_dotdot (name, len))
+    {
+      ret = ext2_dx_lookup (fs, dir, name, len, ino);
+      if (ret != 1)
+        return ret;
+    }
+
+  for (size_t lblk = 0; lblk * fs->block_size < size; lblk++)
+    {
+      ret = ext2_search_dir_block (fs, dir, lblk, name, len, ino);
+      if (ret != 1)
+        return ret;
+    }
+
+  errno = -ENOENT;
+  return -1;
+}
+
+#define EXT2_DCACHE_NIL UINT32_MAX
+
+static int
+ext2_dcache_init (ext2_fs_t *fs, size_t nents)
+{
+  ext2_dcache_t *dcache = &fs->dcache;
+
+  memset (dcache, 0, sizeof (ext2_dcache_t));
+
+  dcache->nbuckets = 1;
+  while (dcache->nbuckets < nents)
+    dcache->nbuckets <<= 1;
+
+  dcache->nents = nents;
+  dcache->buckets
+      = ext2_arena_alloc (&fs->arena, dcache->nbuckets * sizeof (uint32_t));
+  dcache->ents = ext2_arena_alloc (&fs->arena,
+                                   nents * sizeof (ext2_dcache_ent_t));
+
+  if (dcache->buckets == NULL || dcache->ents == NULL)
+    return -1;
+
+  memset (dcache->buckets, 0xff, dcache->nbuckets * sizeof (uint32_t));
+  memset (dcache->ents, 0, nents * sizeof (ext2_dcache_ent_t));
+  return 0;
+}
+
+static uint32_t
+ext2_dcache_hash (uint32_t parent, const char *name, size_t len)
+{
+  /* FNV-1a over the parent inode number and the name */
+  uint32_t hash = 2166136261u;
+
+  for (int i = 0; i < 4; i++)
+    hash = (hash ^ ((parent >> (i * 8)) & 0xff)) * 16777619u;
+
+  while (len--)
+    hash = (hash ^ (unsigned char) *name++) * 16777619u;
+
+  return hash;
+}
+
+static ext2_dcache_ent_t *
+ext2_dcache_find (ext2_dcache_t *dcache, uint32_t parent, const char *name,
+                  size_t len, uint32_t hash)
+{
+  for (uint32_t idx = dcache->buckets[hash & (dcache->nbuckets - 1)];
+       idx != EXT2_DCACHE_NIL; idx = dcache->ents[idx].next)
+    {
+      ext2_dcache_ent_t *ent = dcache->ents + idx;
+
+      if (ent->hash == hash && ent->parent == parent && ent->len == len
+          && !memcmp (ent->name, name, len))
+        return ent;
+    }
+
+  return NULL;
+}
+
+static void
+ext2_dcache_unlink (ext2_dcache_t *dcache, uint32_t idx)
+{
+  uint32_t *link
+      = &dcache->buckets[dcache->ents[idx].hash & (dcache->nbuckets - 1)];
+
+  while (*link != idx)
+    link = &dcache->ents[*link].next;
+
+  *link = dcache->ents[idx].next;
+}
+
+/* records parent/name -> ino, where ino 0 marks the name as missing */
+static void
+ext2_dcache_add (ext2_fs_t *fs, uint32_t parent, const char *name, size_t len,
+                 uint32_t ino)
+{
+  ext2_dcache_t *dcache = &fs->dcache;
+  uint32_t hash = ext2_dcache_hash (parent, name, len);
+  ext2_dcache_ent_t *ent;
+  uint32_t idx;
+
+  /* long names aren't worth the space, they just always miss */
+  if (len > EXT2_DCACHE_NAME_LEN || !dcache->nents)
+    return;
+
+  ent = ext2_dcache_find (dcache, parent, name, len, hash);
+  if (ent != NULL)
+    {
+      ent->ino = ino;
+      ent->ref = 1;
+      return;
+    }
+
+  for (;;)
+    {
+      idx = dcache->hand;
+      ent = dcache->ents + idx;
+      dcache->hand = (dcache->hand + 1) % dcache->nents;
+
+      if (!ent->ref)
+        break;
+
+      ent->ref = 0;
+    }
+
+  if (ent->len)
+    ext2_dcache_unlink (dcache, idx);
+
+  ent->parent = parent;
+  ent->ino = ino;
+  ent->hash = hash;
+  ent->len = len;
+  ent->ref = 1;
+  memcpy (ent->name, name, len);
+
+  ent->next = dcache->buckets[hash & (dcache->nbuckets - 1)];
+  dcache->buckets[hash & (dcache->nbuckets - 1)] = idx;
+}
+
+static int
+ext2_lookup_cached (ext2_fs_t *fs, uint32_t parent, const char *name,
+                    size_t len, uint32_t *ino)
+{
+  ext2_dcache_t *dcache = &fs->dcache;
+  ext2_dcache_ent_t *ent = NULL;
+  ext2_inode_t *dir;
+  int ret;
+
+  if (dcache->nents)
+    ent = ext2_dcache_find (dcache, parent, name, len,
+                            ext2_dcache_hash (parent, name, len));
+
+  if (ent != NULL)
+    {
+      ent->ref = 1;
+
+      if (!ent->ino)
+        {
+          dcache->neg_hits++;
+          errno = -ENOENT;
+          return -1;
+        }
+
+      dcache->hits++;
+      *ino = ent->ino;
+      return 0;
+    }
+
+  dcache->misses++;
+
+  dir = ext2_inode_get (fs, parent);
+  if (dir == NULL)
+    return -1;
+
+  ret = ext2_lookup (fs, dir, name, len, ino);
+  ext2_inode_put (fs, dir);
+
+  if (!ret)
+    ext2_dcache_add (fs, parent, name, len, *ino);
+  else if (errno == -ENOENT)
+    ext2_dcache_add (fs, parent, name, len, 0);
+
+  return ret;
+}
+
+static int
+ext2_namei_locked (ext2_fs_t *fs, const char *path, uint32_t *ino)
+{
+  uint32_t cur = EXT2_ROOT_INODE;
+
+  if (path[0] != '/')
+    {
+      errno = -EINVAL;
+      return -1;
+    }
+
+  while (*path)
+    {
+      size_t len;
+
+      while (*path == '/')
+        path++;
+
+      len = strcspn (path, "/");
+      if (!len)
+        break;
+
+      if (len > EXT2_NAME_MAX)
+        {
+          errno = -ENAMETOOLONG;
+          return -1;
+        }
+
+      if (ext2_lookup_cached (fs, cur, path, len, &cur) == -1)
+        return -1;
+
+      path += len;
+    }
+
+  *ino = cur;
+  return 0;
+}
+
+/* resolves an absolute path, "." and ".." are ordinary directory entries */
+int
+ext2_namei (ext2_fs_t *fs, const char *path, uint32_t *ino)
+{
+  int ret;
+
+  pthread_mutex_lock (&fs->lock);
+  ret = ext2_namei_locked (fs, path, ino);
+  pthread_mutex_unlock (&fs->lock);
+
+  return ret;
+}
+
+static void
+ext2_inode_set_size (ext2_fs_t *fs, ext2_inode_t *inode, uint64_t size)
+{
+  inode->nbytes_lo = size;
+
+  if (EXT2_INODE_TYPE (inode->mode) == EXT2_INODE_TYPE_REG_FILE
+      && ext2_has_extended_sb (fs->sb))
+    inode->nbytes_hi = size >> 32;
+}
+
+static uint8_t
+ext2_ft_from_mode (uint16_t mode)
+{
+  switch (EXT2_INODE_TYPE (mode))
+    {
+    case EXT2_INODE_TYPE_FIFO:
+      return EXT2_FT_FIFO;
+    case EXT2_INODE_TYPE_CHR_DEV:
+      return EXT2_FT_CHR_DEV;
+    case EXT2_INODE_TYPE_DIR:
+      return EXT2_FT_DIR;
+    case EXT2_INODE_TYPE_BLK_DEV:
+      return EXT2_FT_BLK_DEV;
+    case EXT2_INODE_TYPE_REG_FILE:
+      return EXT2_FT_REG_FILE;
+    case EXT2_INODE_TYPE_SYM_LINK:
+      return EXT2_FT_SYM_LINK;
+    case EXT2_INODE_TYPE_SOCK:
+      return EXT2_FT_SOCK;
+    default:
+      return EXT2_FT_UNKN;
+    }
+}
+
+#define EXT2_DIRENT_LEN(len) ALIGN_UP (EXT2_DIRENT_MIN_LEN + (len), 4)
+
+/* tries to fit the entry into one directory block, 1 if there's no room */
+static int
+ext2_dir_block_add (ext2_fs_t *fs, unsigned char *block, const char *name,
+                    size_t len, uint32_t ino, uint8_t ft)
+{
+  size_t need = EXT2_DIRENT_LEN (len);
+  ext2_dirent_t *dirent;
+
+  for (size_t off = 0; off < fs->block_size; off += dirent->rec_len)
+    {
+      size_t used;
+
+      if (ext2_dirent_at (fs, block, off) == NULL)
+        {
+          errno = -EIO;
+          return -1;
+        }
+
+      dirent = (ext2_dirent_t *) (block + off);
+
+      used = dirent->inode
+                 ? EXT2_DIRENT_LEN (ext2_dirent_name_len (fs, dirent))
+                 : 0;
+      if (dirent->rec_len - used < need)
+        continue;
+
+      /* split the slack off the end of a live entry */
+      if (used)
+        {
+          ext2_dirent_t *next = (ext2_dirent_t *) (block + off + used);
+
+          next->rec_len = dirent->rec_len - used;
+          dirent->rec_len = used;
+          dirent = next;
+        }
+
+      dirent->inode = ino;
+      dirent->name_len = len;
+      dirent->file_type = ext2_has_filetype (fs) ? ft : 0;
+      memcpy (dirent->name, name, len);
+      return 0;
+    }
+
+  return 1;
+}
+
+/*
+ * Adds name -> ino to a directory, into the first block with room for it or
+ * else into a new block at the end. The directory inode is updated in
+ * memory, writing it back is left to the caller. Hash-indexed directories
+ * lose their index flag, the old index blocks still read as empty linear
+ * blocks, which is what the kernel's plain ext2 driver does as well.
+ */
+static int
+ext2_dir_add (ext2_fs_t *fs, uint32_t dir_ino, ext2_inode_t *dir,
+              const char *name, size_t len, uint32_t ino, uint8_t ft)
+{
+  uint64_t size = ext2_inode_get_size (fs, dir);
+  size_t nblks = size / fs->block_size;
+  ext2_alloc_t alloc = { 0 };
+  unsigned char *block;
+  uint32_t pblk;
+  int ret;
+
+  dir->flags &= ~EXT2_INODE_FLAG_HASH_IDX_DIR;
+
+  for (size_t lblk = 0; lblk < nblks; lblk++)
+    {
+      if (ext2_bmap (fs, dir, lblk, &pblk) == -1)
+        return -1;
+
+      if (!pblk)
+        continue;
+
+      block = ext2_get_block_mut (fs, pblk, 0);
+      if (block == NULL)
+        return -1;
+
+      ret = ext2_dir_block_add (fs, block, name, len, ino, ft);
+      if (ret == 1)
+        {
+          ext2_put_block (fs, block);
+          continue;
+        }
+
+      if (ret == -1)
+        {
+          ext2_put_block (fs, block);
+          return -1;
+        }
+
+      ext2_put_block_dirty (fs, block);
+      ext2_dcache_add (fs, dir_ino, name, len, ino);
+      return 0;
+    }
+
+  /* no room anywhere, grow the directory by a block next to its last one */
+  if (nblks && ext2_bmap (fs, dir, nblks - 1, &alloc.goal) == -1)
+    return -1;
+
+  if (!alloc.goal)
+    alloc.goal = fs->sb->first_block
+                 + (dir_ino - 1) / fs->sb->inodes_per_group
+                       * fs->sb->blocks_per_group;
+
+  if (ext2_bmap_alloc (fs, dir, &alloc, nblks, 1) == -1
+      || ext2_bmap (fs, dir, nblks, &pblk) == -1)
+    {
+      ext2_alloc_release (fs, &alloc);
+      return -1;
+    }
+
+  if (ext2_alloc_release (fs, &alloc) == -1)
+    return -1;
+
+  block = ext2_get_block_mut (fs, pblk, 1);
+  if (block == NULL)
+    return -1;
+
+  ((ext2_dirent_t *) block)->rec_len = fs->block_size;
+  ext2_dir_block_add (fs, block, name, len, ino, ft);
+  ext2_put_block_dirty (fs, block);
+
+  ext2_inode_set_size (fs, dir, size + fs->block_size);
+  ext2_dcache_add (fs, dir_ino, name, len, ino);
+  return 0;
+}
+
+#define EXT2_FILE(file) ext2_file_t *ext2_file = (ext2_file_t *) (file)
+#define EXT2_DIR(dir)   ext2_dir_t *ext2_dir = (ext2_dir_t *) (dir)
+
+typedef struct
+{
+  file_t base;
+  ext2_fs_t *fs;
+  ext2_inode_t *inode;
+  size_t off;
+  ext2_alloc_t alloc;
+  int dirty; /* the inode needs writing back on close */
+} ext2_file_t;
+
+typedef struct
+{
+  dir_t base;
+  ext2_file_t *file;
+  size_t pos;
+  /* block under pos, kept pinned between calls */
+  size_t lblk;
+  const unsigned char *block;
+  dentry_t ent;
+  char name[EXT2_NAME_MAX + 1];
+} ext2_dir_t;
+
+static dir_t *ext2_file_opendir (file_t *file);
+static int ext2_file_get_type (file_t *file, file_type_t *type);
+static int ext2_file_get_size (file_t *file, size_t *size);
+static int ext2_file_set_size (file_t *file, size_t size);
+static int ext2_file_seek (file_t *file, size_t off, file_seek_t origin);
+static ssize_t ext2_file_read (file_t *file, void *buf, size_t nbytes);
+static ssize_t ext2_file_write (file_t *file, const void *buf,
+                               size_t nbytes);
+static ssize_t ext2_file_pread (file_t *file, void *buf, size_t nbytes,
+                                size_t off);
+static ssize_t ext2_file_pwrite (file_t *file, const void *buf, size_t nbytes,
+                                 size_t off);
+static void ext2_file_close (file_t *file);
+
+static dentry_t *ext2_dir_readdir (dir_t *dir);
+static void ext2_dir_rewinddir (dir_t *dir);
+static void ext2_dir_closedir (dir_t *dir);
+
+file_t *
+ext2_file_open (ext2_fs_t *fs, uint32_t ino)
+{
+  ext2_file_t *file = malloc (sizeof (ext2_file_t));
+
+  if (file == NULL)
+    {
+      errno = -ENOMEM;
+      return NULL;
+    }
+
+  memset (file, 0, sizeof (ext2_file_t));
+
+  file->base.opendir = ext2_file_opendir;
+  file->base.get_type = ext2_file_get_type;
+  file->base.get_size = ext2_file_get_size;
+  file->base.set_size = ext2_file_set_size;
+  file->base.seek = ext2_file_seek;
+  file->base.read = ext2_file_read;
+  file->base.write = ext2_file_write;
+  file->base.pread = ext2_file_pread;
+  file->base.pwrite = ext2_file_pwrite;
+  file->base.close = ext2_file_close;
+
+  file->fs = fs;
+
+  pthread_mutex_lock (&fs->lock);
+  file->inode = ext2_inode_get (fs, ino);
+  pthread_mutex_unlock (&fs->lock);
+
+  if (file->inode == NULL)
+    {
+      free (file);
+      return NULL;
+    }
+
+  /* new blocks go next to the inode unless there are blocks to follow */
+  file->alloc.goal = fs->sb->first_block
+                     + (ino - 1) / fs->sb->inodes_per_group
+                           * fs->sb->blocks_per_group;
+
+  return &file->base;
+}
+
+/* checks that name can be added to the directory dir_ino */
+static int
+ext2_name_free (ext2_fs_t *fs, uint32_t dir_ino, const char *name,
+                size_t len)
+{
+  uint32_t ino;
+
+  if (!len || strchr (name, '/') != NULL)
+    {
+      errno = -EINVAL;
+      return -1;
+    }
+
+  if (len > EXT2_NAME_MAX)
+    {
+      errno = -ENAMETOOLONG;
+      return -1;
+    }
+
+  if (!ext2_lookup_cached (fs, dir_ino, name, len, &ino))
+    {
+      errno = -EEXIST;
+      return -1;
+    }
+
+  return errno == -ENOENT ? 0 : -1;
+}
+
+/*
+ * Allocates an inode of the given mode from group and links it into the
+ * directory dir_ino as name. Anything beyond the bare inode, like a
+ * directory's first block, is up to the caller.
+ */
+static int
+ext2_create_locked (ext2_fs_t *fs, uint32_t dir_ino, const char *name,
+                    uint16_t mode, size_t group, uint32_t *ino)
+{
+  size_t len = strlen (name);
+  ext2_inode_t *dir, *inode;
+  int is_dir = EXT2_INODE_TYPE (mode) == EXT2_INODE_TYPE_DIR;
+  int _errno;
+
+  if (ext2_name_free (fs, dir_ino, name, len) == -1)
+    return -1;
+
+  dir = ext2_inode_get (fs, dir_ino);
+  if (dir == NULL)
+    return -1;
+
+  if (EXT2_INODE_TYPE (dir->mode) != EXT2_INODE_TYPE_DIR)
+    {
+      errno = -ENOTDIR;
+      goto cleanup;
+    }
+
+  if (ext2_alloc_inode (fs, group, is_dir, ino) == -1)
+    goto cleanup;
+
+  inode = ext2_inode_get (fs, *ino);
+  if (inode == NULL)
+    goto free_inode;
+
+  /* whatever the slot held before is stale */
+  memset (inode, 0, sizeof (ext2_inode_t));
+  inode->mode = mode;
+  inode->num_hard_links = 1;
+  inode->last_access_time = inode->creation_time = inode->last_mod_time
+      = time (NULL);
+
+  if (ext2_write_inode (fs, *ino, inode, 1) == -1)
+    {
+      ext2_inode_put (fs, inode);
+      goto free_inode;
+    }
+
+  ext2_inode_put (fs, inode);
+
+  if (ext2_dir_add (fs, dir_ino, dir, name, len, *ino,
+                    ext2_ft_from_mode (mode))
+      == -1)
+    goto free_inode;
+
+  /*
+   * The entry is in place from here on, the inode is reachable and stays
+   * allocated; handing it back now would leave the entry dangling.
+   */
+  dir->last_mod_time = time (NULL);
+  if (ext2_write_inode (fs, dir_ino, dir, 0) == -1)
+    goto cleanup;
+
+  ext2_inode_put (fs, dir);
+  return 0;
+
+free_inode:
+  /* nothing points at the inode, mark it deleted and give it back */
+  _errno = errno;
+
+  inode = ext2_inode_get (fs, *ino);
+  if (inode != NULL)
+    {
+      if (inode->num_hard_links)
+        {
+          inode->num_hard_links = 0;
+          inode->deletion_time = time (NULL);
+          ext2_write_inode (fs, *ino, inode, 0);
+        }
+
+      ext2_inode_put (fs, inode);
+    }
+
+  ext2_free_inode (fs, *ino, is_dir);
+  errno = _errno;
+
+cleanup:
+  ext2_inode_put (fs, dir);
+  return -1;
+}
+
+static file_t *
+ext2_file_create_locked (ext2_fs_t *fs, uint32_t dir_ino, const char *name,
+                         uint16_t mode, size_t group)
+{
+  uint32_t ino;
+
+  if (ext2_create_locked (fs, dir_ino, name, mode, group, &ino) == -1)
+    return NULL;
+
+  return ext2_file_open (fs, ino);
+}
+
+/*
+ * Creates an empty file named name in the directory dir_ino and opens it.
+ * The inode is taken from the directory's group so that the file's blocks,
+ * which are allocated near the inode, stay close to their siblings.
+ */
+file_t *
+ext2_file_create (ext2_fs_t *fs, uint32_t dir_ino, const char *name,
+                  uint16_t mode)
+{
+  return ext2_file_create_in (fs, dir_ino, name, mode,
+                              (dir_ino - 1) / fs->sb->inodes_per_group);
+}
+
+/*
+ * Like ext2_file_create, but the inode and with it the file's blocks come
+ * from the given group if it has room. Threads writing files side by side
+ * each pick their own group and so stay out of each other's bitmaps.
+ */
+file_t *
+ext2_file_create_in (ext2_fs_t *fs, uint32_t dir_ino, const char *name,
+                     uint16_t mode, size_t group)
+{
+  file_t *file;
+
+  if (group >= fs->block_group_cnt)
+    group %= fs->block_group_cnt;
+
+  pthread_mutex_lock (&fs->lock);
+  file = ext2_file_create_locked (fs, dir_ino, name, mode, group);
+  pthread_mutex_unlock (&fs->lock);
+
+  return file;
+}
+
+/*
+ * Reserves room for nbytes of data, plus the indirect blocks mapping it, as
+ * one contiguous run if the filesystem has one. Later writes draw on the
+ * reservation; whatever is left over is handed back on close.
+ */
+int
+ext2_file_reserve (file_t *file, uint64_t nbytes)
+{
+  EXT2_FILE (file);
+  ext2_fs_t *fs = ext2_file->fs;
+  size_t nblks = ALIGN_UP (nbytes, fs->block_size) / fs->block_size;
+  int ret = 0;
+
+  nblks += ext2_meta_blocks (fs, nblks);
+
+  /* the allocator locks the groups it works in, fs->lock isn't needed */
+  if (ext2_alloc_release (fs, &ext2_file->alloc) == -1)
+    ret = -1;
+  else if (nblks)
+    ret = ext2_alloc_blocks (fs, ext2_file->alloc.goal, nblks,
+                             &ext2_file->alloc.next, &ext2_file->alloc.left);
+
+  return ret;
+}
+
+uint32_t
+ext2_file_ino (file_t *file)
+{
+  EXT2_FILE (file);
+  return ext2_inode_ino (ext2_file->inode);
+}
+
+static size_t
+ext2_inode_group (ext2_fs_t *fs, uint32_t ino)
+{
+  return (ino - 1) / fs->sb->inodes_per_group;
+}
+
+/* gives an inode without blocks its first one, zeroed and pinned */
+static unsigned char *
+ext2_first_block (ext2_fs_t *fs, uint32_t ino, ext2_inode_t *inode)
+{
+  ext2_alloc_t alloc = { 0 };
+  uint32_t pblk;
+
+  alloc.goal = fs->sb->first_block
+               + ext2_inode_group (fs, ino) * fs->sb->blocks_per_group;
+
+  if (ext2_bmap_alloc (fs, inode, &alloc, 0, 1) == -1
+      || ext2_bmap (fs, inode, 0, &pblk) == -1)
+    {
+      ext2_alloc_release (fs, &alloc);
+      return NULL;
+    }
+
+  if (ext2_alloc_release (fs, &alloc) == -1)
+    return NULL;
+
+  return ext2_get_block_mut (fs, pblk, 1);
+}
+
+static int
+ext2_mkdir_locked (ext2_fs_t *fs, uint32_t dir_ino, const char *name,
+                   uint16_t mode, uint32_t *ino)
+{
+  ext2_inode_t *inode, *dir;
+  unsigned char *block;
+  int ret = -1;
+
+  if (ext2_create_locked (fs, dir_ino, name, EXT2_INODE_TYPE_DIR | mode,
+                          ext2_inode_group (fs, dir_ino), ino)
+      == -1)
+    return -1;
+
+  inode = ext2_inode_get (fs, *ino);
+  if (inode == NULL)
+    return -1;
+
+  block = ext2_first_block (fs, *ino, inode);
+  if (block == NULL)
+    goto cleanup;
+
+  /* "." takes the whole block, ".." is then split off its end */
+  ((ext2_dirent_t *) block)->rec_len = fs->block_size;
+  ext2_dir_block_add (fs, block, ".", 1, *ino, EXT2_FT_DIR);
+  ext2_dir_block_add (fs, block, "..", 2, dir_ino, EXT2_FT_DIR);
+  ext2_put_block_dirty (fs, block);
+
+  ext2_inode_set_size (fs, inode, fs->block_size);
+  inode->num_hard_links = 2;
+  if (ext2_write_inode (fs, *ino, inode, 0) == -1)
+    goto cleanup;
+
+  dir = ext2_inode_get (fs, dir_ino);
+  if (dir == NULL)
+    goto cleanup;
+
+  dir->num_hard_links++;
+  ret = ext2_write_inode (fs, dir_ino, dir, 0);
+  ext2_inode_put (fs, dir);
+
+cleanup:
+  ext2_inode_put (fs, inode);
+  return ret;
+}
+
+/* creates the directory name in dir_ino, mode holds the permission bits */
+int
+ext2_mkdir (ext2_fs_t *fs, uint32_t dir_ino, const char *name, uint16_t mode,
+            uint32_t *ino)
+{
+  int ret;
+
+  pthread_mutex_lock (&fs->lock);
+  ret = ext2_mkdir_locked (fs, dir_ino, name, mode & 07777, ino);
+  pthread_mutex_unlock (&fs->lock);
+
+  return ret;
+}
+
+static int
+ext2_symlink_locked (ext2_fs_t *fs, uint32_t dir_ino, const char *name,
+                     const char *target, uint32_t *ino)
+{
+  size_t len = strlen (target);
+  ext2_inode_t *inode;
+  int ret = -1;
+
+  if (!len || len >= fs->block_size)
+    {
+      errno = len ? -ENAMETOOLONG : -EINVAL;
+      return -1;
+    }
+
+  if (ext2_create_locked (fs, dir_ino, name, EXT2_INODE_TYPE_SYM_LINK | 0777,
+                          ext2_inode_group (fs, dir_ino), ino)
+      == -1)
+    return -1;
+
+  inode = ext2_inode_get (fs, *ino);
+  if (inode == NULL)
+    return -1;
+
+  /* short targets fit into block[] itself, like the kernel does it */
+  if (len < sizeof (inode->block))
+    memcpy (inode->block, target, len);
+  else
+    {
+      unsigned char *block = ext2_first_block (fs, *ino, inode);
+
+      if (block == NULL)
+        goto cleanup;
+
+      memcpy (block, target, len);
+      ext2_put_block_dirty (fs, block);
+    }
+
+  ext2_inode_set_size (fs, inode, len);
+  ret = ext2_write_inode (fs, *ino, inode, 0);
+
+cleanup:
+  ext2_inode_put (fs, inode);
+  return ret;
+}
+
+/* creates a symbolic link name in dir_ino pointing to target */
+int
+ext2_symlink (ext2_fs_t *fs, uint32_t dir_ino, const char *name,
+              const char *target, uint32_t *ino)
+{
+  int ret;
+
+  pthread_mutex_lock (&fs->lock);
+  ret = ext2_symlink_locked (fs, dir_ino, name, target, ino);
+  pthread_mutex_unlock (&fs->lock);
+
+  return ret;
+}
+
+/*
+ * Creates a device node, FIFO or socket; mode carries the type. Device
+ * numbers that fit into a byte each use the old encoding in block[0], the
+ * kernel's new encoding in block[1] otherwise.
+ */
+int
+ext2_mknod (ext2_fs_t *fs, uint32_t dir_ino, const char *name, uint16_t mode,
+            uint32_t major, uint32_t minor, uint32_t *ino)
+{
+  ext2_inode_t *inode;
+  int ret = -1;
+
+  switch (EXT2_INODE_TYPE (mode))
+    {
+    case EXT2_INODE_TYPE_FIFO:
+    case EXT2_INODE_TYPE_CHR_DEV:
+    case EXT2_INODE_TYPE_BLK_DEV:
+    case EXT2_INODE_TYPE_SOCK:
+      break;
+    default:
+      errno = -EINVAL;
+      return -1;
+    }
+
+  pthread_mutex_lock (&fs->lock);
+
+  if (ext2_create_locked (fs, dir_ino, name, mode,
+                          ext2_inode_group (fs, dir_ino), ino)
+      == -1)
+    goto out;
+
+  inode = ext2_inode_get (fs, *ino);
+  if (inode == NULL)
+    goto out;
+
+  if (EXT2_INODE_TYPE (mode) == EXT2_INODE_TYPE_CHR_DEV
+      || EXT2_INODE_TYPE (mode) == EXT2_INODE_TYPE_BLK_DEV)
+    {
+      if (major < 256 && minor < 256)
+        inode->block[0] = major << 8 | minor;
+      else
+        inode->block[1] = (minor & 0xff) | major << 8 | (minor & ~0xffu) << 12;
+    }
+
+  ret = ext2_write_inode (fs, *ino, inode, 0);
+  ext2_inode_put (fs, inode);
+
+out:
+  pthread_mutex_unlock (&fs->lock);
+  return ret;
+}
+
+static int
+ext2_link_locked (ext2_fs_t *fs, uint32_t dir_ino, const char *name,
+                  uint32_t ino)
+{
+  size_t len = strlen (name);
+  ext2_inode_t *dir = NULL, *inode;
+  int ret = -1;
+
+  if (ext2_name_free (fs, dir_ino, name, len) == -1)
+    return -1;
+
+  inode = ext2_inode_get (fs, ino);
+  if (inode == NULL)
+    return -1;
+
+  if (EXT2_INODE_TYPE (inode->mode) == EXT2_INODE_TYPE_DIR)
+    {
+      errno = -EPERM;
+      goto cleanup;
+    }
+
+  dir = ext2_inode_get (fs, dir_ino);
+  if (dir == NULL)
+    goto cleanup;
+
+  if (EXT2_INODE_TYPE (dir->mode) != EXT2_INODE_TYPE_DIR)
+    {
+      errno = -ENOTDIR;
+      goto cleanup;
+    }
+
+  if (ext2_dir_add (fs, dir_ino, dir, name, len, ino,
+                    ext2_ft_from_mode (inode->mode))
+      == -1)
+    goto cleanup;
+
+  inode->num_hard_links++;
+  dir->last_mod_time = time (NULL);
+
+  if (ext2_write_inode (fs, ino, inode, 0) == -1
+      || ext2_write_inode (fs, dir_ino, dir, 0) == -1)
+    goto cleanup;
+
+  ret = 0;
+
+cleanup:
+  if (dir != NULL)
+    ext2_inode_put (fs, dir);
+
+  ext2_inode_put (fs, inode);
+  return ret;
+}
+
+/* adds another name for ino, which must not be a directory, to dir_ino */
+int
+ext2_link (ext2_fs_t *fs, uint32_t dir_ino, const char *name, uint32_t ino)
+{
+  int ret;
+
+  pthread_mutex_lock (&fs->lock);
+  ret = ext2_link_locked (fs, dir_ino, name, ino);
+  pthread_mutex_unlock (&fs->lock);
+
+  return ret;
+}
+
+/*
+ * Sets the permission bits, owner and modification time of an inode, the
+ * way an archive extractor restores them. Owner IDs past 16 bits go into
+ * the Linux high halves in os_res2.
+ */
+int
+ext2_setattr (ext2_fs_t *fs, uint32_t ino, uint16_t perm, uint32_t uid,
+              uint32_t gid, uint32_t mtime)
+{
+  ext2_inode_t *inode;
+  uint16_t hi;
+  int ret;
+
+  pthread_mutex_lock (&fs->lock);
+
+  inode = ext2_inode_get (fs, ino);
+  if (inode == NULL)
+    {
+      pthread_mutex_unlock (&fs->lock);
+      return -1;
+    }
+
+  inode->mode = EXT2_INODE_TYPE (inode->mode) | (perm & 07777);
+  inode->uid = uid;
+  inode->grp_id = gid;
+  inode->last_mod_time = mtime;
+
+  hi = uid >> 16;
+  memcpy (inode->os_res2 + 4, &hi, sizeof (hi));
+  hi = gid >> 16;
+  memcpy (inode->os_res2 + 6, &hi, sizeof (hi));
+
+  ret = ext2_write_inode (fs, ino, inode, 0);
+  ext2_inode_put (fs, inode);
+
+  pthread_mutex_unlock (&fs->lock);
+  return ret;
+}
+
+static dir_t *
+ext2_file_opendir (file_t *file)
+{
+  EXT2_FILE (file);
+  ext2_dir_t *dir;
+  uint16_t mode;
+
+  pthread_mutex_lock (&ext2_file->fs->lock);
+  mode = ext2_file->inode->mode;
+  pthread_mutex_unlock (&ext2_file->fs->lock);
+
+  if (EXT2_INODE_TYPE (mode) != EXT2_INODE_TYPE_DIR)
+    {
+      errno = -ENOTDIR;
+      return NULL;
+    }
+
+  dir = malloc (sizeof (ext2_dir_t));
+  if (dir == NULL)
+    {
+      errno = -ENOMEM;
+      return NULL;
+    }
+
+  memset (dir, 0, sizeof (ext2_dir_t));
+
+  dir->base.readdir = ext2_dir_readdir;
+  dir->base.rewinddir = ext2_dir_rewinddir;
+  dir->base.closedir = ext2_dir_closedir;
+
+  dir->file = ext2_file;
+  dir->ent.name = dir->name;
+
+  return &dir->base;
+}
+
 static int
-ext2_read_from_block (ext2_fs_t *fs, size_t block, size_t off, void *buf,
-                      size_t nbytes)
+ext2_file_get_type (file_t *file, file_type_t *type)
 {
-  if (block >= fs->sb->block_cnt)
-    return -3;
+  EXT2_FILE (file);
+  *type = ext2_inode_get_type (ext2_file->inode);
+  return 0;
+}
+
+static int
+ext2_file_get_size (file_t *file, size_t *size)
+{
+  EXT2_FILE (file);
+
+  pthread_mutex_lock (&ext2_file->fs->lock);
+  *size = ext2_inode_get_size (ext2_file->fs, ext2_file->inode);
+  pthread_mutex_unlock (&ext2_file->fs->lock);
 
-  return file_sread (fs->file, block * fs->block_size + off, FILE_SEEK_START,
-                     buf, nbytes);
+  return 0;
 }
 
-static ext2_inode_t *
-ext2_read_inode (ext2_fs_t *fs, size_t inode)
+/* can only grow a file, the new tail is a hole that reads back as zeros */
+static int
+ext2_file_set_size (file_t *file, size_t size)
 {
-  size_t block_group = (inode - 1) / fs->sb->inodes_per_group;
-  ext2_bgdt_t *bgdt;
-  ext2_inode_t *_inode = NULL;
-  size_t off;
+  EXT2_FILE (file);
+  ext2_fs_t *fs = ext2_file->fs;
+  ext2_inode_t *inode = ext2_file->inode;
+  int ret = 0;
 
-  if (!inode || inode > fs->sb->inode_cnt
-      || block_group >= fs->block_group_cnt)
+  pthread_mutex_lock (&fs->lock);
+
+  if (EXT2_INODE_TYPE (inode->mode) != EXT2_INODE_TYPE_REG_FILE
+      || size < ext2_inode_get_size (fs, inode))
     {
       errno = -EINVAL;
-      return NULL;
+      ret = -1;
+    }
+  else if (size > ext2_inode_get_size (fs, inode))
+    {
+      ext2_inode_set_size (fs, inode, size);
+      inode->last_mod_time = time (NULL);
+      ext2_file->dirty = 1;
     }
 
-  bgdt = fs->bgdt + block_group;
-  _inode = malloc (fs->inode_size);
+  pthread_mutex_unlock (&fs->lock);
+  return ret;
+}
+
+static int
+ext2_file_seek (file_t *file, size_t off, file_seek_t origin)
+{
+  EXT2_FILE (file);
 
-  if (_inode == NULL)
+  switch (origin)
     {
-      errno = -ENOMEM;
-      goto cleanup;
+    case FILE_SEEK_START:
+      ext2_file->off = off;
+      break;
+    case FILE_SEEK_CUR:
+      ext2_file->off += off;
+      break;
+    case FILE_SEEK_END:
+      /* the size changes under writers in other threads */
+      pthread_mutex_lock (&ext2_file->fs->lock);
+      ext2_file->off
+          = ext2_inode_get_size (ext2_file->fs, ext2_file->inode) + off;
+      pthread_mutex_unlock (&ext2_file->fs->lock);
+      break;
+    default:
+      errno = -EINVAL;
+      return -1;
     }
 
-  off = fs->inode_size * ((inode - 1) % fs->sb->inodes_per_group);
-  if (ext2_read_from_block (fs, bgdt->inode_table, off, _inode, fs->inode_size)
-      != (ssize_t) fs->inode_size)
+  return 0;
+}
+
+static ssize_t
+ext2_file_read (file_t *file, void *buf, size_t nbytes)
+{
+  EXT2_FILE (file);
+  ssize_t read = ext2_file_pread (file, buf, nbytes, ext2_file->off);
+
+  if (read > 0)
+    ext2_file->off += read;
+
+  return read;
+}
+
+/*
+ * The fs lock is held for the block map walks but dropped around the data
+ * transfers, those only touch the image file.
+ */
+static ssize_t
+ext2_file_pread_locked (ext2_file_t *ext2_file, void *buf, size_t nbytes,
+                        size_t off)
+{
+  ext2_fs_t *fs = ext2_file->fs;
+  const ext2_inode_t *inode = ext2_file->inode;
+  uint64_t size = ext2_inode_get_size (fs, inode);
+  unsigned char *dst = buf;
+  size_t left;
+  int ret;
+
+  if (off >= size)
+    return 0;
+
+  if (nbytes > size - off)
+    nbytes = size - off;
+
+  if (ext2_inode_is_fast_symlink (inode))
+    {
+      memcpy (buf, (const char *) inode->block + off, nbytes);
+      return nbytes;
+    }
+
+  /*
+   * One read per physically contiguous run instead of one per block, and
+   * all the runs of a window go to the image as a single batch.
+   */
+  for (left = nbytes; left;)
+    {
+      ext2_run_t runs[EXT2_READ_RUNS];
+      file_io_t ios[EXT2_READ_RUNS];
+      size_t nruns = EXT2_READ_RUNS, nios = 0;
+      size_t first = off / fs->block_size;
+      size_t last = (off + left - 1) / fs->block_size;
+
+      if (ext2_map_runs (fs, inode, first, last - first + 1, runs, &nruns)
+          == -1)
+        return -1;
+
+      for (size_t i = 0; i < nruns && left; i++)
+        {
+          size_t run_end = (runs[i].lblk + runs[i].len) * fs->block_size;
+          size_t n = run_end - off;
+
+          if (n > left)
+            n = left;
+
+          if (!runs[i].pblk)
+            memset (dst, 0, n);
+          else
+            {
+              size_t pos = runs[i].pblk * fs->block_size + off
+                           - runs[i].lblk * fs->block_size;
+
+              if (runs[i].pblk + runs[i].len > fs->sb->block_cnt)
+                {
+                  errno = -EIO;
+                  return -1;
+                }
+
+              ios[nios].op = FILE_IO_READ;
+              ios[nios].buf = dst;
+              ios[nios].nbytes = n;
+              ios[nios].off = pos;
+              nios++;
+            }
+
+          dst += n;
+          off += n;
+          left -= n;
+        }
+
+      pthread_mutex_unlock (&fs->lock);
+      ret = file_submit (fs->file, ios, nios);
+      pthread_mutex_lock (&fs->lock);
+
+      if (ret == -1)
+        {
+          errno = -EIO;
+          return -1;
+        }
+    }
+
+  return nbytes;
+}
+
+static ssize_t
+ext2_file_pread (file_t *file, void *buf, size_t nbytes, size_t off)
+{
+  EXT2_FILE (file);
+  ssize_t ret;
+
+  pthread_mutex_lock (&ext2_file->fs->lock);
+  ret = ext2_file_pread_locked (ext2_file, buf, nbytes, off);
+  pthread_mutex_unlock (&ext2_file->fs->lock);
+
+  return ret;
+}
+
+static ssize_t
+ext2_file_write (file_t *file, const void *buf, size_t nbytes)
+{
+  EXT2_FILE (file);
+  ssize_t written = ext2_file_pwrite (file, buf, nbytes, ext2_file->off);
+
+  if (written > 0)
+    ext2_file->off += written;
+
+  return written;
+}
+
+/* writes part of one block through the block cache */
+static int
+ext2_file_write_partial (ext2_fs_t *fs, uint32_t pblk, int fresh, size_t off,
+                         const void *buf, size_t nbytes)
+{
+  unsigned char *block = ext2_get_block_mut (fs, pblk, fresh);
+
+  if (block == NULL)
+    return -1;
+
+  /* data is read around the cache, so it can't be left dirty in it */
+  memcpy (block + off, buf, nbytes);
+  return ext2_put_block_sync (fs, block);
+}
+
+static ssize_t
+ext2_file_pwrite_locked (ext2_file_t *ext2_file, const void *buf,
+                         size_t nbytes, size_t off)
+{
+  ext2_fs_t *fs = ext2_file->fs;
+  ext2_inode_t *inode = ext2_file->inode;
+  uint64_t size = ext2_inode_get_size (fs, inode);
+  const unsigned char *src = buf;
+  size_t first, last, left;
+  uint32_t head, tail;
+  ssize_t written;
+
+  if (EXT2_INODE_TYPE (inode->mode) != EXT2_INODE_TYPE_REG_FILE)
     {
       errno = -EINVAL;
-      goto cleanup;
+      return -1;
     }
 
-  return _inode;
+  if (!nbytes)
+    return 0;
 
-cleanup:
-  if (_inode != NULL)
-    free (_inode);
+  first = off / fs->block_size;
+  last = (off + nbytes - 1) / fs->block_size;
+
+  /* blocks only partly written must be zero filled if they are new */
+  if (ext2_bmap (fs, inode, first, &head) == -1
+      || ext2_bmap (fs, inode, last, &tail) == -1)
+    return -1;
+
+  ext2_file->dirty = 1;
+  if (ext2_bmap_alloc (fs, inode, &ext2_file->alloc, first, last - first + 1)
+      == -1)
+    return -1;
+
+  /* full blocks go out one write per physically contiguous run */
+  for (left = nbytes; left;)
+    {
+      ext2_run_t runs[EXT2_READ_RUNS];
+      size_t nruns = EXT2_READ_RUNS;
+      size_t lblk = off / fs->block_size;
+
+      if (ext2_map_runs (fs, inode, lblk, last - lblk + 1, runs, &nruns)
+          == -1)
+        return -1;
+
+      for (size_t i = 0; i < nruns && left; i++)
+        {
+          size_t run_end = (runs[i].lblk + runs[i].len) * fs->block_size;
+
+          while (off < run_end && left)
+            {
+              size_t in_blk = off % fs->block_size;
+              size_t n = run_end - off;
+              uint32_t pblk;
+
+              lblk = off / fs->block_size;
+              pblk = runs[i].pblk + lblk - runs[i].lblk;
+
+              if (n > left)
+                n = left;
+
+              if (in_blk || n < fs->block_size)
+                {
+                  int fresh = (lblk == first && !head)
+                              || (lblk == last && !tail);
+
+                  if (n > fs->block_size - in_blk)
+                    n = fs->block_size - in_blk;
+
+                  if (ext2_file_write_partial (fs, pblk, fresh, in_blk, src,
+                                               n)
+                      == -1)
+                    return -1;
+                }
+              else
+                {
+                  n -= n % fs->block_size;
+
+                  /* the blocks are this file's alone by now */
+                  pthread_mutex_unlock (&fs->lock);
+                  written = file_pwrite (fs->file, src, n,
+                                         pblk * fs->block_size);
+                  pthread_mutex_lock (&fs->lock);
+
+                  if (written != (ssize_t) n)
+                    {
+                      errno = -EIO;
+                      return -1;
+                    }
+
+                  ext2_bcache_invalidate (fs, pblk, n / fs->block_size);
+                }
+
+              src += n;
+              off += n;
+              left -= n;
+            }
+        }
+    }
+
+  if (off > size)
+    ext2_inode_set_size (fs, inode, off);
+
+  inode->last_mod_time = time (NULL);
+  return nbytes;
+}
+
+static ssize_t
+ext2_file_pwrite (file_t *file, const void *buf, size_t nbytes, size_t off)
+{
+  EXT2_FILE (file);
+  ssize_t ret;
+
+  pthread_mutex_lock (&ext2_file->fs->lock);
+  ret = ext2_file_pwrite_locked (ext2_file, buf, nbytes, off);
+  pthread_mutex_unlock (&ext2_file->fs->lock);
+
+  return ret;
+}
+
+static void
+ext2_file_close (file_t *file)
+{
+  EXT2_FILE (file);
+  ext2_fs_t *fs = ext2_file->fs;
+
+  /* like ext2_file_reserve, without fs->lock */
+  ext2_alloc_release (fs, &ext2_file->alloc);
+
+  pthread_mutex_lock (&fs->lock);
+
+  if (ext2_file->dirty)
+    ext2_write_inode (fs, ext2_inode_ino (ext2_file->inode), ext2_file->inode,
+                      0);
+
+  ext2_inode_put (fs, ext2_file->inode);
+
+  pthread_mutex_unlock (&fs->lock);
+  free (ext2_file);
+}
+
+static void
+ext2_dir_release_block (ext2_dir_t *dir)
+{
+  ext2_fs_t *fs = dir->file->fs;
 
+  if (dir->block != NULL)
+    {
+      pthread_mutex_lock (&fs->lock);
+      ext2_put_block (fs, dir->block);
+      pthread_mutex_unlock (&fs->lock);
+    }
+
+  dir->block = NULL;
+}
+
+static dentry_t *
+ext2_dir_readdir_locked (ext2_dir_t *ext2_dir)
+{
+  ext2_fs_t *fs = ext2_dir->file->fs;
+  const ext2_inode_t *inode = ext2_dir->file->inode;
+  uint64_t size = ext2_inode_get_size (fs, inode);
+
+  while (ext2_dir->pos < size)
+    {
+      size_t lblk = ext2_dir->pos / fs->block_size;
+      size_t off = ext2_dir->pos % fs->block_size;
+      const ext2_dirent_t *dirent;
+      size_t len;
+
+      if (ext2_dir->block == NULL || ext2_dir->lblk != lblk)
+        {
+          uint32_t pblk;
+
+          ext2_dir_release_block (ext2_dir);
+
+          if (ext2_bmap (fs, inode, lblk, &pblk) == -1)
+            return NULL;
+
+          /* holes in directories hold no entries */
+          if (!pblk)
+            {
+              ext2_dir->pos += fs->block_size - off;
+              continue;
+            }
+
+          ext2_dir->block = ext2_get_block (fs, pblk);
+          if (ext2_dir->block == NULL)
+            return NULL;
+
+          ext2_dir->lblk = lblk;
+        }
+
+      dirent = ext2_dirent_at (fs, ext2_dir->block, off);
+      if (dirent == NULL)
+        {
+          errno = -EIO;
+          return NULL;
+        }
+
+      ext2_dir->pos += dirent->rec_len;
+
+      if (!dirent->inode)
+        continue;
+
+      len = ext2_dirent_name_len (fs, dirent);
+      memcpy (ext2_dir->name, dirent->name, len);
+      ext2_dir->name[len] = '\0';
+
+      ext2_dir->ent.ino = dirent->inode;
+
+      if (ext2_has_filetype (fs))
+        ext2_dir->ent.type = ext2_ft_get_type (dirent->file_type);
+      else
+        {
+          ext2_inode_t *child = ext2_inode_get (fs, dirent->inode);
+          ext2_dir->ent.type = child != NULL ? ext2_inode_get_type (child)
+                                             : FILE_TYPE_UNKN;
+          ext2_inode_put (fs, child);
+        }
+
+      return &ext2_dir->ent;
+    }
+
+  ext2_dir_release_block (ext2_dir);
   return NULL;
 }
 
+static dentry_t *
+ext2_dir_readdir (dir_t *dir)
+{
+  EXT2_DIR (dir);
+  ext2_fs_t *fs = ext2_dir->file->fs;
+  dentry_t *ent;
+
+  /* the block and inode caches are shared with every other file */
+  pthread_mutex_lock (&fs->lock);
+  ent = ext2_dir_readdir_locked (ext2_dir);
+  pthread_mutex_unlock (&fs->lock);
+
+  return ent;
+}
+
+static void
+ext2_dir_rewinddir (dir_t *dir)
+{
+  EXT2_DIR (dir);
+  ext2_dir_release_block (ext2_dir);
+  ext2_dir->pos = 0;
+}
+
+static void
+ext2_dir_closedir (dir_t *dir)
+{
+  EXT2_DIR (dir);
+  ext2_dir_release_block (ext2_dir);
+  free (ext2_dir);
+}
+
 fs_t *
 ext2_fs_init (file_t *file, fs_init_error_t *error)
 {
-  ext2_fs_t *fs;
+  ext2_fs_t *fs = NULL;
+  ext2_arena_t arena;
   ext2_sb_t *sb;
-  ext2_inode_t *root_inode;
+  pthread_mutexattr_t attr;
+  const void *mapped_sb;
   size_t size;
 
   if (file_get_size (file, &size) == -1)
@@ -114,23 +4191,41 @@ ext2_fs_init (file_t *file, fs_init_error_t *error)
   if (size < 2048)
     ERROR (error, "image too small for superblock");
 
-  sb = malloc (1024);
+  /* everything that lasts the whole session comes from one arena */
+  ext2_arena_init (&arena);
+  fs = ext2_arena_alloc (&arena, sizeof (ext2_fs_t));
+  if (fs == NULL)
+    ERROR (error, "out of memory");
+
+  memset (fs, 0, sizeof (ext2_fs_t));
+  fs->arena = arena;
+  fs->file = file;
+
+  sb = ext2_arena_alloc (&fs->arena, 1024);
   if (sb == NULL)
     ERROR (error, "out of memory");
 
-  if (file_sread (file, 1024, FILE_SEEK_START, sb, 1024) != 1024)
+  fs->sb = sb;
+
+  mapped_sb = file_map (file, 1024, 1024);
+  if (mapped_sb != NULL)
+    memcpy (sb, mapped_sb, 1024);
+  else if (file_sread (file, 1024, FILE_SEEK_START, sb, 1024) != 1024)
     ERROR (error, "failed to read superblock");
 
   if (sb->magic != EXT2_MAGIC)
     ERROR (error, "invalid ext2 signature in superblock");
 
-  fs = malloc (sizeof (ext2_fs_t));
-  if (fs == NULL)
-    ERROR (error, "out of memory");
+  /* the file API re-enters itself, ext2_file_create opens the new file */
+  if (pthread_mutexattr_init (&attr))
+    ERROR (error, "failed to initialize lock");
 
-  memset (fs, 0, sizeof (ext2_fs_t));
-  fs->sb = sb;
-  fs->file = file;
+  fs->has_lock = !pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE)
+                 && !pthread_mutex_init (&fs->lock, &attr);
+  pthread_mutexattr_destroy (&attr);
+
+  if (!fs->has_lock)
+    ERROR (error, "failed to initialize lock");
 
   /* we only permit block sizes of up to 8192 */
   if (sb->log2_block_size > 3)
@@ -168,52 +4263,174 @@ ext2_fs_init (file_t *file, fs_init_error_t *error)
       fs->first_block = 0;
     }
 
+  if (ext2_bcache_init (fs, EXT2_BCACHE_DEFAULT_BLOCKS) == -1)
+    ERROR (error, "out of memory");
+
+  if (ext2_dcache_init (fs, EXT2_DCACHE_ENTRIES) == -1)
+    ERROR (error, "out of memory");
+
   fs->bgdt_size = fs->block_group_cnt * sizeof (ext2_bgdt_t);
-  fs->bgdt = malloc (fs->bgdt_size);
+  fs->bgdt = ext2_arena_alloc (&fs->arena, fs->bgdt_size);
   if (fs->bgdt == NULL)
     ERROR (error, "out of memory");
 
-  if (ext2_read_from_block (fs, fs->block_size == 1024 ? 2 : 1, 0, fs->bgdt,
-                            fs->bgdt_size)
+  /* one read for the whole table, it doesn't belong in the block cache */
+  if (file_pread (file, fs->bgdt, fs->bgdt_size,
+                  (fs->block_size == 1024 ? 2 : 1) * fs->block_size)
       != (ssize_t) fs->bgdt_size)
     ERROR (error, "failed to read block group descriptor table");
 
-  root_inode = ext2_read_inode (fs, EXT2_ROOT_INODE);
-  if (root_inode == NULL)
+  fs->group_locks = ext2_arena_alloc (
+      &fs->arena, fs->block_group_cnt * sizeof (pthread_mutex_t));
+  if (fs->group_locks == NULL)
+    ERROR (error, "out of memory");
+
+  for (; fs->ngroup_locks < fs->block_group_cnt; fs->ngroup_locks++)
+    if (pthread_mutex_init (fs->group_locks + fs->ngroup_locks, NULL))
+      ERROR (error, "failed to initialize lock");
+
+  fs->root_inode = ext2_inode_get (fs, EXT2_ROOT_INODE);
+  if (fs->root_inode == NULL)
     ERROR (error, "failed to read root inode");
 
-  if (!(root_inode->mode & EXT2_INODE_TYPE_DIR))
+  if (!(fs->root_inode->mode & EXT2_INODE_TYPE_DIR))
     ERROR (error, "root inode is not directory");
 
-  fs->root_inode = root_inode;
-
   fs->fs.data = fs;
   return &fs->fs;
 
 cleanup:
-  if (sb != NULL)
-    free (sb);
-
   if (fs != NULL)
     {
-      if (fs->bgdt != NULL)
-        free (fs->bgdt);
+      if (fs->has_lock)
+        pthread_mutex_destroy (&fs->lock);
 
-      if (fs->root_inode != NULL)
-        free (fs->root_inode);
+      for (size_t i = 0; i < fs->ngroup_locks; i++)
+        pthread_mutex_destroy (fs->group_locks + i);
 
-      free (fs);
+      ext2_bcache_fini (fs);
+
+      /* fs is in the arena itself */
+      arena = fs->arena;
+      ext2_arena_fini (&arena);
     }
 
   return NULL;
 }
 
+static int
+ext2_io_cmp (const void *a, const void *b)
+{
+  const file_io_t *x = a, *y = b;
+
+  return x->off < y->off ? -1 : x->off > y->off;
+}
+
+/*
+ * Writes every dirty cached block, the superblock and the BGDT back to the
+ * image as one batch sorted by offset, so that neighbouring blocks (the
+ * superblock and BGDT on 1K images, runs of inode table blocks) can go out
+ * as a single write. On failure everything stays dirty.
+ */
+int
+ext2_fs_sync (ext2_fs_t *fs)
+{
+  ext2_bcache_t *bcache = &fs->bcache;
+  int sb_dirty, bgdt_dirty;
+  file_io_t *ios;
+  size_t nios = 0;
+  int ret = 0;
+
+  pthread_mutex_lock (&fs->lock);
+
+  /* taken before the writes, an allocation meanwhile sets them again */
+  sb_dirty = __atomic_exchange_n (&fs->sb_dirty, 0, __ATOMIC_ACQ_REL);
+  bgdt_dirty = __atomic_exchange_n (&fs->bgdt_dirty, 0, __ATOMIC_ACQ_REL);
+
+  if (!bcache->ndirty && !sb_dirty && !bgdt_dirty)
+    goto out;
+
+  ios = malloc ((bcache->ndirty + 2) * sizeof (file_io_t));
+  if (ios == NULL)
+    {
+      errno = -ENOMEM;
+      ret = -1;
+      goto restore;
+    }
+
+  for (size_t i = 0; i < bcache->nents; i++)
+    if (bcache->ents[i].dirty)
+      {
+        ios[nios].op = FILE_IO_WRITE;
+        ios[nios].buf = bcache->data + i * fs->block_size;
+        ios[nios].nbytes = fs->block_size;
+        ios[nios].off = (size_t) bcache->ents[i].block * fs->block_size;
+        nios++;
+      }
+
+  if (sb_dirty)
+    {
+      ios[nios].op = FILE_IO_WRITE;
+      ios[nios].buf = fs->sb;
+      ios[nios].nbytes = 1024;
+      ios[nios].off = 1024;
+      nios++;
+    }
+
+  if (bgdt_dirty)
+    {
+      ios[nios].op = FILE_IO_WRITE;
+      ios[nios].buf = fs->bgdt;
+      ios[nios].nbytes = fs->bgdt_size;
+      ios[nios].off = (fs->block_size == 1024 ? 2 : 1) * fs->block_size;
+      nios++;
+    }
+
+  qsort (ios, nios, sizeof (file_io_t), ext2_io_cmp);
+
+  if (file_submit (fs->file, ios, nios) == -1)
+    {
+      errno = -EIO;
+      ret = -1;
+    }
+  else
+    {
+      for (size_t i = 0; i < bcache->nents; i++)
+        bcache->ents[i].dirty = 0;
+
+      bcache->ndirty = 0;
+    }
+
+  free (ios);
+
+restore:
+  if (ret == -1 && sb_dirty)
+    __atomic_store_n (&fs->sb_dirty, 1, __ATOMIC_RELEASE);
+  if (ret == -1 && bgdt_dirty)
+    __atomic_store_n (&fs->bgdt_dirty, 1, __ATOMIC_RELEASE);
+
+out:
+  pthread_mutex_unlock (&fs->lock);
+  return ret;
+}
+
 void
 ext2_fs_fini (fs_t *_fs)
 {
   ext2_fs_t *fs = (ext2_fs_t *) _fs->data;
-  free (fs->sb);
-  free (fs->bgdt);
-  free (fs->root_inode);
-  free (fs);
+  ext2_arena_t arena;
+
+  /* callers that care about write errors sync first themselves */
+  ext2_fs_sync (fs);
+
+  /* resizable, so it isn't in the arena */
+  ext2_bcache_fini (fs);
+  pthread_mutex_destroy (&fs->lock);
+
+  for (size_t i = 0; i < fs->ngroup_locks; i++)
+    pthread_mutex_destroy (fs->group_locks + i);
+
+  /* the rest, fs included, goes in one release */
+  arena = fs->arena;
+  ext2_arena_fini (&arena);
 }
\ No newline at end of file
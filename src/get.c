@@ -0,0 +1,374 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ext2.h"
+#include "file.h"
+#include "fs.h"
+
+#define USE_ESCAPE_SEQUENCES
+
+#ifdef USE_ESCAPE_SEQUENCES
+
+#define ESC_RESET "\033[0m"
+#define ESC_BOLD  "\033[1m"
+#define ESC_RED   "\033[31m"
+
+#else
+
+#define ESC_RESET
+#define ESC_BOLD
+#define ESC_RED
+
+#endif
+
+/* bounce buffer size when the kernel can't copy for us */
+#define GET_BUF_SIZE (8 << 20)
+
+static const char *get_cmd_name = "ext2get";
+
+static file_t *img_file = NULL;
+static file_t *dst_file = NULL;
+static fs_t *fs = NULL;
+static char *error_msg = NULL;
+static unsigned char *buf = NULL;
+static int no_copy_range = 0;
+
+typedef struct
+{
+  const char *img;
+  int nsrcs;
+  const char **srcs;
+  const char *dst;
+} get_params_t;
+
+static void
+cleanup (void)
+{
+  if (dst_file != NULL)
+    file_close (dst_file);
+
+  if (fs != NULL)
+    ext2_fs_fini (fs);
+
+  if (img_file != NULL)
+    file_close (img_file);
+
+  if (buf != NULL)
+    free (buf);
+
+  if (error_msg != NULL)
+    free (error_msg);
+}
+
+static void
+fail (const char *fmt, ...)
+{
+  const char *internal_err = "formatting error";
+  char *msg = NULL;
+  int tmp, _errno;
+  va_list args;
+
+  va_start (args, fmt);
+  tmp = vasprintf (&msg, fmt, args);
+  _errno = errno;
+
+  cleanup ();
+
+  if (tmp == -1)
+    goto perror;
+
+  fprintf (stderr, ESC_BOLD "%s: " ESC_RED "error: " ESC_RESET "%s\n",
+           get_cmd_name, msg);
+
+  va_end (args);
+  exit (1);
+
+perror:
+  if (msg != NULL)
+    free (msg);
+
+  if (_errno == -ENOMEM)
+    internal_err = "out of memory";
+
+  fprintf (stderr, ESC_BOLD "%s: " ESC_RED "error:" ESC_RESET "%s\n",
+           get_cmd_name, internal_err);
+
+  exit (2);
+}
+
+static void
+usage (void)
+{
+  printf ("Usage: %s [OPTION]... IMAGE SOURCE    DEST\n", get_cmd_name);
+  printf ("   or: %s [OPTION]... IMAGE SOURCE... DIRECTORY\n", get_cmd_name);
+}
+
+static void
+get_copy (const char *dst, size_t img_off, size_t dst_off, size_t nbytes)
+{
+  /* image to host inside the kernel when both ends are descriptors */
+  while (nbytes && !no_copy_range)
+    {
+      ssize_t copied
+          = file_copy_range (img_file, img_off, dst_file, dst_off, nbytes);
+
+      if (copied <= 0)
+        {
+          /* only a refused copy goes on through a buffer, not a failed one */
+          if (copied == -1 && errno != -EXDEV && errno != -ENOSYS
+              && errno != -EINVAL && errno != -EOPNOTSUPP)
+            fail ("failed to copy to '%s'", dst);
+
+          no_copy_range = 1;
+          break;
+        }
+
+      img_off += copied;
+      dst_off += copied;
+      nbytes -= copied;
+    }
+
+  while (nbytes)
+    {
+      size_t n = nbytes > GET_BUF_SIZE ? GET_BUF_SIZE : nbytes;
+
+      if (buf == NULL && (buf = malloc (GET_BUF_SIZE)) == NULL)
+        fail ("out of memory");
+
+      if (file_pread (img_file, buf, n, img_off) != (ssize_t) n)
+        fail ("failed to read image");
+
+      if (file_pwrite (dst_file, buf, n, dst_off) != (ssize_t) n)
+        fail ("failed to write '%s'", dst);
+
+      img_off += n;
+      dst_off += n;
+      nbytes -= n;
+    }
+}
+
+static void
+get_file (const char *src, const char *dst)
+{
+  ext2_fs_t *ext2 = fs->data;
+  ext2_inode_t *inode;
+  uint64_t size, off;
+  uint32_t ino;
+
+  if (ext2_namei (ext2, src, &ino) == -1)
+    {
+      if (errno == -ENOENT)
+        fail ("cannot stat '%s': no such file or directory", src);
+      fail ("cannot stat '%s'", src);
+    }
+
+  inode = ext2_inode_get (ext2, ino);
+  if (inode == NULL)
+    fail ("failed to read inode of '%s'", src);
+
+  if (ext2_inode_get_type (inode) != FILE_TYPE_FILE)
+    fail ("'%s' is not a regular file", src);
+
+  dst_file = file_open (dst, FILE_OWRONLY | FILE_OCREAT | FILE_OTRUNC);
+  if (dst_file == NULL)
+    fail ("failed to open destination file: '%s'", dst);
+
+  size = ext2_inode_get_size (ext2, inode);
+
+  /* holes are skipped, the final set_size leaves them sparse on the host */
+  for (off = 0; off < size;)
+    {
+      ext2_run_t runs[EXT2_READ_RUNS];
+      size_t nruns = EXT2_READ_RUNS;
+      size_t lblk = off / ext2->block_size;
+      size_t nblks = (size - off + ext2->block_size - 1) / ext2->block_size;
+      ssize_t mapped;
+
+      mapped = ext2_map_runs (ext2, inode, lblk, nblks, runs, &nruns);
+      if (mapped == -1)
+        fail ("failed to map blocks of '%s'", src);
+
+      for (size_t i = 0; i < nruns; i++)
+        {
+          size_t start = runs[i].lblk * ext2->block_size;
+          size_t n = runs[i].len * ext2->block_size;
+
+          if (!runs[i].pblk)
+            continue;
+
+          if (runs[i].pblk + runs[i].len > ext2->sb->block_cnt)
+            fail ("corrupt block map in '%s'", src);
+
+          if (start + n > size)
+            n = size - start;
+
+          get_copy (dst, runs[i].pblk * ext2->block_size, start, n);
+        }
+
+      off += mapped * ext2->block_size;
+    }
+
+  if (file_set_size (dst_file, size) == -1)
+    fail ("failed to resize '%s'", dst);
+
+  file_close (dst_file);
+  dst_file = NULL;
+
+  ext2_inode_put (ext2, inode);
+}
+
+static int
+get_is_dir (const char *path)
+{
+  file_t *file = file_open (path, FILE_ORDONLY);
+  file_type_t type = FILE_TYPE_UNKN;
+
+  if (file == NULL)
+    return 0;
+
+  file_get_type (file, &type);
+  file_close (file);
+
+  return type == FILE_TYPE_DIR;
+}
+
+static void
+get_op (get_params_t *params)
+{
+  fs_init_error_t error;
+  file_t *sparse_file;
+  int to_dir;
+
+  /* a plain descriptor lets the data move with copy_file_range */
+  img_file = file_open (params->img, FILE_ORDONLY);
+  if (img_file == NULL)
+    fail ("failed to open image file: '%s'", params->img);
+
+  /* compact sparse images are expanded on the fly */
+  sparse_file = file_open_maybe_sparse (img_file);
+  if (sparse_file == NULL)
+    fail (errno == -EBADMSG ? "invalid sparse image: '%s'"
+                            : "failed to read image file: '%s'",
+          params->img);
+  img_file = sparse_file;
+
+  for (int i = 0; i < params->nsrcs; i++)
+    if (params->srcs[i][0] != '/')
+      fail ("source must be absolute path: '%s'", params->srcs[i]);
+
+  to_dir = get_is_dir (params->dst);
+  if (params->nsrcs > 1 && !to_dir)
+    fail ("target '%s' is not a directory", params->dst);
+
+  fs = ext2_fs_init (img_file, &error);
+  if (fs == NULL)
+    {
+      if (error.allocated)
+        error_msg = error.alloc_error;
+      fail ("%s", error.const_error);
+    }
+
+  for (int i = 0; i < params->nsrcs; i++)
+    {
+      const char *src = params->srcs[i];
+      const char *base = strrchr (src, '/') + 1;
+      char *dst;
+
+      if (!to_dir)
+        {
+          get_file (src, params->dst);
+          continue;
+        }
+
+      if (base[0] == '\0')
+        fail ("cannot copy a directory: '%s'", src);
+
+      if (asprintf (&dst, "%s/%s", params->dst, base) == -1)
+        fail ("out of memory");
+
+      get_file (src, dst);
+      free (dst);
+    }
+
+  cleanup ();
+}
+
+int
+main (int argc, const char **argv)
+{
+  get_params_t params = { 0 };
+  int argn, nsrcs = 0;
+
+  /* pre-pass */
+  for (argn = 1; argn < argc; argn++)
+    {
+      const char *arg = argv[argn];
+
+      if (arg[0] == '-')
+        {
+          arg++;
+          while (arg[0] != '\0')
+            {
+              switch (arg[0])
+                {
+                case 'h':
+                  usage ();
+                  exit (0);
+                default:
+                  fail ("invalid option '%c'", arg[0]);
+                }
+              arg++;
+            }
+          continue;
+        }
+
+      if (params.img == NULL)
+        params.img = arg;
+      else
+        ++nsrcs;
+    }
+
+  if (params.img == NULL)
+    fail ("missing image operand");
+
+  params.img = NULL;
+
+  if (!nsrcs)
+    fail ("missing source operand");
+
+  if (!--nsrcs)
+    fail ("missing destination operand");
+
+  params.srcs = malloc (sizeof (const char *) * nsrcs);
+  if (params.srcs == NULL)
+    fail ("out of memory");
+
+  for (argn = 1; argn < argc; argn++)
+    {
+      const char *arg = argv[argn];
+
+      if (arg[0] == '-')
+        continue;
+
+      if (params.img == NULL)
+        params.img = arg;
+      else if (params.nsrcs < nsrcs)
+        params.srcs[params.nsrcs++] = arg;
+      else
+        params.dst = arg;
+    }
+
+  assert (params.img);
+  assert (params.nsrcs && params.srcs);
+  assert (params.dst);
+
+  get_op (&params);
+
+  free (params.srcs);
+
+  return 0;
+}
@@ -0,0 +1,481 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "file.h"
+
+#define URING_FILE(file) uring_file_t *uring_file = (uring_file_t *) (file)
+
+/* requests in flight at once, batches larger than this go in waves */
+#define URING_ENTRIES 64
+
+/*
+ * A regular file driven through an io_uring. Single reads and writes are
+ * batches of one; file_submit queues up to URING_ENTRIES requests with one
+ * system call and reaps them as they complete, in whatever order the device
+ * finishes them. The ring is set up with raw system calls, liburing isn't
+ * needed.
+ */
+typedef struct
+{
+  file_t base;
+  file_oflags_t oflags;
+  int fd;
+  size_t off;
+  int ring;
+  pthread_mutex_t lock; /* one submitter at a time owns the ring */
+  unsigned entries;
+  void *sq_ptr;
+  size_t sq_len;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  void *cq_ptr;
+  size_t cq_len;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+} uring_file_t;
+
+static int uring_file_get_type (file_t *file, file_type_t *type);
+static int uring_file_get_size (file_t *file, size_t *size);
+static int uring_file_seek (file_t *file, size_t off, file_seek_t origin);
+static ssize_t uring_file_read (file_t *file, void *buf, size_t nbytes);
+static ssize_t uring_file_write (file_t *file, const void *buf,
+                                 size_t nbytes);
+static ssize_t uring_file_pread (file_t *file, void *buf, size_t nbytes,
+                                 size_t off);
+static ssize_t uring_file_pwrite (file_t *file, const void *buf,
+                                  size_t nbytes, size_t off);
+static int uring_file_submit (file_t *file, file_io_t *ios, size_t nios);
+static int uring_file_next_data (file_t *file, size_t off, size_t *data,
+                                 size_t *hole);
+static void uring_file_close (file_t *file);
+
+static int
+uring_setup (uring_file_t *file)
+{
+  struct io_uring_params params;
+  unsigned char *sq, *cq;
+
+  memset (&params, 0, sizeof (params));
+
+  file->ring = syscall (__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (file->ring == -1)
+    return -1;
+
+  file->entries = params.sq_entries;
+  file->sq_len = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  file->cq_len = params.cq_off.cqes
+                 + params.cq_entries * sizeof (struct io_uring_cqe);
+
+  /* newer kernels map both rings in one go */
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (file->cq_len > file->sq_len)
+        file->sq_len = file->cq_len;
+      file->cq_len = file->sq_len;
+    }
+
+  file->sq_ptr = mmap (NULL, file->sq_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, file->ring,
+                       IORING_OFF_SQ_RING);
+  if (file->sq_ptr == MAP_FAILED)
+    {
+      file->sq_ptr = NULL;
+      return -1;
+    }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    file->cq_ptr = file->sq_ptr;
+  else
+    {
+      file->cq_ptr = mmap (NULL, file->cq_len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, file->ring,
+                           IORING_OFF_CQ_RING);
+      if (file->cq_ptr == MAP_FAILED)
+        {
+          file->cq_ptr = NULL;
+          return -1;
+        }
+    }
+
+  file->sqes_len = params.sq_entries * sizeof (struct io_uring_sqe);
+  file->sqes = mmap (NULL, file->sqes_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, file->ring, IORING_OFF_SQES);
+  if (file->sqes == MAP_FAILED)
+    {
+      file->sqes = NULL;
+      return -1;
+    }
+
+  sq = file->sq_ptr;
+  cq = file->cq_ptr;
+
+  file->sq_head = (unsigned *) (void *) (sq + params.sq_off.head);
+  file->sq_tail = (unsigned *) (void *) (sq + params.sq_off.tail);
+  file->sq_mask = (unsigned *) (void *) (sq + params.sq_off.ring_mask);
+  file->sq_array = (unsigned *) (void *) (sq + params.sq_off.array);
+  file->cq_head = (unsigned *) (void *) (cq + params.cq_off.head);
+  file->cq_tail = (unsigned *) (void *) (cq + params.cq_off.tail);
+  file->cq_mask = (unsigned *) (void *) (cq + params.cq_off.ring_mask);
+  file->cqes = (struct io_uring_cqe *) (void *) (cq + params.cq_off.cqes);
+
+  return 0;
+}
+
+static void
+uring_teardown (uring_file_t *file)
+{
+  if (file->sqes != NULL)
+    munmap (file->sqes, file->sqes_len);
+
+  if (file->cq_ptr != NULL && file->cq_ptr != file->sq_ptr)
+    munmap (file->cq_ptr, file->cq_len);
+
+  if (file->sq_ptr != NULL)
+    munmap (file->sq_ptr, file->sq_len);
+
+  if (file->ring > -1)
+    close (file->ring);
+}
+
+file_t *
+file_open_uring (const char *name, file_oflags_t flags)
+{
+  int _flags = 0;
+  uring_file_t *file = malloc (sizeof (uring_file_t));
+
+  if (file == NULL)
+    {
+      errno = -ENOMEM;
+      return NULL;
+    }
+
+  memset (file, 0, sizeof (uring_file_t));
+
+  file->base.get_type = uring_file_get_type;
+  file->base.get_size = uring_file_get_size;
+  file->base.seek = uring_file_seek;
+  file->base.read = uring_file_read;
+  file->base.write = uring_file_write;
+  file->base.pread = uring_file_pread;
+  file->base.pwrite = uring_file_pwrite;
+  file->base.submit = uring_file_submit;
+  file->base.next_data = uring_file_next_data;
+  file->base.close = uring_file_close;
+
+  if (flags & FILE_ORDONLY)
+    _flags |= O_RDONLY;
+
+  if (flags & FILE_OWRONLY)
+    _flags |= O_WRONLY;
+
+  if (flags & FILE_ORDWR)
+    _flags |= O_RDWR;
+
+  if (flags & FILE_OCREAT)
+    _flags |= O_CREAT;
+
+  if (flags & FILE_OTRUNC)
+    _flags |= O_TRUNC;
+
+  file->oflags = flags;
+  file->ring = -1;
+  file->fd = open (name, _flags, 0666);
+
+  if (file->fd == -1)
+    goto cleanup;
+
+  /* kernels without io_uring (or with it disabled) fail here */
+  if (uring_setup (file) == -1)
+    goto cleanup;
+
+  if (pthread_mutex_init (&file->lock, NULL))
+    goto cleanup;
+
+  return &file->base;
+
+cleanup:
+  uring_teardown (file);
+
+  if (file->fd > -1)
+    close (file->fd);
+
+  free (file);
+  return NULL;
+}
+
+static int
+uring_file_get_type (file_t *file, file_type_t *type)
+{
+  URING_FILE (file);
+  struct stat buf;
+
+  if (fstat (uring_file->fd, &buf) == -1)
+    return -1;
+
+  *type = S_ISREG (buf.st_mode) ? FILE_TYPE_FILE
+          : S_ISBLK (buf.st_mode) ? FILE_TYPE_BLOCK
+                                  : FILE_TYPE_UNKN;
+  return 0;
+}
+
+static int
+uring_file_get_size (file_t *file, size_t *size)
+{
+  URING_FILE (file);
+  struct stat buf;
+
+  if (fstat (uring_file->fd, &buf) == -1)
+    return -1;
+
+  *size = buf.st_size;
+  return 0;
+}
+
+static int
+uring_file_seek (file_t *file, size_t off, file_seek_t origin)
+{
+  URING_FILE (file);
+  size_t size;
+
+  switch (origin)
+    {
+    case FILE_SEEK_START:
+      uring_file->off = off;
+      break;
+    case FILE_SEEK_CUR:
+      uring_file->off += off;
+      break;
+    case FILE_SEEK_END:
+      if (uring_file_get_size (file, &size) == -1)
+        return -1;
+      uring_file->off = size + off;
+      break;
+    default:
+      errno = -EINVAL;
+      return -1;
+    }
+
+  return 0;
+}
+
+static ssize_t
+uring_file_read (file_t *file, void *buf, size_t nbytes)
+{
+  URING_FILE (file);
+  ssize_t read = uring_file_pread (file, buf, nbytes, uring_file->off);
+
+  if (read > 0)
+    uring_file->off += read;
+
+  return read;
+}
+
+static ssize_t
+uring_file_write (file_t *file, const void *buf, size_t nbytes)
+{
+  URING_FILE (file);
+  ssize_t written = uring_file_pwrite (file, buf, nbytes, uring_file->off);
+
+  if (written > 0)
+    uring_file->off += written;
+
+  return written;
+}
+
+/*
+ * A single request may come back short, so one too big for the ring is cut
+ * down to what fits instead of being refused. res stays -1 if submit turns
+ * the request away without running it.
+ */
+static ssize_t
+uring_file_pread (file_t *file, void *buf, size_t nbytes, size_t off)
+{
+  file_io_t io = { FILE_IO_READ, buf, nbytes, off, -1 };
+
+  if (io.nbytes > UINT32_MAX)
+    io.nbytes = UINT32_MAX;
+
+  uring_file_submit (file, &io, 1);
+  return io.res;
+}
+
+static ssize_t
+uring_file_pwrite (file_t *file, const void *buf, size_t nbytes, size_t off)
+{
+  /* the buffer is only read from, the request type just can't say so */
+  file_io_t io = { FILE_IO_WRITE, (void *) (uintptr_t) buf, nbytes, off, -1 };
+
+  if (io.nbytes > UINT32_MAX)
+    io.nbytes = UINT32_MAX;
+
+  uring_file_submit (file, &io, 1);
+  return io.res;
+}
+
+static void
+uring_queue (uring_file_t *file, file_io_t *io, size_t idx)
+{
+  unsigned tail = *file->sq_tail;
+  unsigned slot = tail & *file->sq_mask;
+  struct io_uring_sqe *sqe = file->sqes + slot;
+
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->opcode = io->op == FILE_IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+  sqe->fd = file->fd;
+  sqe->addr = (uintptr_t) io->buf;
+  sqe->len = io->nbytes;
+  sqe->off = io->off;
+  sqe->user_data = idx;
+
+  file->sq_array[slot] = slot;
+
+  /* the kernel must see the entry before the new tail */
+  __atomic_store_n (file->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Takes back the entries the kernel hasn't consumed yet, the last ones
+ * queued, and fails them. Returns how many there were.
+ */
+static unsigned
+uring_retract (uring_file_t *file, file_io_t *ios, size_t queued)
+{
+  unsigned head = __atomic_load_n (file->sq_head, __ATOMIC_ACQUIRE);
+  unsigned n = *file->sq_tail - head;
+
+  for (size_t i = queued - n; i < queued; i++)
+    ios[i].res = -1;
+
+  __atomic_store_n (file->sq_tail, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+static int
+uring_file_submit (file_t *file, file_io_t *ios, size_t nios)
+{
+  URING_FILE (file);
+  size_t queued = 0;
+  unsigned inflight = 0, pending = 0;
+  int ret = 0, err = 0;
+
+  for (size_t i = 0; i < nios; i++)
+    if (ios[i].nbytes > UINT32_MAX)
+      {
+        errno = -EINVAL;
+        return -1;
+      }
+
+  pthread_mutex_lock (&uring_file->lock);
+
+  /*
+   * After an error nothing new is queued, but whatever is in flight is
+   * still reaped: it writes into the caller's buffers, and its completions
+   * would otherwise be taken for the next batch's.
+   */
+  while ((!err && queued < nios) || inflight)
+    {
+      unsigned head, tail;
+      long entered;
+
+      for (; !err && queued < nios && inflight < uring_file->entries;
+           queued++)
+        {
+          uring_queue (uring_file, ios + queued, queued);
+          inflight++;
+          pending++;
+        }
+
+      entered = syscall (__NR_io_uring_enter, uring_file->ring, pending, 1,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+      if (entered == -1)
+        {
+          unsigned retracted;
+
+          if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            continue;
+
+          /* waiting itself fails, the ring is gone and nothing comes back */
+          if (err)
+            break;
+
+          err = errno;
+          ret = -1;
+
+          retracted = uring_retract (uring_file, ios, queued);
+          inflight -= retracted;
+          pending = 0;
+          continue;
+        }
+
+      pending -= entered;
+
+      head = *uring_file->cq_head;
+      tail = __atomic_load_n (uring_file->cq_tail, __ATOMIC_ACQUIRE);
+
+      /* completions come in any order, user_data says whose they are */
+      for (; head != tail; head++, inflight--)
+        {
+          struct io_uring_cqe *cqe
+              = uring_file->cqes + (head & *uring_file->cq_mask);
+          file_io_t *io = ios + cqe->user_data;
+
+          io->res = cqe->res < 0 ? -1 : cqe->res;
+          if (io->res != (ssize_t) io->nbytes)
+            ret = -1;
+
+          /* already negative, says why the request failed */
+          if (cqe->res < 0)
+            errno = cqe->res;
+        }
+
+      __atomic_store_n (uring_file->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+  /* never queued */
+  for (size_t i = queued; i < nios; i++)
+    ios[i].res = -1;
+
+  pthread_mutex_unlock (&uring_file->lock);
+
+  if (err)
+    errno = -err;
+
+  return ret;
+}
+
+/* nothing else here uses the descriptor's offset */
+static int
+uring_file_next_data (file_t *file, size_t off, size_t *data, size_t *hole)
+{
+  URING_FILE (file);
+  return file_fd_next_data (uring_file->fd, off, data, hole);
+}
+
+static void
+uring_file_close (file_t *file)
+{
+  URING_FILE (file);
+
+  uring_teardown (uring_file);
+  pthread_mutex_destroy (&uring_file->lock);
+
+  if (uring_file->fd > -1)
+    close (uring_file->fd);
+
+  free (uring_file);
+}
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +9,7 @@
 #include "ext2.h"
 #include "file.h"
 #include "fs.h"
+#include "stats.h"
 
 #define USE_ESCAPE_SEQUENCES
 
@@ -32,20 +34,30 @@ static int nfiles = 0;
 static file_t **files = NULL;
 static fs_t *fs = NULL;
 static char *error_msg = NULL;
+static stats_t img_stats;
+static ext2_arena_t names; /* subdirectory names, released per directory */
 
 typedef struct
 {
   const char *img;
   int nfiles;
   const char **files;
+  int recursive;
+  int uring; /* drive the image through io_uring where the kernel can */
+  int stats; /* report image I/O on stderr when done */
+  stats_format_t stats_format;
 } ls_params_t;
 
+/* a subdirectory waiting to be listed */
+typedef struct
+{
+  uint32_t ino;
+  char *name;
+} ls_subdir_t;
+
 static void
 cleanup (void)
 {
-  if (img_file != NULL)
-    file_close (img_file);
-
   if (nfiles && files != NULL)
     for (int i = 0; i < nfiles; i++)
       {
@@ -55,9 +67,15 @@ cleanup (void)
         file_close (files[i]);
       }
 
+  /* the filesystem still needs the image while it shuts down */
   if (fs != NULL)
     ext2_fs_fini (fs);
 
+  if (img_file != NULL)
+    file_close (img_file);
+
+  ext2_arena_fini (&names);
+
   if (error_msg != NULL)
     free (error_msg);
 }
@@ -101,18 +119,177 @@ perror:
 static void
 usage (void)
 {
-  printf ("Usage: %s [OPTION]... IMAGE FILE...\n", cp_cmd_name);
+  printf ("Usage: %s [OPTION]... IMAGE [FILE]...\n", cp_cmd_name);
+  printf ("\n");
+  printf ("  -R              list subdirectories recursively\n");
+  printf ("  --uring         use io_uring for the image, if the kernel has "
+          "it\n");
+  printf ("  --stats[=json]  report image I/O on stderr when done\n");
+  printf ("  -h              display this help and exit\n");
+}
+
+static int
+ls_subdir_cmp (const void *a, const void *b)
+{
+  const ls_subdir_t *x = a, *y = b;
+
+  return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static void
+ls_dir (file_t *file, const char *path, int recursive)
+{
+  ext2_fs_t *ext2 = fs->data;
+  ext2_arena_mark_t mark = ext2_arena_mark (&names);
+  ls_subdir_t *subdirs = NULL;
+  size_t nsubdirs = 0, cap = 0;
+  uint32_t *inos;
+  dentry_t *ent;
+  dir_t *dir;
+
+  dir = file_open_dir (file);
+  if (dir == NULL)
+    fail ("failed to open directory '%s'", path);
+
+  while ((ent = dir_readdir (dir)) != NULL)
+    {
+      printf ("%s\n", ent->name);
+
+      if (!recursive || ent->type != FILE_TYPE_DIR || !strcmp (ent->name, ".")
+          || !strcmp (ent->name, ".."))
+        continue;
+
+      if (nsubdirs == cap)
+        {
+          cap = cap ? cap * 2 : 16;
+          subdirs = realloc (subdirs, sizeof (ls_subdir_t) * cap);
+          if (subdirs == NULL)
+            fail ("out of memory");
+        }
+
+      subdirs[nsubdirs].ino = ent->ino;
+      subdirs[nsubdirs].name = ext2_arena_strdup (&names, ent->name);
+      if (subdirs[nsubdirs++].name == NULL)
+        fail ("out of memory");
+    }
+
+  dir_closedir (dir);
+
+  if (!nsubdirs)
+    return;
+
+  /*
+   * Inode numbers run through the groups and their inode tables in order,
+   * so visiting subdirectories by number reads the tables front to back
+   * instead of jumping around in directory order.
+   */
+  qsort (subdirs, nsubdirs, sizeof (ls_subdir_t), ls_subdir_cmp);
+
+  inos = malloc (sizeof (uint32_t) * nsubdirs);
+  if (inos == NULL)
+    fail ("out of memory");
+
+  for (size_t i = 0; i < nsubdirs; i++)
+    inos[i] = subdirs[i].ino;
+
+  ext2_inode_prefetch (ext2, inos, nsubdirs);
+  free (inos);
+
+  for (size_t i = 0; i < nsubdirs; i++)
+    {
+      const char *sep = path[strlen (path) - 1] == '/' ? "" : "/";
+      file_t *child;
+      char *child_path;
+
+      if (asprintf (&child_path, "%s%s%s", path, sep, subdirs[i].name) == -1)
+        fail ("out of memory");
+
+      child = ext2_file_open (ext2, subdirs[i].ino);
+      if (child == NULL)
+        fail ("failed to open '%s'", child_path);
+
+      printf ("\n%s:\n", child_path);
+      ls_dir (child, child_path, 1);
+
+      file_close (child);
+      free (child_path);
+    }
+
+  free (subdirs);
+  ext2_arena_release (&names, mark);
+}
+
+static void
+ls_file (int idx, const char *path, int recursive)
+{
+  ext2_fs_t *ext2 = fs->data;
+  file_type_t type;
+  uint32_t ino;
+
+  if (ext2_namei (ext2, path, &ino) == -1)
+    {
+      if (errno == -ENOENT)
+        fail ("cannot access '%s': no such file or directory", path);
+      fail ("cannot access '%s'", path);
+    }
+
+  files[idx] = ext2_file_open (ext2, ino);
+  if (files[idx] == NULL)
+    fail ("failed to open '%s'", path);
+
+  if (file_get_type (files[idx], &type) == -1)
+    fail ("failed to read type of '%s'", path);
+
+  if (type != FILE_TYPE_DIR)
+    {
+      printf ("%s\n", path);
+      return;
+    }
+
+  if (nfiles > 1 || recursive)
+    printf ("%s%s:\n", idx ? "\n" : "", path);
+
+  ls_dir (files[idx], path, recursive);
 }
 
 static void
 ls_op (ls_params_t *params)
 {
   fs_init_error_t error;
-
-  img_file = file_open (params->img, FILE_ORDWR);
+  file_t *sparse_file;
+
+  /*
+   * Prefer the mapped backend, plain reads are the fallback. io_uring
+   * goes first when asked for, kernels without it fall through.
+   */
+  img_file = NULL;
+  if (params->uring)
+    img_file = file_open_uring (params->img, FILE_ORDONLY);
+  if (img_file == NULL)
+    img_file = file_open_mmap (params->img, FILE_ORDONLY);
+  if (img_file == NULL)
+    img_file = file_open (params->img, FILE_ORDONLY);
   if (img_file == NULL)
     fail ("failed to open image file: '%s'", params->img);
 
+  if (params->stats)
+    {
+      file_t *stats_file = file_open_stats (img_file, &img_stats);
+
+      if (stats_file == NULL)
+        fail ("out of memory");
+
+      img_file = stats_file;
+    }
+
+  /* compact sparse images are expanded on the fly */
+  sparse_file = file_open_maybe_sparse (img_file);
+  if (sparse_file == NULL)
+    fail (errno == -EBADMSG ? "invalid sparse image: '%s'"
+                            : "failed to read image file: '%s'",
+          params->img);
+  img_file = sparse_file;
+
   nfiles = params->nfiles;
   files = malloc (sizeof (file_t *) * nfiles);
   if (files == NULL)
@@ -128,6 +305,22 @@ ls_op (ls_params_t *params)
       fail ("%s", error.const_error);
     }
 
+  for (int i = 0; i < nfiles; i++)
+    {
+      if (params->files[i][0] != '/')
+        fail ("path must be absolute: '%s'", params->files[i]);
+
+      ls_file (i, params->files[i], params->recursive);
+    }
+
+  if (params->stats)
+    {
+      const char *name = "image";
+      const stats_t *stats = &img_stats;
+
+      stats_report (stderr, &name, &stats, 1, params->stats_format);
+    }
+
   cleanup ();
 }
 
@@ -141,6 +334,29 @@ main (int argc, const char **argv)
     {
       const char *arg = argv[argn];
 
+      if (!strcmp (arg, "--stats") || !strcmp (arg, "--stats=text"))
+        {
+          params.stats = 1;
+          params.stats_format = STATS_FORMAT_TEXT;
+          continue;
+        }
+
+      if (!strcmp (arg, "--uring"))
+        {
+          params.uring = 1;
+          continue;
+        }
+
+      if (!strcmp (arg, "--stats=json"))
+        {
+          params.stats = 1;
+          params.stats_format = STATS_FORMAT_JSON;
+          continue;
+        }
+
+      if (arg[0] == '-' && arg[1] == '-')
+        fail ("invalid option '%s'", arg);
+
       if (arg[0] == '-')
         {
           arg++;
@@ -151,11 +367,15 @@ main (int argc, const char **argv)
                 case 'h':
                   usage ();
                   exit (0);
+                case 'R':
+                  params.recursive = 1;
+                  break;
                 default:
-                  fail ("invalid option '%c'", arg[1]);
+                  fail ("invalid option '%c'", arg[0]);
                 }
               arg++;
             }
+          continue;
         }
 
       if (params.img == NULL)
@@ -167,13 +387,9 @@ main (int argc, const char **argv)
   if (params.img == NULL)
     fail ("missing image operand");
 
-  params.img = NULL;
-
+  /* with no FILE operands, list the root directory */
   if (!_nfiles)
-    fail ("missing source operand");
-
-  if (!--_nfiles)
-    fail ("missing destination operand");
+    _nfiles = 1;
 
   params.files = malloc (sizeof (const char *) * _nfiles);
   if (params.files == NULL)
@@ -192,10 +408,15 @@ main (int argc, const char **argv)
         params.files[params.nfiles++] = argv[i];
     }
 
+  if (!params.nfiles)
+    params.files[params.nfiles++] = "/";
+
   assert (params.img);
   assert (params.nfiles && params.files);
 
   ls_op (&params);
 
+  free (params.files);
+
   return 0;
 }
\ No newline at end of file
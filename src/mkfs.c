@@ -0,0 +1,631 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+
+#include "ext2.h"
+#include "file.h"
+
+#define USE_ESCAPE_SEQUENCES
+
+#ifdef USE_ESCAPE_SEQUENCES
+
+#define ESC_RESET "\033[0m"
+#define ESC_BOLD  "\033[1m"
+#define ESC_RED   "\033[31m"
+
+#else
+
+#define ESC_RESET
+#define ESC_BOLD
+#define ESC_RED
+
+#endif
+
+#define ALIGN_UP(X, ALIGN) (((X) + ((ALIGN) - 1)) / (ALIGN) * (ALIGN))
+
+#define MKFS_DEFAULT_BLOCK_SIZE 4096
+#define MKFS_DEFAULT_INODE_RATIO 16384 /* bytes per inode */
+#define MKFS_RDO_FLAGS                                                        \
+  (EXT2_RDO_FLAG_SPARSE_SB | EXT2_RDO_FLAG_64_BIT_FILE_SIZE)
+#define MKFS_RESERVED_PERCENT 5
+
+#define MKFS_INODE_SIZE 128
+#define MKFS_FIRST_INO 11 /* everything below is reserved */
+#define MKFS_LPF_INO 11
+
+/* lost+found is made big up front so that fsck never has to grow it */
+#define MKFS_LPF_SIZE 16384
+
+/* a last group with less room than this after its metadata is cut off */
+#define MKFS_MIN_GROUP_DATA 50
+
+/* rwxr-xr-x and rwx------ */
+#define MKFS_ROOT_MODE 0755
+#define MKFS_LPF_MODE  0700
+
+static const char *mkfs_cmd_name = "ext2mkfs";
+
+typedef struct
+{
+  const char *img;
+  uint64_t size;
+  size_t block_size;
+  size_t inode_ratio;
+  const char *label;
+} mkfs_params_t;
+
+/* where everything goes, worked out before anything is written */
+typedef struct
+{
+  size_t bs;
+  size_t first_block;
+  size_t block_cnt;
+  size_t ngroups;
+  size_t bpg;
+  size_t ipg;
+  size_t itb;        /* inode table blocks per group */
+  size_t itb_used;   /* the ones holding the reserved inodes */
+  size_t gdt_blocks;
+  size_t nlpf;       /* lost+found blocks */
+  size_t nsupers;    /* groups with a superblock copy */
+} mkfs_layout_t;
+
+/*
+ * Blocks that are written out, one block each unless noted. Full groups
+ * with or without a superblock copy all share one bitmap each, only the
+ * first and last group need their own.
+ */
+enum
+{
+  MKFS_BB_FIRST,
+  MKFS_BB_LAST,
+  MKFS_BB_SUPER,
+  MKFS_BB_PLAIN,
+  MKFS_IB_FIRST,
+  MKFS_IB_REST,
+  MKFS_ROOT,
+  MKFS_BUFS /* followed by the inode table head, lost+found and the BGDT */
+};
+
+static file_t *img_file = NULL;
+static ext2_sb_t *sb = NULL;
+static unsigned char *sbs = NULL;
+static unsigned char *bufs = NULL;
+static file_io_t *ios = NULL;
+
+static void
+cleanup (void)
+{
+  if (img_file != NULL)
+    file_close (img_file);
+
+  if (sb != NULL)
+    free (sb);
+
+  if (sbs != NULL)
+    free (sbs);
+
+  if (bufs != NULL)
+    free (bufs);
+
+  if (ios != NULL)
+    free (ios);
+}
+
+static void
+fail (const char *fmt, ...)
+{
+  const char *internal_err = "formatting error";
+  char *msg = NULL;
+  int tmp, _errno;
+  va_list args;
+
+  va_start (args, fmt);
+  tmp = vasprintf (&msg, fmt, args);
+  _errno = errno;
+
+  cleanup ();
+
+  if (tmp == -1)
+    goto perror;
+
+  fprintf (stderr, ESC_BOLD "%s: " ESC_RED "error: " ESC_RESET "%s\n",
+           mkfs_cmd_name, msg);
+
+  va_end (args);
+  exit (1);
+
+perror:
+  if (msg != NULL)
+    free (msg);
+
+  if (_errno == -ENOMEM)
+    internal_err = "out of memory";
+
+  fprintf (stderr, ESC_BOLD "%s: " ESC_RED "error:" ESC_RESET "%s\n",
+           mkfs_cmd_name, internal_err);
+
+  exit (2);
+}
+
+static void
+usage (void)
+{
+  printf ("Usage: %s [OPTION]... IMAGE SIZE\n", mkfs_cmd_name);
+  printf ("\n");
+  printf ("SIZE is in bytes, or with a K, M, G or T suffix.\n");
+  printf ("\n");
+  printf ("  -b N      block size, 1024, 2048 or 4096 (default %d)\n",
+          MKFS_DEFAULT_BLOCK_SIZE);
+  printf ("  -i N      bytes per inode (default %d)\n",
+          MKFS_DEFAULT_INODE_RATIO);
+  printf ("  -L LABEL  volume label\n");
+  printf ("  -h        display this help and exit\n");
+}
+
+static int
+mkfs_parse_size (const char *arg, uint64_t *size)
+{
+  char *end;
+  int shift = 0;
+
+  *size = strtoull (arg, &end, 10);
+  if (end == arg)
+    return -1;
+
+  switch (*end)
+    {
+    case 'T':
+    case 't':
+      shift += 10;
+      /* fall through */
+    case 'G':
+    case 'g':
+      shift += 10;
+      /* fall through */
+    case 'M':
+    case 'm':
+      shift += 10;
+      /* fall through */
+    case 'K':
+    case 'k':
+      shift += 10;
+      end++;
+      break;
+    default:
+      break;
+    }
+
+  if (*end != '\0' || *size > UINT64_MAX >> shift)
+    return -1;
+
+  *size <<= shift;
+  return 0;
+}
+
+static int
+mkfs_has_super (size_t group)
+{
+  return ext2_group_has_super (MKFS_RDO_FLAGS, group);
+}
+
+static size_t
+mkfs_group_start (const mkfs_layout_t *l, size_t group)
+{
+  return l->first_block + group * l->bpg;
+}
+
+static size_t
+mkfs_group_nblocks (const mkfs_layout_t *l, size_t group)
+{
+  size_t n = l->block_cnt - mkfs_group_start (l, group);
+  return n < l->bpg ? n : l->bpg;
+}
+
+/* superblock and BGDT copies, both bitmaps and the inode table */
+static size_t
+mkfs_group_overhead (const mkfs_layout_t *l, size_t group)
+{
+  return (mkfs_has_super (group) ? 1 + l->gdt_blocks : 0) + 2 + l->itb;
+}
+
+static void
+mkfs_layout (const mkfs_params_t *params, mkfs_layout_t *l)
+{
+  uint64_t nblocks = params->size / params->block_size;
+  size_t per_block = params->block_size / MKFS_INODE_SIZE;
+
+  memset (l, 0, sizeof (mkfs_layout_t));
+  l->bs = params->block_size;
+  l->first_block = l->bs == 1024;
+  l->bpg = l->bs * 8;
+  l->nlpf = MKFS_LPF_SIZE / l->bs;
+  if (l->nlpf > EXT2_NDIR_BLOCKS)
+    l->nlpf = EXT2_NDIR_BLOCKS; /* direct blocks only */
+  l->itb_used = ALIGN_UP (MKFS_FIRST_INO * MKFS_INODE_SIZE, l->bs) / l->bs;
+
+  if (nblocks > UINT32_MAX)
+    fail ("image too large for %zu byte blocks", l->bs);
+
+  l->block_cnt = nblocks;
+
+  /* drop a last group that would be all metadata, then redo the sums */
+  for (;;)
+    {
+      size_t last;
+
+      if (l->block_cnt <= l->first_block)
+        fail ("image too small");
+
+      l->ngroups = ALIGN_UP (l->block_cnt - l->first_block, l->bpg) / l->bpg;
+      l->gdt_blocks
+          = ALIGN_UP (l->ngroups * sizeof (ext2_bgdt_t), l->bs) / l->bs;
+
+      l->ipg = (uint64_t) l->block_cnt * l->bs / params->inode_ratio
+               / l->ngroups;
+      if (l->ipg < MKFS_FIRST_INO + 1)
+        l->ipg = MKFS_FIRST_INO + 1;
+
+      /* whole inode table blocks, no more than one bitmap or a 32 bit
+         inode count can track */
+      l->ipg = ALIGN_UP (l->ipg, per_block);
+      if (l->ipg > l->bs * 8)
+        l->ipg = l->bs * 8;
+      if ((uint64_t) l->ipg * l->ngroups > UINT32_MAX)
+        l->ipg = UINT32_MAX / l->ngroups / per_block * per_block;
+
+      l->itb = l->ipg / per_block;
+
+      last = mkfs_group_nblocks (l, l->ngroups - 1);
+      if (l->ngroups == 1
+          || last >= mkfs_group_overhead (l, l->ngroups - 1)
+                         + MKFS_MIN_GROUP_DATA)
+        break;
+
+      l->block_cnt -= last;
+    }
+
+  if (mkfs_group_overhead (l, 0) + 1 + l->nlpf > mkfs_group_nblocks (l, 0))
+    fail ("image too small");
+
+  for (size_t g = 0; g < l->ngroups; g++)
+    l->nsupers += mkfs_has_super (g);
+}
+
+/* marks the first used bits and everything past the group's end in use */
+static void
+mkfs_bitmap (unsigned char *bitmap, size_t bs, size_t used, size_t nbits)
+{
+  memset (bitmap, 0, bs);
+
+  for (size_t i = 0; i < used; i++)
+    bitmap[i / 8] |= 1 << (i % 8);
+
+  for (size_t i = nbits; i < bs * 8; i++)
+    bitmap[i / 8] |= 1 << (i % 8);
+}
+
+static size_t
+mkfs_dirent (unsigned char *block, size_t off, uint32_t ino, size_t rec_len,
+             const char *name, uint8_t ft)
+{
+  ext2_dirent_t *ent = (ext2_dirent_t *) (void *) (block + off);
+
+  ent->inode = ino;
+  ent->rec_len = rec_len;
+  ent->name_len = strlen (name);
+  ent->file_type = ft;
+  memcpy (ent->name, name, ent->name_len);
+
+  return off + rec_len;
+}
+
+static void
+mkfs_dir_inode (ext2_inode_t *inode, uint16_t mode, uint16_t links,
+                uint32_t first, size_t nblocks, size_t bs, uint32_t now)
+{
+  inode->mode = EXT2_INODE_TYPE_DIR | mode;
+  inode->nbytes_lo = nblocks * bs;
+  inode->last_access_time = now;
+  inode->creation_time = now;
+  inode->last_mod_time = now;
+  inode->num_hard_links = links;
+  inode->num_sectors = nblocks * (bs / 512);
+
+  for (size_t i = 0; i < nblocks; i++)
+    inode->block[i] = first + i;
+}
+
+static void
+mkfs_io (size_t *nios, void *buf, size_t nbytes, size_t off)
+{
+  ios[*nios].op = FILE_IO_WRITE;
+  ios[*nios].buf = buf;
+  ios[*nios].nbytes = nbytes;
+  ios[*nios].off = off;
+  (*nios)++;
+}
+
+static void
+mkfs_sb (const mkfs_params_t *params, const mkfs_layout_t *l, uint32_t now)
+{
+  sb = calloc (1, 1024);
+  if (sb == NULL)
+    fail ("out of memory");
+
+  sb->inode_cnt = l->ipg * l->ngroups;
+  sb->block_cnt = l->block_cnt;
+  sb->su_block_cnt = (uint64_t) l->block_cnt * MKFS_RESERVED_PERCENT / 100;
+  sb->first_block = l->first_block;
+  sb->log2_block_size = __builtin_ctzl (l->bs) - 10;
+  sb->log2_frag_size = sb->log2_block_size;
+  sb->blocks_per_group = l->bpg;
+  sb->frags_per_group = l->bpg;
+  sb->inodes_per_group = l->ipg;
+  sb->prev_mod_time = now;
+  sb->max_mnt_cnt = UINT16_MAX;
+  sb->magic = EXT2_MAGIC;
+  sb->state = EXT2_FS_STATE_VALID;
+  sb->err_res = EXT2_ERR_CONT;
+  sb->prev_fsck_time = now;
+  sb->major_ver = 1;
+  sb->first_inode = MKFS_FIRST_INO;
+  sb->inode_size = MKFS_INODE_SIZE;
+  sb->opt_flags = EXT2_OPT_FLAG_DIRS_USE_HASH_IDX;
+  sb->req_flags = EXT2_REQ_FLAG_DIR_ENTS_HAVE_TYPE;
+  sb->rdo_flags = MKFS_RDO_FLAGS;
+  sb->def_hash_ver = EXT2_HASH_HALF_MD4;
+  sb->mkfs_time = now;
+
+  /* the kernel hashes names with this machine's char signedness */
+  sb->flags = (char) -1 < 0 ? EXT2_SB_FLAG_SIGNED_HASH
+                            : EXT2_SB_FLAG_UNSIGNED_HASH;
+
+  if (getrandom (sb->uuid, sizeof (sb->uuid), 0) != sizeof (sb->uuid)
+      || getrandom (sb->hash_seed, sizeof (sb->hash_seed), 0)
+             != sizeof (sb->hash_seed))
+    fail ("failed to generate UUID");
+
+  /* random, version 4 */
+  sb->uuid[6] = (sb->uuid[6] & 0x0f) | 0x40;
+  sb->uuid[8] = (sb->uuid[8] & 0x3f) | 0x80;
+
+  if (params->label != NULL)
+    memcpy (sb->volume_name, params->label, strlen (params->label));
+}
+
+/*
+ * Lays out the filesystem and writes only what can't be left as zeros: the
+ * superblock and BGDT copies, the bitmaps, the reserved inodes and the root
+ * and lost+found directories. The image is created sparse with set_size,
+ * so the inode tables read back as zeros, i.e. all free, without being
+ * written. A regular file is required for that.
+ */
+static void
+mkfs_op (const mkfs_params_t *params)
+{
+  mkfs_layout_t l;
+  ext2_bgdt_t *bgdt;
+  ext2_inode_t *inode;
+  unsigned char *itable, *lpf, *root;
+  uint32_t now = time (NULL);
+  size_t nios = 0, nsb = 0, data, lpf_blk, free_blks = 0, off;
+  file_type_t type;
+
+  mkfs_layout (params, &l);
+  mkfs_sb (params, &l, now);
+
+  bufs = calloc (MKFS_BUFS + l.itb_used + l.nlpf + l.gdt_blocks, l.bs);
+  sbs = malloc (l.nsupers * 1024);
+  ios = malloc ((2 * l.ngroups + 2 * l.nsupers + 3) * sizeof (file_io_t));
+  if (bufs == NULL || sbs == NULL || ios == NULL)
+    fail ("out of memory");
+
+  root = bufs + MKFS_ROOT * l.bs;
+  itable = bufs + MKFS_BUFS * l.bs;
+  lpf = itable + l.itb_used * l.bs;
+  bgdt = (ext2_bgdt_t *) (void *) (lpf + l.nlpf * l.bs);
+
+  /* root and lost+found right behind group 0's inode table */
+  data = l.first_block + mkfs_group_overhead (&l, 0);
+  lpf_blk = data + 1;
+
+  for (size_t g = 0; g < l.ngroups; g++)
+    {
+      size_t meta = mkfs_group_start (&l, g)
+                    + (mkfs_has_super (g) ? 1 + l.gdt_blocks : 0);
+      size_t used = mkfs_group_overhead (&l, g) + (g ? 0 : 1 + l.nlpf);
+
+      bgdt[g].block_bitmap = meta;
+      bgdt[g].inode_bitmap = meta + 1;
+      bgdt[g].inode_table = meta + 2;
+      bgdt[g].num_free_blks = mkfs_group_nblocks (&l, g) - used;
+      bgdt[g].num_free_inodes = l.ipg - (g ? 0 : MKFS_FIRST_INO);
+      bgdt[g].num_dirs = g ? 0 : 2;
+      free_blks += bgdt[g].num_free_blks;
+    }
+
+  sb->free_block_cnt = free_blks;
+  sb->free_inode_cnt = sb->inode_cnt - MKFS_FIRST_INO;
+
+  mkfs_bitmap (bufs + MKFS_BB_FIRST * l.bs, l.bs,
+               mkfs_group_overhead (&l, 0) + 1 + l.nlpf,
+               mkfs_group_nblocks (&l, 0));
+  mkfs_bitmap (bufs + MKFS_BB_LAST * l.bs, l.bs,
+               mkfs_group_overhead (&l, l.ngroups - 1),
+               mkfs_group_nblocks (&l, l.ngroups - 1));
+  mkfs_bitmap (bufs + MKFS_BB_SUPER * l.bs, l.bs, 1 + l.gdt_blocks + 2 + l.itb,
+               l.bpg);
+  mkfs_bitmap (bufs + MKFS_BB_PLAIN * l.bs, l.bs, 2 + l.itb, l.bpg);
+  mkfs_bitmap (bufs + MKFS_IB_FIRST * l.bs, l.bs, MKFS_FIRST_INO, l.ipg);
+  mkfs_bitmap (bufs + MKFS_IB_REST * l.bs, l.bs, 0, l.ipg);
+
+  inode = (ext2_inode_t *) (void *) (itable
+                                     + (EXT2_ROOT_INODE - 1) * MKFS_INODE_SIZE);
+  mkfs_dir_inode (inode, MKFS_ROOT_MODE, 3, data, 1, l.bs, now);
+
+  inode = (ext2_inode_t *) (void *) (itable
+                                     + (MKFS_LPF_INO - 1) * MKFS_INODE_SIZE);
+  mkfs_dir_inode (inode, MKFS_LPF_MODE, 2, lpf_blk, l.nlpf, l.bs, now);
+
+  off = mkfs_dirent (root, 0, EXT2_ROOT_INODE, 12, ".", EXT2_FT_DIR);
+  off = mkfs_dirent (root, off, EXT2_ROOT_INODE, 12, "..", EXT2_FT_DIR);
+  mkfs_dirent (root, off, MKFS_LPF_INO, l.bs - off, "lost+found",
+               EXT2_FT_DIR);
+
+  off = mkfs_dirent (lpf, 0, MKFS_LPF_INO, 12, ".", EXT2_FT_DIR);
+  mkfs_dirent (lpf, off, EXT2_ROOT_INODE, l.bs - off, "..", EXT2_FT_DIR);
+
+  /* the rest of lost+found is empty, but must still parse */
+  for (size_t i = 1; i < l.nlpf; i++)
+    ((ext2_dirent_t *) (void *) (lpf + i * l.bs))->rec_len = l.bs;
+
+  /* in group order, so neighbours can be merged into one write */
+  for (size_t g = 0; g < l.ngroups; g++)
+    {
+      size_t start = mkfs_group_start (&l, g);
+      int bb = !g                    ? MKFS_BB_FIRST
+               : g == l.ngroups - 1  ? MKFS_BB_LAST
+               : mkfs_has_super (g) ? MKFS_BB_SUPER
+                                     : MKFS_BB_PLAIN;
+
+      if (mkfs_has_super (g))
+        {
+          ext2_sb_t *copy = (ext2_sb_t *) (void *) (sbs + nsb++ * 1024);
+
+          memcpy (copy, sb, 1024);
+          copy->sb_block = g;
+
+          mkfs_io (&nios, copy, 1024, g ? start * l.bs : 1024);
+          mkfs_io (&nios, bgdt, l.gdt_blocks * l.bs, (start + 1) * l.bs);
+        }
+
+      mkfs_io (&nios, bufs + bb * l.bs, l.bs, bgdt[g].block_bitmap * l.bs);
+
+      /* with no padding bits the other groups' inode bitmaps are zeros */
+      if (!g || l.ipg < l.bs * 8)
+        mkfs_io (&nios, bufs + (g ? MKFS_IB_REST : MKFS_IB_FIRST) * l.bs, l.bs,
+                 bgdt[g].inode_bitmap * l.bs);
+
+      if (!g)
+        {
+          mkfs_io (&nios, itable, l.itb_used * l.bs,
+                   bgdt[0].inode_table * l.bs);
+          mkfs_io (&nios, root, l.bs, data * l.bs);
+          mkfs_io (&nios, lpf, l.nlpf * l.bs, lpf_blk * l.bs);
+        }
+    }
+
+  img_file
+      = file_open (params->img, FILE_ORDWR | FILE_OCREAT | FILE_OTRUNC);
+  if (img_file == NULL)
+    fail ("failed to open image file: '%s'", params->img);
+
+  if (file_get_type (img_file, &type) == -1 || type != FILE_TYPE_FILE)
+    fail ("'%s' is not a regular file", params->img);
+
+  if (file_set_size (img_file, params->size) == -1)
+    fail ("failed to size image file: '%s'", params->img);
+
+  if (file_submit (img_file, ios, nios) == -1)
+    fail ("failed to write image file: '%s'", params->img);
+
+  cleanup ();
+}
+
+int
+main (int argc, const char **argv)
+{
+  mkfs_params_t params = { 0 };
+  const char *size = NULL;
+  uint64_t n;
+  char *end;
+
+  params.block_size = MKFS_DEFAULT_BLOCK_SIZE;
+  params.inode_ratio = MKFS_DEFAULT_INODE_RATIO;
+
+  for (int argn = 1; argn < argc; argn++)
+    {
+      const char *arg = argv[argn];
+
+      if (arg[0] == '-')
+        {
+          char opt = arg[1];
+
+          if (opt == 'h')
+            {
+              usage ();
+              exit (0);
+            }
+
+          if (opt != 'b' && opt != 'i' && opt != 'L')
+            fail ("invalid option '%c'", opt);
+
+          /* -bN or -b N */
+          if (arg[2] != '\0')
+            arg += 2;
+          else if (argn + 1 < argc)
+            arg = argv[++argn];
+          else
+            fail ("option '%c' requires an argument", opt);
+
+          if (opt == 'L')
+            {
+              if (strlen (arg) > sizeof (((ext2_sb_t *) NULL)->volume_name))
+                fail ("label too long: '%s'", arg);
+
+              params.label = arg;
+              continue;
+            }
+
+          n = strtoull (arg, &end, 10);
+          if (end == arg || *end != '\0')
+            fail ("invalid number: '%s'", arg);
+
+          if (opt == 'b')
+            {
+              if (n != 1024 && n != 2048 && n != 4096)
+                fail ("invalid block size: '%s'", arg);
+
+              params.block_size = n;
+            }
+          else
+            {
+              if (n < 1024 || n > (64 << 20))
+                fail ("invalid bytes per inode: '%s'", arg);
+
+              params.inode_ratio = n;
+            }
+
+          continue;
+        }
+
+      if (params.img == NULL)
+        params.img = arg;
+      else if (size == NULL)
+        size = arg;
+      else
+        fail ("extra operand '%s'", arg);
+    }
+
+  if (params.img == NULL)
+    fail ("missing image operand");
+
+  if (size == NULL)
+    fail ("missing size operand");
+
+  if (mkfs_parse_size (size, &params.size) == -1)
+    fail ("invalid size: '%s'", size);
+
+  assert (params.block_size && params.inode_ratio);
+
+  mkfs_op (&params);
+
+  return 0;
+}
@@ -4,7 +4,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "file.h"
@@ -12,6 +14,9 @@
 #define POSIX_FILE(file) posix_file_t *posix_file = (posix_file_t *) (file)
 #define POSIX_DIR(dir)   posix_dir_t *posix_dir = (posix_dir_t *) (dir)
 
+/* most requests merged into one preadv/pwritev */
+#define POSIX_SUBMIT_IOVS 64
+
 typedef struct
 {
   file_t base;
@@ -23,14 +28,25 @@ typedef struct
 {
   dir_t base;
   DIR *dir;
+  dentry_t ent; /* reused by every readdir */
 } posix_dir_t;
 
 static dir_t *posix_file_opendir (file_t *file);
 static int posix_file_get_type (file_t *file, file_type_t *type);
 static int posix_file_get_size (file_t *file, size_t *size);
+static int posix_file_set_size (file_t *file, size_t size);
 static int posix_file_seek (file_t *file, size_t off, file_seek_t origin);
 static ssize_t posix_file_read (file_t *file, void *buf, size_t nbytes);
 static ssize_t posix_file_write (file_t *file, const void *buf, size_t nbytes);
+static ssize_t posix_file_pread (file_t *file, void *buf, size_t nbytes,
+                                 size_t off);
+static ssize_t posix_file_pwrite (file_t *file, const void *buf,
+                                  size_t nbytes, size_t off);
+static ssize_t posix_file_copy_range (file_t *file, size_t off, file_t *dst,
+                                      size_t dst_off, size_t nbytes);
+static int posix_file_submit (file_t *file, file_io_t *ios, size_t nios);
+static int posix_file_next_data (file_t *file, size_t off, size_t *data,
+                                 size_t *hole);
 static void posix_file_close (file_t *file);
 
 static dentry_t *posix_dir_readdir (dir_t *dir);
@@ -54,9 +70,15 @@ file_open (const char *name, file_oflags_t flags)
   file->base.opendir = posix_file_opendir;
   file->base.get_type = posix_file_get_type;
   file->base.get_size = posix_file_get_size;
+  file->base.set_size = posix_file_set_size;
   file->base.seek = posix_file_seek;
   file->base.read = posix_file_read;
   file->base.write = posix_file_write;
+  file->base.pread = posix_file_pread;
+  file->base.pwrite = posix_file_pwrite;
+  file->base.copy_range = posix_file_copy_range;
+  file->base.submit = posix_file_submit;
+  file->base.next_data = posix_file_next_data;
   file->base.close = posix_file_close;
 
   if (flags & FILE_ORDONLY)
@@ -68,8 +90,14 @@ file_open (const char *name, file_oflags_t flags)
   if (flags & FILE_ORDWR)
     _flags |= O_RDWR;
 
+  if (flags & FILE_OCREAT)
+    _flags |= O_CREAT;
+
+  if (flags & FILE_OTRUNC)
+    _flags |= O_TRUNC;
+
   file->oflags = flags;
-  file->fd = open (name, _flags);
+  file->fd = open (name, _flags, 0666);
 
   if (file->fd == -1)
     {
@@ -177,6 +205,13 @@ posix_file_get_size (file_t *file, size_t *size)
   return 0;
 }
 
+static int
+posix_file_set_size (file_t *file, size_t size)
+{
+  POSIX_FILE (file);
+  return ftruncate (posix_file->fd, size);
+}
+
 static int
 posix_file_seek (file_t *file, size_t off, file_seek_t origin)
 {
@@ -216,6 +251,197 @@ posix_file_write (file_t *file, const void *buf, size_t nbytes)
   return write (posix_file->fd, buf, nbytes);
 }
 
+static ssize_t
+posix_file_pread (file_t *file, void *buf, size_t nbytes, size_t off)
+{
+  POSIX_FILE (file);
+  return pread (posix_file->fd, buf, nbytes, off);
+}
+
+static ssize_t
+posix_file_pwrite (file_t *file, const void *buf, size_t nbytes, size_t off)
+{
+  POSIX_FILE (file);
+  return pwrite (posix_file->fd, buf, nbytes, off);
+}
+
+/* copy_file_range refusing the pair of files rather than failing on them */
+static int
+posix_file_copy_refused (int err)
+{
+  return err == EXDEV || err == ENOSYS || err == EINVAL || err == EOPNOTSUPP;
+}
+
+static ssize_t
+posix_file_copy_range (file_t *file, size_t off, file_t *dst, size_t dst_off,
+                       size_t nbytes)
+{
+  POSIX_FILE (file);
+  posix_file_t *posix_dst = (posix_file_t *) dst;
+  loff_t in_off = off, out_off = dst_off;
+  off_t sendfile_off = off;
+  size_t left = nbytes;
+  ssize_t copied;
+
+  /* only another descriptor can be the target of a kernel copy */
+  if (dst->copy_range != posix_file_copy_range)
+    {
+      errno = -ENOSYS;
+      return -1;
+    }
+
+  while (left)
+    {
+      copied = copy_file_range (posix_file->fd, &in_off, posix_dst->fd,
+                                &out_off, left, 0);
+      if (copied == -1 && !posix_file_copy_refused (errno))
+        goto out;
+      if (copied <= 0)
+        break;
+      left -= copied;
+    }
+
+  if (!left)
+    return nbytes;
+
+  /* copies across filesystems may be refused, sendfile doesn't care */
+  sendfile_off += nbytes - left;
+  if (lseek (posix_dst->fd, dst_off + nbytes - left, SEEK_SET) == -1)
+    goto out;
+
+  while (left)
+    {
+      copied = sendfile (posix_dst->fd, posix_file->fd, &sendfile_off, left);
+      if (copied <= 0)
+        break;
+      left -= copied;
+    }
+
+out:
+  if (left == nbytes)
+    {
+      /* nothing to copy from is not a failure of the copy itself */
+      errno = copied == 0 ? -EINVAL : -errno;
+      return -1;
+    }
+
+  return nbytes - left;
+}
+
+/*
+ * Sends ios[0] out on fd together with the requests of the same type that
+ * follow it in the file, like the blocks of an indirect block walk often
+ * do, as one vectored call. Returns how many requests went out; *ret is set
+ * to -1 if any of them came up short.
+ */
+size_t
+file_fd_submit_run (int fd, file_io_t *ios, size_t nios, int *ret)
+{
+  struct iovec iov[POSIX_SUBMIT_IOVS];
+  ssize_t done;
+  size_t n;
+
+  iov[0].iov_base = ios[0].buf;
+  iov[0].iov_len = ios[0].nbytes;
+
+  for (n = 1; n < nios && n < POSIX_SUBMIT_IOVS; n++)
+    {
+      const file_io_t *prev = ios + n - 1, *io = prev + 1;
+
+      if (io->op != prev->op || io->off != prev->off + prev->nbytes)
+        break;
+
+      iov[n].iov_base = io->buf;
+      iov[n].iov_len = io->nbytes;
+    }
+
+  if (ios[0].op == FILE_IO_READ)
+    done = preadv (fd, iov, n, ios[0].off);
+  else
+    done = pwritev (fd, iov, n, ios[0].off);
+
+  /* a short transfer is charged to the requests at the end */
+  for (size_t j = 0; j < n; j++)
+    {
+      if (done == -1)
+        ios[j].res = -1;
+      else
+        {
+          ios[j].res = (size_t) done < ios[j].nbytes
+                           ? done
+                           : (ssize_t) ios[j].nbytes;
+          done -= ios[j].res;
+        }
+
+      if (ios[j].res != (ssize_t) ios[j].nbytes)
+        *ret = -1;
+    }
+
+  return n;
+}
+
+static int
+posix_file_submit (file_t *file, file_io_t *ios, size_t nios)
+{
+  POSIX_FILE (file);
+  int ret = 0;
+
+  for (size_t i = 0; i < nios;)
+    i += file_fd_submit_run (posix_file->fd, ios + i, nios - i, &ret);
+
+  return ret;
+}
+
+/*
+ * Finds the next data extent of fd at or after off with SEEK_DATA/SEEK_HOLE.
+ * Both move the descriptor's offset, callers that use it put it back.
+ * Filesystems that can't tell report the whole file as one extent.
+ */
+int
+file_fd_next_data (int fd, size_t off, size_t *data, size_t *hole)
+{
+  off_t start, end;
+  struct stat buf;
+
+  start = lseek (fd, off, SEEK_DATA);
+  if (start == -1)
+    {
+      /* ENXIO: only a hole is left from off to the end */
+      if (errno != ENXIO || fstat (fd, &buf) == -1)
+        return -1;
+
+      *data = *hole = (size_t) buf.st_size > off ? (size_t) buf.st_size : off;
+      return 0;
+    }
+
+  end = lseek (fd, start, SEEK_HOLE);
+  if (end == -1)
+    return -1;
+
+  *data = start;
+  *hole = end;
+  return 0;
+}
+
+/* read and write go through the descriptor's offset, so it is kept */
+static int
+posix_file_next_data (file_t *file, size_t off, size_t *data, size_t *hole)
+{
+  POSIX_FILE (file);
+  off_t cur;
+  int ret;
+
+  cur = lseek (posix_file->fd, 0, SEEK_CUR);
+  if (cur == -1)
+    return -1;
+
+  ret = file_fd_next_data (posix_file->fd, off, data, hole);
+  if (lseek (posix_file->fd, cur, SEEK_SET) == -1)
+    return -1;
+
+  return ret;
+}
+
 static void
 posix_file_close (file_t *file)
 {
@@ -231,14 +457,12 @@ posix_dir_readdir (dir_t *dir)
 {
   POSIX_DIR (dir);
   struct dirent *dirent = readdir (posix_dir->dir);
-  dentry_t *ent = malloc (sizeof (dentry_t));
+  dentry_t *ent = &posix_dir->ent;
 
-  if (ent == NULL)
-    {
-      errno = -ENOMEM;
-      return NULL;
-    }
+  if (dirent == NULL)
+    return NULL;
 
+  ent->ino = dirent->d_ino;
   ent->name = dirent->d_name;
 
   switch (dirent->d_type)
@@ -0,0 +1,286 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file.h"
+
+#define MMAP_FILE(file) mmap_file_t *mmap_file = (mmap_file_t *) (file)
+
+/*
+ * A read-only shared mapping of a regular file. Reads are served straight out
+ * of the mapping and map() hands out borrowed pointers into it, so metadata
+ * walks cost no syscalls at all. Writes still go through the descriptor; the
+ * page cache keeps the mapping coherent with them.
+ */
+typedef struct
+{
+  file_t base;
+  file_oflags_t oflags;
+  int fd;
+  unsigned char *addr;
+  size_t size;
+  size_t off;
+} mmap_file_t;
+
+static int mmap_file_get_type (file_t *file, file_type_t *type);
+static int mmap_file_get_size (file_t *file, size_t *size);
+static int mmap_file_seek (file_t *file, size_t off, file_seek_t origin);
+static ssize_t mmap_file_read (file_t *file, void *buf, size_t nbytes);
+static ssize_t mmap_file_write (file_t *file, const void *buf, size_t nbytes);
+static ssize_t mmap_file_pread (file_t *file, void *buf, size_t nbytes,
+                                size_t off);
+static ssize_t mmap_file_pwrite (file_t *file, const void *buf, size_t nbytes,
+                                 size_t off);
+static const void *mmap_file_map (file_t *file, size_t off, size_t nbytes);
+static ssize_t mmap_file_copy_range (file_t *file, size_t off, file_t *dst,
+                                     size_t dst_off, size_t nbytes);
+static int mmap_file_submit (file_t *file, file_io_t *ios, size_t nios);
+static int mmap_file_next_data (file_t *file, size_t off, size_t *data,
+                                size_t *hole);
+static void mmap_file_close (file_t *file);
+
+file_t *
+file_open_mmap (const char *name, file_oflags_t flags)
+{
+  int _flags = 0;
+  mmap_file_t *file;
+  struct stat buf;
+
+  if (flags & FILE_ORDONLY)
+    _flags |= O_RDONLY;
+
+  /* a write-only descriptor cannot back a mapping */
+  if (flags & FILE_OWRONLY)
+    {
+      errno = -EINVAL;
+      return NULL;
+    }
+
+  if (flags & FILE_ORDWR)
+    _flags |= O_RDWR;
+
+  file = malloc (sizeof (mmap_file_t));
+  if (file == NULL)
+    {
+      errno = -ENOMEM;
+      return NULL;
+    }
+
+  memset (file, 0, sizeof (mmap_file_t));
+
+  file->base.get_type = mmap_file_get_type;
+  file->base.get_size = mmap_file_get_size;
+  file->base.seek = mmap_file_seek;
+  file->base.read = mmap_file_read;
+  file->base.write = mmap_file_write;
+  file->base.pread = mmap_file_pread;
+  file->base.pwrite = mmap_file_pwrite;
+  file->base.map = mmap_file_map;
+  file->base.copy_range = mmap_file_copy_range;
+  file->base.submit = mmap_file_submit;
+  file->base.next_data = mmap_file_next_data;
+  file->base.close = mmap_file_close;
+
+  file->oflags = flags;
+  file->fd = open (name, _flags);
+
+  if (file->fd == -1)
+    goto cleanup;
+
+  if (fstat (file->fd, &buf) == -1)
+    goto cleanup;
+
+  if (!S_ISREG (buf.st_mode) || buf.st_size == 0)
+    {
+      errno = -EINVAL;
+      goto cleanup;
+    }
+
+  file->size = buf.st_size;
+  file->addr = mmap (NULL, file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+  if (file->addr == MAP_FAILED)
+    goto cleanup;
+
+  return &file->base;
+
+cleanup:
+  if (file->fd > -1)
+    close (file->fd);
+
+  free (file);
+  return NULL;
+}
+
+static int
+mmap_file_get_type (file_t *file, file_type_t *type)
+{
+  (void) file;
+  *type = FILE_TYPE_FILE;
+  return 0;
+}
+
+static int
+mmap_file_get_size (file_t *file, size_t *size)
+{
+  MMAP_FILE (file);
+  struct stat buf;
+
+  /* the file may have grown past the mapping through write() */
+  if (fstat (mmap_file->fd, &buf) == -1)
+    return -1;
+
+  *size = buf.st_size;
+  return 0;
+}
+
+static int
+mmap_file_seek (file_t *file, size_t off, file_seek_t origin)
+{
+  MMAP_FILE (file);
+  size_t size;
+
+  switch (origin)
+    {
+    case FILE_SEEK_START:
+      mmap_file->off = off;
+      break;
+    case FILE_SEEK_CUR:
+      mmap_file->off += off;
+      break;
+    case FILE_SEEK_END:
+      if (mmap_file_get_size (file, &size) == -1)
+        return -1;
+      mmap_file->off = size + off;
+      break;
+    default:
+      errno = -EINVAL;
+      return -1;
+    }
+
+  return 0;
+}
+
+static ssize_t
+mmap_file_read (file_t *file, void *buf, size_t nbytes)
+{
+  MMAP_FILE (file);
+  ssize_t read = mmap_file_pread (file, buf, nbytes, mmap_file->off);
+
+  if (read > 0)
+    mmap_file->off += read;
+
+  return read;
+}
+
+static ssize_t
+mmap_file_write (file_t *file, const void *buf, size_t nbytes)
+{
+  MMAP_FILE (file);
+  ssize_t written = pwrite (mmap_file->fd, buf, nbytes, mmap_file->off);
+
+  if (written > 0)
+    mmap_file->off += written;
+
+  return written;
+}
+
+static ssize_t
+mmap_file_pread (file_t *file, void *buf, size_t nbytes, size_t off)
+{
+  MMAP_FILE (file);
+
+  /* past the mapping, let the kernel sort out the tail */
+  if (off > mmap_file->size || nbytes > mmap_file->size - off)
+    return pread (mmap_file->fd, buf, nbytes, off);
+
+  memcpy (buf, mmap_file->addr + off, nbytes);
+  return nbytes;
+}
+
+static ssize_t
+mmap_file_pwrite (file_t *file, const void *buf, size_t nbytes, size_t off)
+{
+  MMAP_FILE (file);
+  return pwrite (mmap_file->fd, buf, nbytes, off);
+}
+
+static const void *
+mmap_file_map (file_t *file, size_t off, size_t nbytes)
+{
+  MMAP_FILE (file);
+
+  if (off > mmap_file->size || nbytes > mmap_file->size - off)
+    {
+      errno = -EINVAL;
+      return NULL;
+    }
+
+  return mmap_file->addr + off;
+}
+
+static ssize_t
+mmap_file_copy_range (file_t *file, size_t off, file_t *dst, size_t dst_off,
+                      size_t nbytes)
+{
+  const void *src = mmap_file_map (file, off, nbytes);
+
+  /* the mapping is the source buffer, no bounce copy needed */
+  if (src == NULL)
+    return -1;
+
+  return file_pwrite (dst, src, nbytes, dst_off);
+}
+
+/*
+ * Reads are copies out of the mapping anyway. Writes to neighbouring ranges,
+ * like a sorted batch of dirty metadata blocks, go out as one pwritev.
+ */
+static int
+mmap_file_submit (file_t *file, file_io_t *ios, size_t nios)
+{
+  MMAP_FILE (file);
+  int ret = 0;
+
+  for (size_t i = 0, n; i < nios; i += n)
+    {
+      if (ios[i].op == FILE_IO_READ)
+        {
+          ios[i].res = mmap_file_pread (file, ios[i].buf, ios[i].nbytes,
+                                        ios[i].off);
+          if (ios[i].res != (ssize_t) ios[i].nbytes)
+            ret = -1;
+
+          n = 1;
+          continue;
+        }
+
+      n = file_fd_submit_run (mmap_file->fd, ios + i, nios - i, &ret);
+    }
+
+  return ret;
+}
+
+/* nothing else here uses the descriptor's offset */
+static int
+mmap_file_next_data (file_t *file, size_t off, size_t *data, size_t *hole)
+{
+  MMAP_FILE (file);
+  return file_fd_next_data (mmap_file->fd, off, data, hole);
+}
+
+static void
+mmap_file_close (file_t *file)
+{
+  MMAP_FILE (file);
+
+  munmap (mmap_file->addr, mmap_file->size);
+
+  if (mmap_file->fd > -1)
+    close (mmap_file->fd);
+
+  free (mmap_file);
+}
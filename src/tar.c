@@ -0,0 +1,848 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ext2.h"
+#include "file.h"
+#include "fs.h"
+
+#define USE_ESCAPE_SEQUENCES
+
+#ifdef USE_ESCAPE_SEQUENCES
+
+#define ESC_RESET "\033[0m"
+#define ESC_BOLD  "\033[1m"
+#define ESC_RED   "\033[31m"
+
+#else
+
+#define ESC_RESET
+#define ESC_BOLD
+#define ESC_RED
+
+#endif
+
+#define ALIGN_UP(X, ALIGN) (((X) + ((ALIGN) - 1)) / (ALIGN) * (ALIGN))
+
+#define TAR_BLOCK_SIZE 512
+
+/* archive data is read in pieces this big, a multiple of TAR_BLOCK_SIZE */
+#define TAR_BUF_SIZE (1 << 20)
+
+/* parents are created with rwxr-xr-x when the archive doesn't list them */
+#define TAR_DIR_MODE 0755
+
+static const char *tar_cmd_name = "ext2tar";
+
+typedef struct
+{
+  const char *img;
+  const char *archive; /* NULL for standard input */
+  const char *dst;
+} tar_params_t;
+
+/* ustar header, GNU and pax archives use the same layout */
+typedef struct
+{
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+} tar_header_t;
+
+/* values for the next entry from pax or GNU long name headers */
+typedef struct
+{
+  char *path;
+  char *link;
+  uint64_t size;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t mtime;
+  int has_size;
+  int has_uid;
+  int has_gid;
+  int has_mtime;
+} tar_ext_t;
+
+/* directory attributes are set last, adding entries changes the mtime */
+typedef struct
+{
+  uint32_t ino;
+  uint16_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t mtime;
+} tar_dir_t;
+
+static file_t *img_file = NULL;
+static file_t *in_file = NULL;
+static file_t *dst_file = NULL;
+static fs_t *fs = NULL;
+static char *error_msg = NULL;
+static unsigned char *buf = NULL;
+static tar_ext_t ext = { 0 };
+static char *last_dir = NULL; /* the parent of the previous entry */
+static uint32_t last_dir_ino = 0;
+static tar_dir_t *dirs = NULL;
+static size_t ndirs = 0;
+static size_t dirs_cap = 0;
+
+static void
+tar_ext_reset (void)
+{
+  if (ext.path != NULL)
+    free (ext.path);
+
+  if (ext.link != NULL)
+    free (ext.link);
+
+  memset (&ext, 0, sizeof (tar_ext_t));
+}
+
+static void
+cleanup (void)
+{
+  if (dst_file != NULL)
+    file_close (dst_file);
+
+  if (fs != NULL)
+    ext2_fs_fini (fs);
+
+  if (img_file != NULL)
+    file_close (img_file);
+
+  if (in_file != NULL)
+    file_close (in_file);
+
+  if (buf != NULL)
+    free (buf);
+
+  if (last_dir != NULL)
+    free (last_dir);
+
+  if (dirs != NULL)
+    free (dirs);
+
+  tar_ext_reset ();
+
+  if (error_msg != NULL)
+    free (error_msg);
+}
+
+static void
+fail (const char *fmt, ...)
+{
+  const char *internal_err = "formatting error";
+  char *msg = NULL;
+  int tmp, _errno;
+  va_list args;
+
+  va_start (args, fmt);
+  tmp = vasprintf (&msg, fmt, args);
+  _errno = errno;
+
+  cleanup ();
+
+  if (tmp == -1)
+    goto perror;
+
+  fprintf (stderr, ESC_BOLD "%s: " ESC_RED "error: " ESC_RESET "%s\n",
+           tar_cmd_name, msg);
+
+  va_end (args);
+  exit (1);
+
+perror:
+  if (msg != NULL)
+    free (msg);
+
+  if (_errno == -ENOMEM)
+    internal_err = "out of memory";
+
+  fprintf (stderr, ESC_BOLD "%s: " ESC_RED "error:" ESC_RESET "%s\n",
+           tar_cmd_name, internal_err);
+
+  exit (2);
+}
+
+static void
+usage (void)
+{
+  printf ("Usage: %s [OPTION]... IMAGE [DIRECTORY]\n", tar_cmd_name);
+  printf ("Unpack a tar archive into DIRECTORY (default /) of IMAGE.\n");
+  printf ("\n");
+  printf ("  -f ARCHIVE  read ARCHIVE instead of standard input\n");
+  printf ("  -h          display this help and exit\n");
+}
+
+/* reads until nbytes are in or the archive ends, returns what was read */
+static size_t
+tar_read (void *dst, size_t nbytes)
+{
+  unsigned char *p = dst;
+  size_t done = 0;
+
+  while (done < nbytes)
+    {
+      ssize_t n = file_read (in_file, p + done, nbytes - done);
+
+      if (n == -1)
+        fail ("failed to read archive");
+
+      if (!n)
+        break;
+
+      done += n;
+    }
+
+  return done;
+}
+
+static void
+tar_read_all (void *dst, size_t nbytes)
+{
+  if (tar_read (dst, nbytes) != nbytes)
+    fail ("unexpected end of archive");
+}
+
+static unsigned char *
+tar_buf (void)
+{
+  if (buf == NULL && (buf = malloc (TAR_BUF_SIZE)) == NULL)
+    fail ("out of memory");
+
+  return buf;
+}
+
+static void
+tar_skip (uint64_t nbytes)
+{
+  while (nbytes)
+    {
+      size_t n = nbytes > TAR_BUF_SIZE ? TAR_BUF_SIZE : nbytes;
+
+      tar_read_all (tar_buf (), n);
+      nbytes -= n;
+    }
+}
+
+/* octal, or GNU base-256 with the top bit set for values that don't fit */
+static uint64_t
+tar_number (const char *field, size_t len)
+{
+  uint64_t n = 0;
+  size_t i = 0;
+
+  if ((unsigned char) field[0] & 0x80)
+    {
+      n = field[0] & 0x7f;
+      for (i = 1; i < len; i++)
+        n = n << 8 | (unsigned char) field[i];
+
+      return n;
+    }
+
+  while (i < len && field[i] == ' ')
+    i++;
+
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+    n = n << 3 | (field[i] - '0');
+
+  return n;
+}
+
+static int
+tar_header_valid (const tar_header_t *hdr)
+{
+  const unsigned char *p = (const unsigned char *) hdr;
+  uint64_t sum = 0;
+
+  /* the checksum field itself counts as spaces */
+  for (size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+    sum += i >= offsetof (tar_header_t, chksum)
+                   && i < offsetof (tar_header_t, typeflag)
+               ? ' '
+               : p[i];
+
+  return sum == tar_number (hdr->chksum, sizeof (hdr->chksum));
+}
+
+static int
+tar_header_zero (const tar_header_t *hdr)
+{
+  const unsigned char *p = (const unsigned char *) hdr;
+
+  for (size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+    if (p[i])
+      return 0;
+
+  return 1;
+}
+
+/* the data of a long name header, padding and all */
+static char *
+tar_read_string (uint64_t size)
+{
+  char *str;
+
+  if (size > TAR_BUF_SIZE)
+    fail ("long name header too large");
+
+  str = malloc (size + 1);
+  if (str == NULL)
+    fail ("out of memory");
+
+  tar_read_all (str, size);
+  str[size] = '\0';
+  tar_skip (ALIGN_UP (size, TAR_BLOCK_SIZE) - size);
+
+  return str;
+}
+
+/* pax records are "LEN KEY=VALUE\n", only the keys we store are used */
+static void
+tar_pax (uint64_t size)
+{
+  char *data = tar_read_string (size);
+  char *rec = data, *end = data + size;
+
+  while (rec < end)
+    {
+      char *key, *val, *next;
+      unsigned long len = strtoul (rec, &key, 10);
+
+      if (key == rec || *key != ' ' || !len || len > (size_t) (end - rec))
+        {
+          free (data);
+          fail ("invalid pax header");
+        }
+
+      next = rec + len;
+      next[-1] = '\0';
+      key++;
+
+      val = strchr (key, '=');
+      if (val == NULL)
+        {
+          free (data);
+          fail ("invalid pax header");
+        }
+
+      *val++ = '\0';
+
+      if (!strcmp (key, "path") || !strcmp (key, "linkpath"))
+        {
+          char **dst = key[0] == 'p' ? &ext.path : &ext.link;
+
+          if (*dst != NULL)
+            free (*dst);
+
+          *dst = strdup (val);
+          if (*dst == NULL)
+            {
+              free (data);
+              fail ("out of memory");
+            }
+        }
+      else if (!strcmp (key, "size"))
+        {
+          ext.size = strtoull (val, NULL, 10);
+          ext.has_size = 1;
+        }
+      else if (!strcmp (key, "uid"))
+        {
+          ext.uid = strtoul (val, NULL, 10);
+          ext.has_uid = 1;
+        }
+      else if (!strcmp (key, "gid"))
+        {
+          ext.gid = strtoul (val, NULL, 10);
+          ext.has_gid = 1;
+        }
+      else if (!strcmp (key, "mtime"))
+        {
+          /* fractional seconds are dropped */
+          ext.mtime = strtoull (val, NULL, 10);
+          ext.has_mtime = 1;
+        }
+
+      rec = next;
+    }
+
+  free (data);
+}
+
+/*
+ * Turns an archive path into one relative to the destination, without
+ * leading slashes, "." or empty parts. The destination itself is "".
+ */
+static char *
+tar_clean_path (const char *path)
+{
+  char *clean = malloc (strlen (path) + 1);
+  size_t len = 0;
+
+  if (clean == NULL)
+    fail ("out of memory");
+
+  while (*path)
+    {
+      const char *end = strchrnul (path, '/');
+      size_t n = end - path;
+
+      if (n == 2 && path[0] == '.' && path[1] == '.')
+        {
+          free (clean);
+          fail ("refusing path with '..'");
+        }
+
+      if (n && !(n == 1 && path[0] == '.'))
+        {
+          if (len)
+            clean[len++] = '/';
+
+          memcpy (clean + len, path, n);
+          len += n;
+        }
+
+      path = *end ? end + 1 : end;
+    }
+
+  clean[len] = '\0';
+  return clean;
+}
+
+static char *
+tar_join (const char *dir, const char *rel)
+{
+  char *path;
+
+  if (asprintf (&path, "%s%s%s", dir,
+                rel[0] && dir[strlen (dir) - 1] != '/' ? "/" : "", rel)
+      == -1)
+    fail ("out of memory");
+
+  return path;
+}
+
+/* looks up a directory below the destination, creating what is missing */
+static uint32_t
+tar_dir (const tar_params_t *params, const char *rel)
+{
+  ext2_fs_t *ext2 = fs->data;
+  char *path = tar_join (params->dst, rel);
+  size_t base = strlen (path) - strlen (rel);
+  uint32_t ino;
+
+  /* entries come grouped by directory, most share their parent */
+  if (last_dir != NULL && !strcmp (last_dir, rel))
+    {
+      free (path);
+      return last_dir_ino;
+    }
+
+  if (ext2_namei (ext2, path, &ino) == -1)
+    {
+      if (errno != -ENOENT)
+        fail ("cannot stat '%s'", path);
+
+      if (ext2_namei (ext2, params->dst, &ino) == -1)
+        fail ("cannot stat '%s'", params->dst);
+
+      for (char *part = path + base; *part;)
+        {
+          char *end = strchrnul (part, '/');
+          char saved = *end;
+          uint32_t next;
+
+          *end = '\0';
+          if (ext2_namei (ext2, path, &next) == -1)
+            {
+              if (errno != -ENOENT
+                  || ext2_mkdir (ext2, ino, part, TAR_DIR_MODE, &next) == -1)
+                fail ("cannot create directory '%s'", path);
+            }
+          *end = saved;
+
+          ino = next;
+          part = saved ? end + 1 : end;
+        }
+    }
+
+  free (path);
+
+  if (last_dir != NULL)
+    free (last_dir);
+
+  last_dir = strdup (rel);
+  if (last_dir == NULL)
+    fail ("out of memory");
+
+  last_dir_ino = ino;
+  return ino;
+}
+
+static void
+tar_dir_later (uint32_t ino, uint16_t mode, uint32_t uid, uint32_t gid,
+               uint32_t mtime)
+{
+  if (ndirs == dirs_cap)
+    {
+      size_t cap = dirs_cap ? dirs_cap * 2 : 64;
+      tar_dir_t *grown = realloc (dirs, cap * sizeof (tar_dir_t));
+
+      if (grown == NULL)
+        fail ("out of memory");
+
+      dirs = grown;
+      dirs_cap = cap;
+    }
+
+  dirs[ndirs].ino = ino;
+  dirs[ndirs].mode = mode;
+  dirs[ndirs].uid = uid;
+  dirs[ndirs].gid = gid;
+  dirs[ndirs].mtime = mtime;
+  ndirs++;
+}
+
+/* streams the entry's data straight from the archive into a new file */
+static uint32_t
+tar_file (uint32_t dir_ino, const char *name, const char *path, uint16_t mode,
+          uint64_t size)
+{
+  ext2_fs_t *ext2 = fs->data;
+  uint64_t left = ALIGN_UP (size, TAR_BLOCK_SIZE);
+  uint32_t ino;
+
+  dst_file = ext2_file_create (ext2, dir_ino, name,
+                               EXT2_INODE_TYPE_REG_FILE | mode);
+  if (dst_file == NULL)
+    {
+      if (errno == -EEXIST)
+        fail ("cannot create '%s': file exists", path);
+      if (errno == -ENOSPC)
+        fail ("cannot create '%s': no space left on image", path);
+      fail ("cannot create '%s'", path);
+    }
+
+  /* one contiguous run for the whole file, if the image has one */
+  if (ext2_file_reserve (dst_file, size) == -1 && errno != -ENOSPC)
+    fail ("failed to allocate blocks for '%s'", path);
+
+  for (uint64_t off = 0; left; off += TAR_BUF_SIZE)
+    {
+      size_t n = left > TAR_BUF_SIZE ? TAR_BUF_SIZE : left;
+      size_t data = size - off > n ? n : size - off;
+
+      tar_read_all (tar_buf (), n);
+      left -= n;
+
+      if (file_pwrite (dst_file, buf, data, off) != (ssize_t) data)
+        {
+          if (errno == -ENOSPC)
+            fail ("failed to write '%s': no space left on image", path);
+          fail ("failed to write '%s'", path);
+        }
+    }
+
+  ino = ext2_file_ino (dst_file);
+  file_close (dst_file);
+  dst_file = NULL;
+  return ino;
+}
+
+static void
+tar_entry (const tar_params_t *params, const tar_header_t *hdr)
+{
+  ext2_fs_t *ext2 = fs->data;
+  uint64_t size = ext.has_size ? ext.size
+                               : tar_number (hdr->size, sizeof (hdr->size));
+  uint16_t mode = tar_number (hdr->mode, sizeof (hdr->mode)) & 07777;
+  uint32_t uid = ext.has_uid ? ext.uid
+                             : tar_number (hdr->uid, sizeof (hdr->uid));
+  uint32_t gid = ext.has_gid ? ext.gid
+                             : tar_number (hdr->gid, sizeof (hdr->gid));
+  uint32_t mtime = ext.has_mtime
+                       ? ext.mtime
+                       : tar_number (hdr->mtime, sizeof (hdr->mtime));
+  char name[sizeof (hdr->prefix) + 1 + sizeof (hdr->name) + 1];
+  char link[sizeof (hdr->linkname) + 1];
+  char *rel, *path, *base;
+  uint32_t dir_ino, ino;
+
+  /* POSIX ustar splits long names over prefix and name, GNU doesn't */
+  if (!memcmp (hdr->magic, "ustar", 6) && hdr->prefix[0])
+    snprintf (name, sizeof (name), "%.*s/%.*s", (int) sizeof (hdr->prefix),
+              hdr->prefix, (int) sizeof (hdr->name), hdr->name);
+  else
+    snprintf (name, sizeof (name), "%.*s", (int) sizeof (hdr->name),
+              hdr->name);
+
+  snprintf (link, sizeof (link), "%.*s", (int) sizeof (hdr->linkname),
+            hdr->linkname);
+
+  rel = tar_clean_path (ext.path != NULL ? ext.path : name);
+  path = tar_join (params->dst, rel);
+
+  /* the destination itself, as "./" in most archives */
+  if (!rel[0])
+    {
+      if (hdr->typeflag != '5' || ext2_namei (ext2, path, &ino) == -1)
+        fail ("cannot unpack '%s'", path);
+
+      tar_dir_later (ino, mode, uid, gid, mtime);
+      tar_skip (ALIGN_UP (size, TAR_BLOCK_SIZE));
+      free (rel);
+      free (path);
+      return;
+    }
+
+  base = strrchr (rel, '/');
+  if (base != NULL)
+    {
+      *base++ = '\0';
+      dir_ino = tar_dir (params, rel);
+    }
+  else
+    {
+      base = rel;
+      dir_ino = tar_dir (params, "");
+    }
+
+  switch (hdr->typeflag)
+    {
+    case '0':
+    case '\0':
+    case '7':
+      ino = tar_file (dir_ino, base, path, mode, size);
+      size = 0;
+      break;
+    case '1':
+      {
+        char *target = tar_clean_path (ext.link != NULL ? ext.link : link);
+        char *target_path = tar_join (params->dst, target);
+
+        free (target);
+        if (ext2_namei (ext2, target_path, &ino) == -1
+            || ext2_link (ext2, dir_ino, base, ino) == -1)
+          {
+            free (target_path);
+            fail ("cannot link '%s'", path);
+          }
+
+        free (target_path);
+        break;
+      }
+    case '2':
+      if (ext2_symlink (ext2, dir_ino, base,
+                        ext.link != NULL ? ext.link : link, &ino)
+          == -1)
+        fail ("cannot create symbolic link '%s'", path);
+      mode = 0777;
+      break;
+    case '3':
+    case '4':
+    case '6':
+      if (ext2_mknod (ext2, dir_ino, base,
+                      (hdr->typeflag == '3'   ? EXT2_INODE_TYPE_CHR_DEV
+                       : hdr->typeflag == '4' ? EXT2_INODE_TYPE_BLK_DEV
+                                              : EXT2_INODE_TYPE_FIFO)
+                          | mode,
+                      tar_number (hdr->devmajor, sizeof (hdr->devmajor)),
+                      tar_number (hdr->devminor, sizeof (hdr->devminor)),
+                      &ino)
+          == -1)
+        fail ("cannot create '%s'", path);
+      break;
+    case '5':
+      /* an existing directory, say from an earlier entry, is reused */
+      if (ext2_namei (ext2, path, &ino) == -1
+          && (errno != -ENOENT
+              || ext2_mkdir (ext2, dir_ino, base, mode, &ino) == -1))
+        fail ("cannot create directory '%s'", path);
+
+      tar_dir_later (ino, mode, uid, gid, mtime);
+      tar_skip (ALIGN_UP (size, TAR_BLOCK_SIZE));
+      free (rel);
+      free (path);
+      return;
+    default:
+      fail ("unsupported entry type '%c': '%s'", hdr->typeflag, path);
+    }
+
+  /* a hard link's own attributes are those of its target */
+  if (hdr->typeflag != '1' && ext2_setattr (ext2, ino, mode, uid, gid, mtime)
+      == -1)
+    fail ("cannot set attributes of '%s'", path);
+
+  tar_skip (ALIGN_UP (size, TAR_BLOCK_SIZE));
+  free (rel);
+  free (path);
+}
+
+static void
+tar_op (const tar_params_t *params)
+{
+  fs_init_error_t error;
+  ext2_fs_t *ext2;
+  tar_header_t hdr;
+  uint32_t ino;
+
+  /* prefer the mapped backend, plain reads are the fallback */
+  img_file = file_open_mmap (params->img, FILE_ORDWR);
+  if (img_file == NULL)
+    img_file = file_open (params->img, FILE_ORDWR);
+  if (img_file == NULL)
+    fail ("failed to open image file: '%s'", params->img);
+
+  in_file = file_open (params->archive != NULL ? params->archive
+                                               : "/dev/stdin",
+                       FILE_ORDONLY);
+  if (in_file == NULL)
+    fail ("failed to open archive: '%s'",
+          params->archive != NULL ? params->archive : "-");
+
+  if (params->dst[0] != '/')
+    fail ("destination must be absolute path");
+
+  fs = ext2_fs_init (img_file, &error);
+  if (fs == NULL)
+    {
+      if (error.allocated)
+        error_msg = error.alloc_error;
+      fail ("%s", error.const_error);
+    }
+
+  ext2 = fs->data;
+
+  if (ext2_namei (ext2, params->dst, &ino) == -1)
+    fail ("cannot stat '%s'", params->dst);
+
+  for (;;)
+    {
+      size_t n = tar_read (&hdr, sizeof (hdr));
+      uint64_t size;
+
+      /* two zero blocks end the archive, a missing trailer is let go */
+      if (!n || (n == sizeof (hdr) && tar_header_zero (&hdr)))
+        break;
+
+      if (n != sizeof (hdr))
+        fail ("unexpected end of archive");
+
+      if (!tar_header_valid (&hdr))
+        fail ("invalid tar header");
+
+      size = tar_number (hdr.size, sizeof (hdr.size));
+
+      switch (hdr.typeflag)
+        {
+        case 'L':
+          if (ext.path != NULL)
+            free (ext.path);
+          ext.path = tar_read_string (size);
+          break;
+        case 'K':
+          if (ext.link != NULL)
+            free (ext.link);
+          ext.link = tar_read_string (size);
+          break;
+        case 'x':
+          tar_pax (size);
+          break;
+        case 'g':
+          /* global pax headers carry nothing we keep */
+          tar_skip (ALIGN_UP (size, TAR_BLOCK_SIZE));
+          break;
+        default:
+          tar_entry (params, &hdr);
+          tar_ext_reset ();
+        }
+    }
+
+  for (size_t i = ndirs; i--;)
+    if (ext2_setattr (ext2, dirs[i].ino, dirs[i].mode, dirs[i].uid,
+                      dirs[i].gid, dirs[i].mtime)
+        == -1)
+      fail ("cannot set attributes of directory %u", dirs[i].ino);
+
+  if (ext2_fs_sync (ext2) == -1)
+    fail ("failed to write metadata to image");
+
+  cleanup ();
+}
+
+int
+main (int argc, const char **argv)
+{
+  tar_params_t params = { 0 };
+
+  for (int argn = 1; argn < argc; argn++)
+    {
+      const char *arg = argv[argn];
+
+      if (arg[0] == '-' && arg[1] != '\0')
+        {
+          switch (arg[1])
+            {
+            case 'h':
+              usage ();
+              exit (0);
+            case 'f':
+              /* -fARCHIVE or -f ARCHIVE */
+              if (arg[2] != '\0')
+                params.archive = arg + 2;
+              else if (argn + 1 < argc)
+                params.archive = argv[++argn];
+              else
+                fail ("option 'f' requires an argument");
+
+              if (!strcmp (params.archive, "-"))
+                params.archive = NULL;
+              break;
+            default:
+              fail ("invalid option '%c'", arg[1]);
+            }
+          continue;
+        }
+
+      if (params.img == NULL)
+        params.img = arg;
+      else if (params.dst == NULL)
+        params.dst = arg;
+      else
+        fail ("extra operand '%s'", arg);
+    }
+
+  if (params.img == NULL)
+    fail ("missing image operand");
+
+  if (params.dst == NULL)
+    params.dst = "/";
+
+  assert (params.img && params.dst);
+
+  tar_op (&params);
+
+  return 0;
+}